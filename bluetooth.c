@@ -18,11 +18,17 @@
 
 #include "pvlogger.h"
 #include "logging.h"
+#include "hdlc.h"
+#include "engine.h"
+#include "capture.h"
+#include <errno.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 /*
  * Recalculate and update length to correct for escapes
@@ -50,91 +56,226 @@ fix_length_received(unsigned char *received, int *len)
     }
 }
 
-int
-read_bluetooth(time_t const bt_timeout, int const sfd, int *rr, unsigned char *received, int cc, unsigned char *last_sent, int *terminated )
+void
+bt_reader_init(bt_reader_p self, int const sfd)
 {
-    int bytes_read,i;
-    unsigned char buf[1024]; /*read buffer*/
-    unsigned char header[3]; /*read buffer*/
-    struct timeval tv;
-    fd_set readfds;
+    self->sfd = sfd;
+    self->start = 0;
+    self->len = 0;
+}
+
+/*
+ * Copy len bytes starting at offset from the ring into dest
+ */
+static void
+bt_reader_copy(bt_reader_p self, int offset, unsigned char *dest, int len)
+{
+    int pos = (self->start + offset) & (BT_READER_SIZE - 1);
+    int first = BT_READER_SIZE - pos;
 
-    tv.tv_sec = bt_timeout; // set timeout of reading
-    tv.tv_usec = 0;
-    memset(buf,0,1024);
+    if( first > len )
+        first = len;
+    memcpy(dest, self->buf + pos, first);
+    memcpy(dest + first, self->buf, len - first);
+}
 
-    FD_ZERO(&readfds);
-    FD_SET((sfd), &readfds);
+static unsigned char
+bt_reader_byte(bt_reader_p self, int offset)
+{
+    return self->buf[(self->start + offset) & (BT_READER_SIZE - 1)];
+}
 
-    select((sfd)+1, &readfds, NULL, NULL, &tv);
+static void
+bt_reader_consume(bt_reader_p self, int len)
+{
+    self->start = (self->start + len) & (BT_READER_SIZE - 1);
+    self->len -= len;
+}
 
-    (*terminated) = 0; // Tag to tell if string has 7e termination
-    // first read the header to get the record length
-    if (FD_ISSET((sfd), &readfds)){     // did we receive anything within 5 seconds
-        bytes_read = recv((sfd), header, sizeof(header), 0); //Get length of string
-        (*rr) = 0;
-        for( i=0; i<sizeof(header); i++ ) {
-            received[(*rr)] = header[i];
-//            log_trace("%02x ", received[i]);
-            (*rr)++;
+/*
+ * Wait up to timeout_ms for data and pull whatever the kernel has in one read(),
+ * which takes a pty as well as a socket. Other sessions run while this one waits.
+ * Returns the number of bytes added, -1 on timeout or error.
+ */
+static int
+bt_reader_fill(bt_reader_p self, long const timeout_ms)
+{
+    int end, space, bytes_read;
+
+    if( engine_wait(self->sfd, EPOLLIN, timeout_ms) < 0 )
+        return -1;
+
+    // read into the free space up to the end of the ring, the next call fills the rest
+    end = (self->start + self->len) & (BT_READER_SIZE - 1);
+    space = BT_READER_SIZE - self->len;
+    if( space > BT_READER_SIZE - end )
+        space = BT_READER_SIZE - end;
+    if( space == 0 )
+        return 0;
+    bytes_read = read(self->sfd, self->buf + end, space);
+    if(( bytes_read < 0 )&&(( errno == EAGAIN )||( errno == EWOULDBLOCK )))
+        return 0;
+    if( bytes_read <= 0 ) {
+        log_warning("Bluetooth connection closed or failed");
+        return -1;
+    }
+    self->len += bytes_read;
+    return bytes_read;
+}
+
+/*
+ * Get the next complete packet from the socket into frame.
+ * A packet starts with 7e, a two byte length and a check byte, the length
+ * covers the whole packet as sent, ie. still escaped.
+ * Returns the packet length, -1 on timeout.
+ */
+int
+bt_reader_frame(bt_reader_p self, long const timeout_ms, unsigned char *frame, int const size)
+{
+    struct timeval now, deadline;
+    long remaining_ms;
+    int length;
+
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_usec += (timeout_ms % 1000) * 1000;
+    if( deadline.tv_usec >= 1000000 ) {
+        deadline.tv_sec++;
+        deadline.tv_usec -= 1000000;
+    }
+
+    for(;;) {
+        // skip anything that is not the start of a packet
+        while(( self->len >= 4 )
+              &&(( bt_reader_byte(self, 0) != 0x7e )
+                 ||( bt_reader_byte(self, 3) != ( bt_reader_byte(self, 0) ^ bt_reader_byte(self, 1) ^ bt_reader_byte(self, 2) )))) {
+            log_debug("Skipping [%02x] looking for start of packet", bt_reader_byte(self, 0));
+            bt_reader_consume(self, 1);
+        }
+        if( self->len >= 4 ) {
+            length = bt_reader_byte(self, 1) + bt_reader_byte(self, 2) * 256;
+            if(( length < 4 )||( length > size )) {
+                log_warning("Bad packet length [%d]", length);
+                bt_reader_consume(self, 1);
+                continue;
+            }
+            if( self->len >= length ) {
+                bt_reader_copy(self, 0, frame, length);
+                bt_reader_consume(self, length);
+                if( capture )
+                    capture_frame(capture, cd_received, self->sfd, frame, length);
+                return length;
+            }
         }
+        gettimeofday(&now, NULL);
+        remaining_ms = (deadline.tv_sec - now.tv_sec) * 1000
+                     + (deadline.tv_usec - now.tv_usec) / 1000;
+        if(( remaining_ms < 0 )||( bt_reader_fill(self, remaining_ms) < 0 ))
+            return -1;
     }
-    else
+}
+
+/*
+ * Throw away what has been received and whatever else comes in until the
+ * link has been quiet for quiet_ms, such as replies to requests given up on.
+ * Returns the number of bytes thrown away.
+ */
+int
+bt_reader_drain(bt_reader_p self, long const quiet_ms)
+{
+    int dropped = 0;
+
+    do {
+        dropped += self->len;
+        self->start = 0;
+        self->len = 0;
+    } while( bt_reader_fill(self, quiet_ms) >= 0 );
+    return dropped;
+}
+
+int
+read_bluetooth_ms(long const timeout_ms, bt_reader_p reader, int *rr, unsigned char *received, int cc, unsigned char *last_sent, int *terminated )
+{
+    int bytes_read;
+    unsigned char buf[1024]; /*read buffer*/
+
+    (*terminated) = 0; // Tag to tell if string has 7e termination
+    bytes_read = bt_reader_frame(reader, timeout_ms, buf, sizeof(buf));
+    if( bytes_read < 0 )
     {
        log_warning("Timeout reading bluetooth socket");
        (*rr) = 0;
        memset(received,0,1024);
        return -1;
     }
-    if (FD_ISSET((sfd), &readfds)){     // did we receive anything within 5 seconds
-        bytes_read = recv((sfd), buf, header[1]-3, 0); //Read the length specified by header
+    hlog_debug("Receiving - header", buf, 3, 12);
+    hlog_debug("Receiving - body  ", buf+3, bytes_read-3, 0);
+
+    if ((cc==bytes_read)&&(memcmp(buf,last_sent,cc) == 0)){
+       log_error( "ERROR received what we sent!" );
+       abort();
+       //Need to do something
     }
+    if( buf[ bytes_read-1 ] == 0x7e )
+       (*terminated) = 1;
     else
+       (*terminated) = 0;
+    // the header is copied as is, the rest is unescaped
+    memcpy(received, buf, 3);
+    (*rr) = 3 + hdlc_unescape(received+3, buf+3, bytes_read-3);
+    // a whole PPP frame in this packet, check it before anyone uses it. The
+    // last packet of a longer frame has no 7e at 18, CloseStream checks it
+    // with the rest and will not read a frame whose first packet is missing
+    if( (*terminated) && (*rr) > 22
+        && buf[18] == HDLC_FLAG && received[18] == HDLC_FLAG
+        && !hdlc_fcs16_good(received+19, (*rr)-20) )
     {
-       log_warning("Timeout reading bluetooth socket");
+       log_warning("FCS error in received frame");
+       hlog_debug("Bad frame", received, *rr, 0);
        (*rr) = 0;
        memset(received,0,1024);
        return -1;
     }
-    if ( bytes_read > 0){
-        hlog_debug("Receiving - header", header, sizeof(header), 12);
-        hlog_debug("Receiving - body  ", buf, bytes_read, 0);
-
-        if ((cc==bytes_read)&&(memcmp(received,last_sent,cc) == 0)){
-           log_error( "ERROR received what we sent!" );
-           abort();
-           //Need to do something
-        }
-        if( buf[ bytes_read-1 ] == 0x7e )
-           (*terminated) = 1;
-        else
-           (*terminated) = 0;
-        for (i=0;i<bytes_read;i++){ //start copy the rec buffer in to received
-            if (buf[i] == 0x7d){ //did we receive the escape char
-                switch (buf[i+1]){   // act depending on the char after the escape char
-
-                    case 0x5e :
-                        received[(*rr)] = 0x7e;
-                        break;
-
-                    case 0x5d :
-                        received[(*rr)] = 0x7d;
-                        break;
-
-                    default :
-                        received[(*rr)] = buf[i+1] ^ 0x20;
-                        break;
-                }
-                    i++;
+    fix_length_received( received, rr );
+    hlog_trace("received", received, *rr, 0);
+    return 0;
+}
+
+int
+read_bluetooth(time_t const bt_timeout, bt_reader_p reader, int *rr, unsigned char *received, int cc, unsigned char *last_sent, int *terminated )
+{
+    return read_bluetooth_ms(bt_timeout * 1000L, reader, rr, received, cc, last_sent, terminated);
+}
+
+/*
+ * Send len bytes, waiting at most timeout_ms whenever the socket is full.
+ * The descriptor must not block, it may also be a pty.
+ * Returns 0 on success, -1 if the link failed or stayed full.
+ */
+int
+write_bluetooth(int const sfd, unsigned char const *buf, int len, long const timeout_ms)
+{
+    int sent;
+
+    if( capture )
+        capture_frame(capture, cd_sent, sfd, buf, len);
+    while( len > 0 ) {
+        sent = send(sfd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(( sent < 0 )&&( errno == ENOTSOCK ))
+            sent = write(sfd, buf, len);        // a pty
+        if( sent < 0 ) {
+            if(( errno != EAGAIN )&&( errno != EWOULDBLOCK )&&( errno != EINTR )) {
+                log_warning("Bluetooth send failed. %s", strerror(errno));
+                return -1;
             }
-            else {
-               received[(*rr)] = buf[i];
+            if( engine_wait(sfd, EPOLLOUT, timeout_ms) < 0 ) {
+                log_warning("Timeout writing bluetooth socket");
+                return -1;
             }
-//            log_trace("%02x ", received[(*rr)]);
-            (*rr)++;
+            continue;
         }
-        fix_length_received( received, rr );
-        log_trace("received", received, *rr, 0);
+        buf += sent;
+        len -= sent;
     }
     return 0;
 }
@@ -0,0 +1,269 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Writes and reads capture files, and plays them back to a poller.
+ */
+#include "capture.h"
+#include "logging.h"
+#include "engine.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+capture_p capture = 0;
+
+/* Kernel buffer of the replay socket, small so the replay keeps pace
+ * with what the poller reads and its timing tells the decode rate. */
+#define CAPTURE_REPLAY_BUFFER 8192
+/* How long the poller may take to read on before the replay gives up. */
+#define CAPTURE_REPLAY_TIMEOUT_MS 30000
+
+static void put_le(unsigned char * p, uint32_t v, int len)
+{
+        int i;
+        for( i=0; i<len; i++, v >>= 8 )
+                p[i] = v & 0xff;
+}
+
+static uint32_t get_le(unsigned char const * p, int len)
+{
+        uint32_t v = 0;
+        while( len-- > 0 )
+                v = ( v << 8 ) | p[len];
+        return v;
+}
+
+capture_p capture_constructor(char const * path, char const * mode)
+{
+        capture_p self;
+        char magic[CAPTURE_MAGIC_LEN];
+        int const writing = ( mode[0] == 'w' );
+
+        self = (capture_p)calloc(1, sizeof(capture_t));
+        if( self == 0 )
+                return 0;
+        self->writing = writing;
+        memset(self->link_fd, -1, sizeof(self->link_fd));
+        self->file = fopen(path, writing ? "wb" : "rb");
+        if( self->file == 0 ) {
+                log_error("Cannot open capture %s. %s", path, strerror(errno));
+                free(self);
+                return 0;
+        }
+        if( writing )
+                fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, self->file);
+        else if(( fread(magic, 1, CAPTURE_MAGIC_LEN, self->file)
+                  != CAPTURE_MAGIC_LEN )
+                ||( memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0 )) {
+                log_error("%s is not a capture", path);
+                fclose(self->file);
+                free(self);
+                return 0;
+        }
+        return self;
+}
+
+void capture_destructor(capture_p self)
+{
+        if( self == 0 )
+                return;
+        if( self->writing )
+                log_info("Captured %lu packets, %llu bytes",
+                         self->frames, self->bytes);
+        fclose(self->file);
+        free(self);
+}
+
+void capture_connection(capture_p self, int fd)
+{
+        int const slot = self->connections % CAPTURE_LINKS;
+        int i;
+
+        // the socket of a closed connection is often the next one's
+        for( i=0; i<CAPTURE_LINKS; i++ )
+                if( self->link_fd[i] == fd )
+                        self->link_fd[i] = -1;
+        self->link_fd[slot] = fd;
+        self->link_channel[slot] = self->connections++;
+}
+
+void capture_frame(capture_p self, capture_dir_t dir, int fd,
+                void const * data, int len)
+{
+        unsigned char header[CAPTURE_HEADER_LEN];
+        struct timeval now;
+        int i;
+
+        for( i=0; i<CAPTURE_LINKS && self->link_fd[i] != fd; i++ )
+                ;
+        if( i == CAPTURE_LINKS ) {
+                capture_connection(self, fd);
+                i = ( self->connections - 1 ) % CAPTURE_LINKS;
+        }
+
+        gettimeofday(&now, 0);
+        put_le(header, now.tv_sec, 4);
+        put_le(header + 4, now.tv_usec, 4);
+        put_le(header + 8, len, 2);
+        header[10] = dir;
+        header[11] = self->link_channel[i];
+        fwrite(header, 1, CAPTURE_HEADER_LEN, self->file);
+        fwrite(data, 1, len, self->file);
+        self->frames++;
+        self->bytes += len;
+}
+
+int capture_next(capture_p self, capture_dir_t * dir, int * channel,
+                struct timeval * when, unsigned char * data, int size)
+{
+        unsigned char header[CAPTURE_HEADER_LEN];
+        size_t got;
+        int len;
+
+        got = fread(header, 1, CAPTURE_HEADER_LEN, self->file);
+        if( got == 0 && feof(self->file) )
+                return 0;
+        if( got != CAPTURE_HEADER_LEN )
+                return -1;
+        len = get_le(header + 8, 2);
+        if(( len == 0 )||( len > size )
+           ||( fread(data, 1, len, self->file) != (size_t)len ))
+                return -1;
+        if( when ) {
+                when->tv_sec = get_le(header, 4);
+                when->tv_usec = get_le(header + 4, 4);
+        }
+        *dir = header[10];
+        *channel = header[11];
+        self->frames++;
+        self->bytes += len;
+        return len;
+}
+
+struct replay_struct
+{
+        capture_p capture;
+        int fd;
+        int connection;
+};
+
+/* Reads and drops what the poller sent. */
+static void replay_drain(int fd)
+{
+        unsigned char buf[CAPTURE_FRAME_MAX];
+        while( recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0 )
+                ;
+}
+
+static void replay_task(void * arg)
+{
+        struct replay_struct * const replay = (struct replay_struct *)arg;
+        unsigned char frame[CAPTURE_FRAME_MAX];
+        int len, channel, sent, off;
+        capture_dir_t dir;
+        struct timeval start, end;
+        unsigned long frames = 0;
+        unsigned long long bytes = 0;
+        double secs;
+
+        gettimeofday(&start, 0);
+        while(( len = capture_next(replay->capture, &dir, &channel, 0,
+                                   frame, sizeof(frame))) > 0 ) {
+                if(( dir != cd_received )
+                   ||( channel != ( replay->connection & 0xff )))
+                        continue;
+                for( off=0; off<len; off+=sent ) {
+                        replay_drain(replay->fd);
+                        sent = send(replay->fd, frame + off, len - off,
+                                    MSG_DONTWAIT | MSG_NOSIGNAL);
+                        if( sent >= 0 )
+                                continue;
+                        sent = 0;
+                        if(( errno != EAGAIN )&&( errno != EWOULDBLOCK ))
+                                goto done;
+                        if( engine_wait(replay->fd, EPOLLIN | EPOLLOUT,
+                                        CAPTURE_REPLAY_TIMEOUT_MS) < 0 ) {
+                                log_warning("Replay stalled, the poller stopped reading");
+                                goto done;
+                        }
+                }
+                frames++;
+                bytes += len;
+        }
+        if( len < 0 )
+                log_error("Capture is broken after %lu packets",
+                          replay->capture->frames);
+done:
+        gettimeofday(&end, 0);
+        secs = ( end.tv_sec - start.tv_sec )
+             + ( end.tv_usec - start.tv_usec ) / 1e6;
+        log_info("Replayed %lu packets, %llu bytes in %.3f s, %.2f MB/s",
+                 frames, bytes, secs, secs > 0 ? bytes / secs / 1e6 : 0.0);
+        // the poller reads to the end, then finds the link closed
+        shutdown(replay->fd, SHUT_WR);
+        close(replay->fd);
+        capture_destructor(replay->capture);
+        free(replay);
+}
+
+int capture_replay(char const * path, int connection, int * peer)
+{
+        struct replay_struct * replay;
+        int sv[2];
+        int const size = CAPTURE_REPLAY_BUFFER;
+
+        if( engine_running() == 0 ) {
+                log_error("A replay runs only in a task of the engine");
+                return -1;
+        }
+        replay = (struct replay_struct *)calloc(1, sizeof(*replay));
+        if( replay == 0 )
+                return -1;
+        replay->connection = connection;
+        if(( replay->capture = capture_constructor(path, "r")) == 0 ) {
+                free(replay);
+                return -1;
+        }
+        if( socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0 ) {
+                log_error("Cannot create replay socket. %s", strerror(errno));
+                goto failed;
+        }
+        setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        // the task has its own descriptor, the poller's end stays open
+        // for what it sends until it closes both
+        if(( replay->fd = dup(sv[1])) < 0 ) {
+                close(sv[0]);
+                close(sv[1]);
+                goto failed;
+        }
+        if( engine_spawn(engine_running(), replay_task, replay) < 0 ) {
+                close(replay->fd);
+                close(sv[0]);
+                close(sv[1]);
+                goto failed;
+        }
+        *peer = sv[1];
+        return sv[0];
+failed:
+        capture_destructor(replay->capture);
+        free(replay);
+        return -1;
+}
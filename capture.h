@@ -0,0 +1,96 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/*
+ * Capture files hold the packets exchanged with the inverters as they
+ * went over the link, still escaped. The file starts with CAPTURE_MAGIC
+ * followed by one record per packet: a header of CAPTURE_HEADER_LEN bytes,
+ * little endian,
+ *      u32 seconds, u32 microseconds   when it was sent or received
+ *      u16 length                      of the packet that follows
+ *      u8  direction                   cd_received or cd_sent
+ *      u8  channel                     the connection it went over
+ * and the packet itself. Connections are numbered in the order they were
+ * made, modulo 256, so a reconnect that gets the same socket back is told
+ * apart from the connection before it.
+ *
+ * A capture is replayed over a socketpair: a task of the engine plays
+ * the inverter and sends the packets received on one channel, as fast as
+ * they are read, while what the poller sends is read and dropped.
+ */
+
+#include "pvlogger.h"
+#include <stdio.h>
+#include <sys/time.h>
+
+#define CAPTURE_MAGIC "SMACAP1\n"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_HEADER_LEN 12
+/* Largest packet, that of bt_reader_frame(). */
+#define CAPTURE_FRAME_MAX 1024
+/* Connections open at once that a capture tells apart. */
+#define CAPTURE_LINKS 16
+
+enum capture_dir_enum {
+        cd_received,
+        cd_sent
+};
+typedef enum capture_dir_enum capture_dir_t;
+
+struct capture_struct
+{
+        FILE * file;
+        int writing;
+        unsigned long frames;
+        unsigned long long bytes;
+        /* Connections numbered so far, and the socket and number of the
+         * latest ones, by number modulo CAPTURE_LINKS. */
+        int connections;
+        int link_fd[CAPTURE_LINKS];
+        int link_channel[CAPTURE_LINKS];
+};
+typedef struct capture_struct capture_t;
+typedef capture_t * capture_p;
+
+/* Opens path for writing a capture (mode "w") or reading one ("r").
+ * Returns 0 if it cannot be opened or is no capture. */
+capture_p capture_constructor(char const * path, char const * mode);
+void capture_destructor(capture_p self);
+
+/* Numbers a new connection on socket fd. Its packets go under that
+ * number until fd is numbered again. */
+void capture_connection(capture_p self, int fd);
+
+/* Adds a packet sent or received on socket fd. A socket that was never
+ * numbered is numbered now. */
+void capture_frame(capture_p self, capture_dir_t dir, int fd,
+                void const * data, int len);
+
+/* Reads the next packet into data. Returns its length, 0 at the end of
+ * the capture, -1 if the file is broken. */
+int capture_next(capture_p self, capture_dir_t * dir, int * channel,
+                struct timeval * when, unsigned char * data, int size);
+
+/* Starts replaying the packets received on connection, counted from 0 as
+ * in capture_connection(), of the capture at path. Returns the socket to poll the replay on, -1 on
+ * failure. *peer is the other end, to be closed with the socket. */
+int capture_replay(char const * path, int connection, int * peer);
+
+/* The capture everything sent and received goes to, 0 if none. */
+extern capture_p capture;
+
+#endif
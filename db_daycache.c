@@ -0,0 +1,102 @@
+/* start of day energy cache for the smatool database interfaces
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "db_daycache.h"
+#include <string.h>
+
+/* One slot per inverter and day, hashed into DAYCACHE_DAYS, a day in the
+ * same slot just pushes the older one out */
+struct daycache_entry {
+  long unsigned int serial;
+  long day;        //days since 1970-01-01, 0 = empty slot
+  long first_time; //seconds into the day of the first interval
+  long energy;
+};
+
+static struct daycache_entry daycache[DAYCACHE_DAYS];
+
+/* Day number of a calendar date, without going through mktime() */
+static long day_number( struct tm *date )
+{
+  long y = date->tm_year + 1900;
+  long m = date->tm_mon + 1;
+  long d = date->tm_mday;
+
+  y -= m <= 2;
+  long era = ( y >= 0 ? y : y - 399 ) / 400;
+  long yoe = y - era * 400;
+  long doy = ( 153 * ( m + ( m > 2 ? -3 : 9 ) ) + 2 ) / 5 + d - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+static long seconds_of_day( struct tm *date )
+{
+  return date->tm_hour * 3600L + date->tm_min * 60L + date->tm_sec;
+}
+
+static struct daycache_entry *daycache_slot( long unsigned int serial, long day )
+{
+  //the days of one inverter follow each other through the slots
+  return &daycache[ ( day + serial * 2654435761UL ) & ( DAYCACHE_DAYS - 1 ) ];
+}
+
+int daycache_lookup( long unsigned int serial, struct tm *day, long *energy )
+{
+  long n = day_number( day );
+  struct daycache_entry *entry = daycache_slot( serial, n );
+  if( entry->day != n || entry->serial != serial || n == 0 )
+    return 0;
+  *energy = entry->energy;
+  return 1;
+}
+
+void daycache_store( long unsigned int serial, struct tm *interval, long energy )
+{
+  long n = day_number( interval );
+  struct daycache_entry *entry = daycache_slot( serial, n );
+  entry->serial = serial;
+  entry->day = n;
+  entry->first_time = seconds_of_day( interval );
+  entry->energy = energy;
+}
+
+void daycache_update( long unsigned int serial, struct tm *interval, long energy )
+{
+  long n = day_number( interval );
+  struct daycache_entry *entry = daycache_slot( serial, n );
+  //days not cached are read from the database when they are needed
+  if( entry->day != n || entry->serial != serial )
+    return;
+  long t = seconds_of_day( interval );
+  if( t <= entry->first_time )
+  {
+    entry->first_time = t;
+    entry->energy = energy;
+  }
+}
+
+void daycache_forget( long unsigned int serial )
+{
+  int i;
+  for( i = 0; i < DAYCACHE_DAYS; i++ )
+    if( daycache[i].serial == serial )
+      daycache[i].day = 0;
+}
+
+void daycache_clear( void )
+{
+  memset( daycache, 0, sizeof( daycache ) );
+}
@@ -0,0 +1,46 @@
+#ifndef __DB_DAYCACHE_H__
+#define __DB_DAYCACHE_H__
+/* start of day energy cache for the smatool database interfaces
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * The ETotalToday value of the first interval of a day, kept per inverter
+ * and day so db_get_start_of_day_energy_value() only goes to the database
+ * once for each. The backends fill it from their query and keep it right
+ * as they write intervals. Inverters are told apart by serial.
+ */
+
+#include <time.h>
+
+/* Number of inverter days kept, a power of two */
+#define DAYCACHE_DAYS 64
+
+/* Returns 1 and sets energy if the day is cached, 0 if not */
+int daycache_lookup( long unsigned int serial, struct tm *day, long *energy );
+
+/* Remember the first interval of its day, as read from the database */
+void daycache_store( long unsigned int serial, struct tm *interval, long energy );
+
+/* An interval has been written. Moves the start of a cached day if the
+ * interval is earlier than the one cached, or replaces its value */
+void daycache_update( long unsigned int serial, struct tm *interval, long energy );
+
+/* Forget the days of one inverter, something else has written its intervals */
+void daycache_forget( long unsigned int serial );
+
+/* Forget everything, for a new database */
+void daycache_clear( void );
+
+#endif
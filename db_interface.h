@@ -55,9 +55,9 @@ int db_update_almanac(struct tm *date, const char * sunrise, const char * sunset
 
 
 /*
- * get the last recorded interval datetime for the specified date
+ * get the last recorded interval datetime of one inverter for the specified date
  */
-struct tm db_get_last_recorded_interval_datetime(struct tm *date);
+struct tm db_get_last_recorded_interval_datetime(struct tm *date, char const *inverter, long unsigned int serial);
 
 
 //int is_light( ConfType * conf );
@@ -73,31 +73,60 @@ struct tm db_get_last_recorded_interval_datetime(struct tm *date);
   Return 1 on success, 0 on failure
   TODO: current_power and total_energy should be scaled integer values (decimal(10,3) type )
 */
-int db_set_interval_value( struct tm *date, char *inverter, long unsigned int serial, long current_power, long total_energy );
+int db_set_interval_value( struct tm *date, char const *inverter, long unsigned int serial, long current_power, long total_energy );
+
+/* One interval row for db_set_interval_values() */
+typedef struct {
+  struct tm date;
+  char const *inverter;
+  long unsigned int serial;
+  long current_power;
+  long total_energy;
+} interval_row;
+
+/* insert or update n rows in one transaction, either all of them are stored or none
+  Return 1 on success, 0 on failure
+*/
+int db_set_interval_values( interval_row *rows, int n );
 
 /*
- * Get the start of day ETotalEnergy value for the specified day
+ * Get the start of day ETotalEnergy value of one inverter for the specified day
  * Returns 0.0f if there is no data.
  */
-long db_get_start_of_day_energy_value( struct tm *day );
+long db_get_start_of_day_energy_value( struct tm *day, char const *inverter, long unsigned int serial );
+
+/*
+ * Forget what has been cached of one inverter, as another connection has written intervals of it
+ */
+void db_forget_cached( long unsigned int serial );
+
+/*
+ * Set the upload date/time to NOW on the intervals of one inverter between from_datetime and to_datetime inclusive
+ * Return 1 for success, 0 for failure
+ */
+int db_set_data_posted(struct tm *from_datetime, struct tm *to_datetime, char const *inverter, long unsigned int serial );
 
 /*
- * Set the upload date/time to NOW on the intervals between from_datetime and to_datetime inclusive
+ * Park the intervals of one inverter between from_datetime and to_datetime inclusive, PVOutput will never take them.
+ * Their upload date/time becomes 1970-01-01 00:00:00, set it back to NULL to have them posted again.
  * Return 1 for success, 0 for failure
  */
-int db_set_data_posted(struct tm *from_datetime, struct tm *to_datetime );
+int db_set_data_rejected(struct tm *from_datetime, struct tm *to_datetime, char const *inverter, long unsigned int serial );
 
 
 /*
- * Return an opaque row handle pointer that can be iterated over to get unposted values from the specified datetime
+ * Return an opaque row handle pointer that can be iterated over to get unposted values of one inverter from the specified datetime
  * Column ID 0 = interval datetime
- * Column ID 1 = ETotalToday
+ * Column ID 1 = date as YYYYMMDD
+ * Column ID 2 = time as HH:MM
+ * Column ID 3 = ETotalToday in Wh
+ * Column ID 4 = CurrentPower
  * Rows are in interval datetime order, ascending
  * Call db_row_string_data() and db_row_next() to get values and iterate, respectively.
  * Call db_row_handle_free() when done.
  * Returns NULL if there are no rows returned
  */
-row_handle* db_get_unposted_data( struct tm *from_datetime );
+row_handle* db_get_unposted_data( struct tm *from_datetime, char const *inverter, long unsigned int serial );
 
 /*
  * Get a row's column value as a char* value
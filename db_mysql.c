@@ -18,12 +18,18 @@
 #define _XOPEN_SOURCE
 
 #include "db_interface.h"
+#include "db_daycache.h"
 #include <mysql/mysql.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 
+#if MYSQL_VERSION_ID >= 80000
+#include <stdbool.h>
+typedef bool my_bool;
+#endif
+
 char mysql_server[255];
 char mysql_user[255];
 char mysql_password[255];
@@ -35,9 +41,62 @@ const int MYSQL_OK = 0;
 const int MYSQL_ERROR = 1;
 
 
+/* Rows per statement when storing intervals in bulk */
+#define INTERVAL_BATCH_ROWS 50
+
+/* Prepared statements of this connection, by query id.
+   Prepared on first use, reset after each use and closed in db_close() */
+enum query_id {
+  QUERY_SCHEMA,
+  QUERY_FETCH_ALMANAC,
+  QUERY_UPDATE_ALMANAC,
+  QUERY_LAST_INTERVAL,
+  QUERY_SET_INTERVAL,
+  QUERY_SET_INTERVAL_BATCH,
+  QUERY_START_OF_DAY,
+  QUERY_SET_POSTED,
+  QUERY_SET_REJECTED,
+  QUERY_UNPOSTED,
+  QUERY_COUNT
+};
+
+#define INTERVAL_INSERT "INSERT INTO DayData(DateTime, Inverter, Serial, CurrentPower, ETotalToday, Changetime) VALUES "
+#define INTERVAL_VALUES "(?,?,?,?,?,NOW())"
+#define INTERVAL_UPDATE " ON DUPLICATE KEY UPDATE CurrentPower=VALUES(CurrentPower), ETotalToday=VALUES(ETotalToday), Changetime=VALUES(Changetime)"
+
+static const char *query_text[QUERY_COUNT] = {
+  [QUERY_SCHEMA] = "SELECT Data FROM Settings WHERE Value='Schema'",
+  [QUERY_FETCH_ALMANAC] = "SELECT Sunrise, Sunset FROM Almanac WHERE Date=?",
+  [QUERY_UPDATE_ALMANAC] = "REPLACE INTO Almanac(Date,Sunrise,Sunset) VALUES(?,?,?)",
+  [QUERY_LAST_INTERVAL] = "SELECT MAX(DateTime) FROM DayData WHERE Inverter = ? AND Serial = ?",
+  [QUERY_SET_INTERVAL] = INTERVAL_INSERT INTERVAL_VALUES INTERVAL_UPDATE,
+  [QUERY_SET_INTERVAL_BATCH] = NULL, //built by get_statement()
+  [QUERY_START_OF_DAY] = "SELECT DateTime, ETotalToday*1000 FROM DayData WHERE DateTime >= ? AND DateTime < ADDDATE(?,1) AND Inverter = ? AND Serial = ? ORDER BY DateTime ASC LIMIT 1",
+  [QUERY_SET_POSTED] = "UPDATE DayData SET PVOutput=NOW() WHERE DateTime >= ? AND DateTime <= ? AND Inverter = ? AND Serial = ?",
+  [QUERY_SET_REJECTED] = "UPDATE DayData SET PVOutput='1970-01-01 00:00:00' WHERE DateTime >= ? AND DateTime <= ? AND Inverter = ? AND Serial = ?",
+  [QUERY_UNPOSTED] = "SELECT Datetime, DATE_FORMAT(Datetime,'%Y%m%d'), DATE_FORMAT(Datetime,'%H:%i'), ETotalToday*1000, CurrentPower FROM DayData WHERE DateTime >= ? AND Inverter = ? AND Serial = ? AND PVOutput IS NULL AND CurrentPower > 0 ORDER BY Datetime ASC"
+};
+
+static MYSQL_STMT *query_cache[QUERY_COUNT];
+
+/* Result columns are fetched as strings into the handle */
+#define MAX_COLUMNS 5
+#define COLUMN_SIZE 64
+
 struct mysql_row_handle {
- MYSQL_RES *result;
- MYSQL_ROW row;
+ MYSQL_STMT *stmt;
+ MYSQL_BIND bind[MAX_COLUMNS];
+ char data[MAX_COLUMNS][COLUMN_SIZE];
+ unsigned long length[MAX_COLUMNS];
+ my_bool is_null[MAX_COLUMNS];
+};
+
+/* Parameter values are all sent as strings */
+struct mysql_params {
+ int count;
+ MYSQL_BIND bind[INTERVAL_BATCH_ROWS * 5];
+ char data[INTERVAL_BATCH_ROWS * 5][COLUMN_SIZE];
+ unsigned long length[INTERVAL_BATCH_ROWS * 5];
 };
 
 
@@ -64,18 +123,133 @@ void db_init(char *server, char *user, char *password, char *database)
   strcpy( mysql_user , user );
   strcpy( mysql_password, password );
   strcpy( mysql_database, database );
+  daycache_clear();
 }
 
 
 /* Release memory used to store results and close connection */  
 void db_close()
 {
+  int i;
+  for( i = 0; i < QUERY_COUNT; i++ )
+  {
+    if( query_cache[i] != NULL )
+      mysql_stmt_close( query_cache[i] );
+    query_cache[i] = NULL;
+  }
   mysql_close( dbHandle );
   dbHandle = NULL;
 }
 
 
 
+/* Returns the statement for id ready to be bound, NULL if it does not prepare */
+static MYSQL_STMT *get_statement( enum query_id id )
+{
+  if( query_cache[id] != NULL )
+    return query_cache[id];
+
+  const char *text = query_text[id];
+  char batch_text[sizeof(INTERVAL_INSERT) + INTERVAL_BATCH_ROWS * sizeof(INTERVAL_VALUES) + sizeof(INTERVAL_UPDATE)];
+  if( id == QUERY_SET_INTERVAL_BATCH )
+  {
+    int i, len = sprintf( batch_text, "%s", INTERVAL_INSERT );
+    for( i = 0; i < INTERVAL_BATCH_ROWS; i++ )
+      len += sprintf( batch_text + len, "%s%s", ( i ? "," : "" ), INTERVAL_VALUES );
+    strcpy( batch_text + len, INTERVAL_UPDATE );
+    text = batch_text;
+  }
+
+  MYSQL_STMT *stmt = mysql_stmt_init( dbHandle );
+  if( stmt == NULL )
+    return NULL;
+  if( mysql_stmt_prepare( stmt, text, strlen( text ) ) != 0 )
+  {
+    fprintf(stderr, "Error preparing query %d: %s\n", id, mysql_stmt_error( stmt ) );
+    mysql_stmt_close( stmt );
+    return NULL;
+  }
+  query_cache[id] = stmt;
+  return stmt;
+}
+
+/* Hands a statement back to the cache, dropping any unread result */
+static void put_statement( MYSQL_STMT *stmt )
+{
+  mysql_stmt_free_result( stmt );
+  mysql_stmt_reset( stmt );
+}
+
+/* Parameters of the statement being run. One connection runs one
+   statement at a time, so one buffer will do */
+static struct mysql_params params_buffer;
+
+static struct mysql_params *new_params( void )
+{
+  params_buffer.count = 0;
+  return &params_buffer;
+}
+
+/* Adds a string parameter */
+static void param_string( struct mysql_params *params, const char *value )
+{
+  int i = params->count++;
+  snprintf( params->data[i], COLUMN_SIZE, "%s", value );
+  memset( &params->bind[i], 0, sizeof( MYSQL_BIND ) );
+  params->length[i] = strlen( params->data[i] );
+  params->bind[i].buffer_type = MYSQL_TYPE_STRING;
+  params->bind[i].buffer = params->data[i];
+  params->bind[i].buffer_length = COLUMN_SIZE;
+  params->bind[i].length = &params->length[i];
+}
+
+static void param_date( struct mysql_params *params, const char *format, struct tm *date )
+{
+  char chardate[25];
+  strftime( chardate, 25, format, date );
+  param_string( params, chardate );
+}
+
+/* Serials are stored as text, the way DayData has always had them */
+static void param_serial( struct mysql_params *params, long unsigned int serial )
+{
+  char value[COLUMN_SIZE];
+  sprintf( value, "%lu", serial );
+  param_string( params, value );
+}
+
+/* Binds params, runs stmt and, if it returns rows, binds them to handle
+   and fetches the first one.
+   Returns 1 if there is a row, 0 if not, -1 on error */
+static int execute_statement( MYSQL_STMT *stmt, struct mysql_params *params, struct mysql_row_handle *handle )
+{
+  if( params != NULL && params->count > 0 && mysql_stmt_bind_param( stmt, params->bind ) != 0 )
+    return -1;
+  if( mysql_stmt_execute( stmt ) != 0 )
+    return -1;
+  if( handle == NULL )
+    return 0;
+
+  int i;
+  memset( handle, 0, sizeof( struct mysql_row_handle ) );
+  handle->stmt = stmt;
+  for( i = 0; i < MAX_COLUMNS; i++ )
+  {
+    handle->bind[i].buffer_type = MYSQL_TYPE_STRING;
+    handle->bind[i].buffer = handle->data[i];
+    handle->bind[i].buffer_length = COLUMN_SIZE;
+    handle->bind[i].length = &handle->length[i];
+    handle->bind[i].is_null = &handle->is_null[i];
+  }
+  //stored, so other statements can run while the rows are read
+  if( mysql_stmt_bind_result( stmt, handle->bind ) != 0 || mysql_stmt_store_result( stmt ) != 0 )
+    return -1;
+  int result = mysql_stmt_fetch( stmt );
+  if( result == MYSQL_NO_DATA )
+    return 0;
+  return ( result == 0 || result == MYSQL_DATA_TRUNCATED ) ? 1 : -1;
+}
+
 int db_install_tables( void )
 {
   if( mysql_open() != MYSQL_OK )
@@ -141,17 +315,15 @@ int db_get_schema(){
   }
   
   int schema = 0;
-  int result = mysql_query( dbHandle, "SELECT Data FROM Settings WHERE Value='Schema';" );
-  if( result == MYSQL_OK )
+  MYSQL_STMT *stmt = get_statement( QUERY_SCHEMA );
+  if( stmt == NULL )
+    return schema;
+  struct mysql_row_handle row;
+  if( execute_statement( stmt, NULL, &row ) == 1 && !row.is_null[0] )
   {
-    MYSQL_RES *dbResult = mysql_store_result( dbHandle );
-    MYSQL_ROW row = mysql_fetch_row( dbResult );
-    if( row != NULL && row[0] != NULL ) 
-    {
-	schema = atoi(row[0]);
-    }
-    mysql_free_result( dbResult );
+    schema = atoi( row.data[0] );
   }
+  put_statement( stmt );
   
   return schema;
 }
@@ -168,33 +340,30 @@ int db_fetch_almanac(struct tm *date, char * sunrise, char * sunset )
     fprintf(stderr, "db_fetch_almanac error\n" );
     return retval;
   }
-  const char *stmtText = "SELECT Sunrise, Sunset FROM Almanac WHERE Date='%s'";
-  char query[100];
+  MYSQL_STMT *stmt = get_statement( QUERY_FETCH_ALMANAC );
+  if( stmt == NULL )
+    return retval;
 
-  char chardate[25];
-  strftime(chardate, 25, "%Y-%m-%d", date );
+  struct mysql_params *params = new_params();
+  param_date( params, "%Y-%m-%d", date );
 
-  sprintf( query, stmtText, chardate );
-#ifdef DEBUG
-  puts(query);
-#endif
-  int result = mysql_query( dbHandle, query );
-  if( result != MYSQL_OK )
+  struct mysql_row_handle row;
+  int result = execute_statement( stmt, params, &row );
+  if( result < 0 )
   {
-    fprintf(stderr, "db_fetch_almanac error: %s\n", mysql_error( dbHandle) );
+    fprintf(stderr, "db_fetch_almanac error: %s\n", mysql_stmt_error( stmt ) );
+    put_statement( stmt );
     return retval;
   }
 
   retval = 0;
-  MYSQL_RES *dbResult = mysql_store_result( dbHandle );
-  MYSQL_ROW row = mysql_fetch_row( dbResult );
-  if( row != NULL )
+  if( result == 1 )
   {
-    strcpy( sunrise, row[0] );
-    strcpy( sunset, row[1] );
+    strcpy( sunrise, row.data[0] );
+    strcpy( sunset, row.data[1] );
     retval = 1;
   }
-  mysql_free_result( dbResult );
+  put_statement( stmt );
   
   return retval;
   
@@ -209,64 +378,56 @@ int db_update_almanac(struct tm *date, const char * sunrise, const char * sunset
     fprintf(stderr, "db_update_almanac error\n" );
     return 0;
   }
-  const char *stmtText = "REPLACE INTO Almanac(Date,Sunrise,Sunset) VALUES('%s','%s','%s')";
-  char query[200];
-  char chardate[25];
-  strftime(chardate,25,"%Y-%m-%d", date);
+  MYSQL_STMT *stmt = get_statement( QUERY_UPDATE_ALMANAC );
+  if( stmt == NULL )
+    return 0;
 
-  sprintf(query, stmtText, chardate, sunrise, sunset );
-#ifdef DEBUG
-  puts(query);
-#endif
+  struct mysql_params *params = new_params();
+  param_date( params, "%Y-%m-%d", date );
+  param_string( params, sunrise );
+  param_string( params, sunset );
 
-  int result = mysql_query( dbHandle, query );
-  if( result != MYSQL_OK )
-  {
-    fprintf(stderr, "db_update_almanac error: %s\n", mysql_error( dbHandle) );
-    return 0;
-  }
+  int result = execute_statement( stmt, params, NULL );
+  if( result < 0 )
+    fprintf(stderr, "db_update_almanac error: %s\n", mysql_stmt_error( stmt ) );
+  put_statement( stmt );
   
-  return 1;  
+  return ( result < 0 ) ? 0 : 1;  
 } 
 
 /*
- * get the last recorded interval datetime for the specified date
+ * get the last recorded interval datetime of one inverter for the specified date
  */
-struct tm db_get_last_recorded_interval_datetime(struct tm *date)
+struct tm db_get_last_recorded_interval_datetime(struct tm *date, char const *inverter, long unsigned int serial)
 {
   struct tm last_time;
   time_t gmt_zero = 0;
-  last_time = *(gmtime( &gmt_zero  ));
+  gmtime_r( &gmt_zero, &last_time );
 
   if( mysql_open() != MYSQL_OK )
   {
     fprintf(stderr, "db_get_last_recorded_interval_datetime error\n" );
     return last_time;
   }
-	
-  const char *stmtText = "SELECT MAX(DateTime) FROM DayData";
-  char query[200];
-
-  sprintf( query, stmtText);
+  MYSQL_STMT *stmt = get_statement( QUERY_LAST_INTERVAL );
+  if( stmt == NULL )
+    return last_time;
 
-#ifdef DEBUG
-  puts(query);
-#endif
+  struct mysql_params *params = new_params();
+  param_string( params, inverter );
+  param_serial( params, serial );
 
-  int result = mysql_query( dbHandle, query );
-  if( result != MYSQL_OK )
+  struct mysql_row_handle row;
+  int result = execute_statement( stmt, params, &row );
+  if( result < 0 )
   {
-    fprintf(stderr, "db_get_last_recorded_interval_datetime error: %s\n", mysql_error( dbHandle) );
-    return last_time;
+    fprintf(stderr, "db_get_last_recorded_interval_datetime error: %s\n", mysql_stmt_error( stmt ) );
   }
-
-  MYSQL_RES *dbResult = mysql_store_result( dbHandle );
-  MYSQL_ROW row = mysql_fetch_row( dbResult );
-  if( row != NULL && row[0] != NULL )
+  else if( result == 1 && !row.is_null[0] )
   {
-    strptime( row[0], "%Y-%m-%d %H:%M:%S", &last_time );
+    strptime( row.data[0], "%Y-%m-%d %H:%M:%S", &last_time );
   }
-  mysql_free_result( dbResult );
+  put_statement( stmt );
 
   return last_time;  
 }
@@ -274,39 +435,89 @@ struct tm db_get_last_recorded_interval_datetime(struct tm *date)
 /* insert or update a single row in the database 
   Return 1 on success, 0 on failure
 */
-int db_set_interval_value( struct tm *date, char *inverter, long unsigned int serial, long current_power, long total_energy )
+int db_set_interval_value( struct tm *date, char const *inverter, long unsigned int serial, long current_power, long total_energy )
+{
+  interval_row row;
+  row.date = *date;
+  row.inverter = inverter;
+  row.serial = serial;
+  row.current_power = current_power;
+  row.total_energy = total_energy;
+  return db_set_interval_values( &row, 1 );
+}
+
+static void param_interval( struct mysql_params *params, interval_row *row )
+{
+  char value[COLUMN_SIZE];
+  param_date( params, "%Y-%m-%d %H:%M:%S", &row->date );
+  param_string( params, row->inverter );
+  param_serial( params, row->serial );
+  sprintf( value, "%ld", row->current_power );
+  param_string( params, value );
+  //as text, so the decimal(10,3) column gets it exactly
+  sprintf( value, "%ld.%03ld", row->total_energy / 1000, row->total_energy % 1000 );
+  param_string( params, value );
+}
+
+/* insert or update n rows in one transaction
+  Full batches of INTERVAL_BATCH_ROWS go in one multi-row statement, the
+  rest one by one.
+  Return 1 on success, 0 on failure
+*/
+int db_set_interval_values( interval_row *rows, int n )
 {
   if( mysql_open() != MYSQL_OK )
   {
-    fprintf(stderr, "db_set_interval_value error\n" );
+    fprintf(stderr, "db_set_interval_values error\n" );
     return 0;
   }
-  const char *stmtText= "REPLACE INTO DayData(DateTime, Inverter, Serial, CurrentPower, ETotalToday, Changetime) VALUES( '%s', '%s', '%lu', %ld, %d.%03d, NOW() )";
-  char query[200];
-  char interval_datetime[25];
-  strftime(interval_datetime,25,"%Y-%m-%d %H:%M:%S", date);
-
-  sprintf( query, stmtText, interval_datetime, inverter, serial, current_power , total_energy / 1000, total_energy % 1000 );
-#ifdef DEBUG
-  puts(query);
-#endif
-  int result = mysql_query( dbHandle, query);
-  if( result != MYSQL_OK )
+  if( mysql_query( dbHandle, "START TRANSACTION" ) != MYSQL_OK )
   {
-    fprintf(stderr, "db_set_interval_value error: %s\n", mysql_error( dbHandle) );
+    fprintf(stderr, "db_set_interval_values error: %s\n", mysql_error( dbHandle) );
     return 0;
   }
 
-  return 1;  
-  
+  struct mysql_params *params;
+  int i = 0;
+  while( i < n )
+  {
+    int batch = ( n - i >= INTERVAL_BATCH_ROWS ) ? INTERVAL_BATCH_ROWS : 1;
+    MYSQL_STMT *stmt = get_statement( batch > 1 ? QUERY_SET_INTERVAL_BATCH : QUERY_SET_INTERVAL );
+    int j, result = -1;
+    if( stmt != NULL )
+    {
+      params = new_params();
+      for( j = 0; j < batch; j++ )
+        param_interval( params, &rows[i+j] );
+      result = execute_statement( stmt, params, NULL );
+      if( result < 0 )
+        fprintf(stderr, "db_set_interval_values error: %s\n", mysql_stmt_error( stmt ) );
+      put_statement( stmt );
+    }
+    if( result < 0 )
+    {
+      mysql_query( dbHandle, "ROLLBACK" );
+      return 0;
+    }
+    i += batch;
+  }
+
+  if( mysql_query( dbHandle, "COMMIT" ) != MYSQL_OK )
+  {
+    fprintf(stderr, "db_set_interval_values error: %s\n", mysql_error( dbHandle) );
+    return 0;
+  }
+  for( i = 0; i < n; i++ )
+    daycache_update( rows[i].serial, &rows[i].date, rows[i].total_energy );
+  return 1;
 }
 
 
 /*
- * Get the start of day ETotalEnergy value for the specified day
+ * Get the start of day ETotalEnergy value of one inverter for the specified day
  * Returns 0.0f if there is no data.
  */
-long db_get_start_of_day_energy_value( struct tm *day )
+long db_get_start_of_day_energy_value( struct tm *day, char const *inverter, long unsigned int serial )
 {
   if( mysql_open() != MYSQL_OK )
   {
@@ -314,130 +525,149 @@ long db_get_start_of_day_energy_value( struct tm *day )
     return 0;
   }
   long start_day_e = 0;
-  const char *stmtText = "SELECT ETotalToday*1000 FROM DayData WHERE DateTime >= '%s' AND DateTime < ADDDATE('%s',1) ORDER BY DateTime ASC";
-  char query[200];
-  char date[25];
-  strftime(date,25,"%Y-%m-%d", day);
-
-  sprintf( query, stmtText, date, date );
-#ifdef DEBUG
-  puts(query);
-#endif
-  
-  int result = mysql_query( dbHandle, query);
-  if( result != MYSQL_OK )
-  {
-    fprintf(stderr, "db_get_start_of_day_energy_value error: %s\n", mysql_error( dbHandle) );
+  if( daycache_lookup( serial, day, &start_day_e ) )
+    return start_day_e;
+  MYSQL_STMT *stmt = get_statement( QUERY_START_OF_DAY );
+  if( stmt == NULL )
     return 0;
+
+  struct mysql_params *params = new_params();
+  param_date( params, "%Y-%m-%d", day );
+  param_date( params, "%Y-%m-%d", day );
+  param_string( params, inverter );
+  param_serial( params, serial );
+
+  struct mysql_row_handle row;
+  int result = execute_statement( stmt, params, &row );
+  if( result < 0 )
+  {
+    fprintf(stderr, "db_get_start_of_day_energy_value error: %s\n", mysql_stmt_error( stmt ) );
   }
-  
-  MYSQL_RES *dbResult = mysql_store_result( dbHandle );
-  MYSQL_ROW row = mysql_fetch_row( dbResult );
-  if( row != NULL && row[0] != NULL)
+  else if( result == 1 && !row.is_null[1] )
   {
-    start_day_e = atol( row[0]  );
+    struct tm first_interval;
+    memset( &first_interval, 0, sizeof( first_interval ) );
+    strptime( row.data[0], "%Y-%m-%d %H:%M:%S", &first_interval );
+    start_day_e = atol( row.data[1] );
+    daycache_store( serial, &first_interval, start_day_e );
   }
-  mysql_free_result( dbResult );
+  put_statement( stmt );
   
   return start_day_e;  
 }
 
 
 /*
- * Set the upload date/time to NOW on the intervals between from_datetime and to_datetime inclusive
+ * Forget what has been cached of one inverter, as another connection has written intervals of it
+ */
+void db_forget_cached( long unsigned int serial )
+{
+  daycache_forget( serial );
+}
+
+
+/*
+ * Set the upload date/time of the intervals of one inverter between from_datetime and to_datetime inclusive,
+ * with the query id, on behalf of caller.
  * Return 1 for success, 0 for failure
  */
-int db_set_data_posted(struct tm *from_datetime, struct tm *to_datetime )
+static int set_data_uploaded( enum query_id id, char const *caller, struct tm *from_datetime, struct tm *to_datetime, char const *inverter, long unsigned int serial )
 {
   if( mysql_open() != MYSQL_OK )
   {
-    fprintf(stderr, "db_set_data_posted error\n" );
+    fprintf(stderr, "%s error\n", caller );
     return 0;
   }
-  
-  const char *stmtText = "UPDATE DayData SET PVOutput=NOW() WHERE DateTime >= '%s' AND DateTime <= '%s' ";
-  char query[200];
-  char charfromdate[25];
-  char chartodate[25];
-  strftime(charfromdate,25,"%Y-%m-%d %H:%M:%S", from_datetime);
-  strftime(chartodate,25,"%Y-%m-%d %H:%M:%S", to_datetime);
-
-  sprintf( query, stmtText, charfromdate, chartodate );
-#ifdef DEBUG
-  puts(query);
-#endif
-  
-  int result = mysql_query( dbHandle, query);
-  if( result != MYSQL_OK )
-  {
-    fprintf(stderr, "db_set_data_posted error: %s\n", mysql_error( dbHandle) );
+  MYSQL_STMT *stmt = get_statement( id );
+  if( stmt == NULL )
     return 0;
-  }
 
-  return 1;  
+  struct mysql_params *params = new_params();
+  param_date( params, "%Y-%m-%d %H:%M:%S", from_datetime );
+  param_date( params, "%Y-%m-%d %H:%M:%S", to_datetime );
+  param_string( params, inverter );
+  param_serial( params, serial );
+
+  int result = execute_statement( stmt, params, NULL );
+  if( result < 0 )
+    fprintf(stderr, "%s error: %s\n", caller, mysql_stmt_error( stmt ) );
+  put_statement( stmt );
+
+  return ( result < 0 ) ? 0 : 1;  
   
 }
 
+/*
+ * Set the upload date/time to NOW on the intervals of one inverter between from_datetime and to_datetime inclusive
+ * Return 1 for success, 0 for failure
+ */
+int db_set_data_posted(struct tm *from_datetime, struct tm *to_datetime, char const *inverter, long unsigned int serial )
+{
+  return set_data_uploaded( QUERY_SET_POSTED, "db_set_data_posted", from_datetime, to_datetime, inverter, serial );
+}
+
+/*
+ * Park the intervals of one inverter between from_datetime and to_datetime inclusive, PVOutput will never take them
+ * Return 1 for success, 0 for failure
+ */
+int db_set_data_rejected(struct tm *from_datetime, struct tm *to_datetime, char const *inverter, long unsigned int serial )
+{
+  return set_data_uploaded( QUERY_SET_REJECTED, "db_set_data_rejected", from_datetime, to_datetime, inverter, serial );
+}
+
 
 
 /*
- * Return an opaque row handle pointer that can be iterated over to get the values for the specified day
+ * Return an opaque row handle pointer that can be iterated over to get the unposted values of one inverter
+ * Columns are the same as in the sqlite backend:
  * Column ID 0 = interval datetime
- * Column ID 1 = ETotalToday
+ * Column ID 1 = date as YYYYMMDD
+ * Column ID 2 = time as HH:MM
+ * Column ID 3 = ETotalToday in Wh
+ * Column ID 4 = CurrentPower
  * Rows are in interval datetime order, ascending
  * Call db_row_get_column_value() and db_row_next() to get values and iterate, respectively.
  * Call db_row_handle_free() when done.
  */
-row_handle* db_get_unposted_data( struct tm *from_datetime )
+row_handle* db_get_unposted_data( struct tm *from_datetime, char const *inverter, long unsigned int serial )
 {
   if( mysql_open() != MYSQL_OK )
   {
     fprintf(stderr, "db_get_unposted_data error\n" );
     return NULL;
   }
+  MYSQL_STMT *stmt = get_statement( QUERY_UNPOSTED );
+  if( stmt == NULL )
+    return NULL;
 
-  const char *stmtText = "SELECT Datetime, ETotalToday FROM DayData WHERE DateTime >= '%s' AND PVOutput IS NULL ORDER BY Datetime ASC ";
-  char query[200];
-  char charfromdate[25];
-  strftime(charfromdate,25,"%Y-%m-%d %H:%M:%S", from_datetime);
-
-  sprintf( query, stmtText, charfromdate );
-#ifdef DEBUG
-  puts(query);
-#endif
+  struct mysql_params *params = new_params();
+  param_date( params, "%Y-%m-%d %H:%M:%S", from_datetime );
+  param_string( params, inverter );
+  param_serial( params, serial );
 
-  int result = mysql_query( dbHandle, query );
-  if( result != MYSQL_OK )
+  struct mysql_row_handle *handle = malloc( sizeof( struct mysql_row_handle ));
+  int result = execute_statement( stmt, params, handle );
+  if( result < 0 )
+    fprintf(stderr, "db_get_unposted_data error: %s\n", mysql_stmt_error( stmt ) );
+  if( result != 1 )
   {
-    fprintf(stderr, "db_get_unposted_data error: %s\n", mysql_error( dbHandle) );
+    put_statement( stmt );
+    free( handle );
     return NULL;
   }
-  
-
-  if( result == MYSQL_OK )
-  {
-    struct mysql_row_handle *handle = malloc( sizeof( struct mysql_row_handle ));
-    handle->result = mysql_store_result( dbHandle );
-    handle->row = mysql_fetch_row( handle->result );
-    if( handle->row == NULL )
-    {
-	mysql_free_result( handle->result );
-	free( handle );
-	return NULL;
-    }
-    return ((row_handle*) handle);
-  }
-  return NULL;
+  return ((row_handle*) handle);
 }
 
 char* db_row_string_data( row_handle *row, int column_id )
 {
-  return ((struct mysql_row_handle*) row)->row[column_id];
+  struct mysql_row_handle* handle = (struct mysql_row_handle*)row;
+  return handle->is_null[column_id] ? NULL : handle->data[column_id];
 }
 
 long db_row_int_data( row_handle *row, int column_id )
 {
-  return ((struct mysql_row_handle*) row)->row[column_id];
+  char *value = db_row_string_data( row, column_id );
+  return value ? atol( value ) : 0;
 }
 
 struct tm db_row_datetime_data( row_handle *row, int column_id )
@@ -457,8 +687,10 @@ int db_row_next( row_handle *row )
 {
   struct mysql_row_handle* handle = (struct mysql_row_handle*)row;
 
-  handle->row =  mysql_fetch_row( handle->result );
-  return (handle->row == NULL) ? 0 : 1;
+  int result = mysql_stmt_fetch( handle->stmt );
+  if( result == 0 || result == MYSQL_DATA_TRUNCATED )
+    return 1;
+  return ( result == MYSQL_NO_DATA ) ? 0 : -result;
 }
 
 /*
@@ -467,6 +699,7 @@ int db_row_next( row_handle *row )
 void db_row_handle_free( row_handle *row )
 {
   struct mysql_row_handle* handle = (struct mysql_row_handle*) row;
-  mysql_free_result( handle->result );
+  //the statement belongs to the cache
+  put_statement( handle->stmt );
   free( handle );
 }
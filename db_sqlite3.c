@@ -19,6 +19,7 @@
 
 #include "logging.h"
 #include "db_interface.h"
+#include "db_daycache.h"
 #include <sqlite3.h>
 #include <stdio.h>
 #include <string.h>
@@ -29,6 +30,50 @@ char sqlite_dbfile[255];
 
 sqlite3 *dbHandle = NULL;
 
+/* Prepared statements of this connection, by query id.
+   Prepared on first use, reset after each use and finalized in db_close() */
+enum query_id {
+  QUERY_SCHEMA,
+  QUERY_FETCH_ALMANAC,
+  QUERY_UPDATE_ALMANAC,
+  QUERY_LAST_INTERVAL,
+  QUERY_SET_INTERVAL,
+  QUERY_START_OF_DAY,
+  QUERY_SET_POSTED,
+  QUERY_SET_REJECTED,
+  QUERY_UNPOSTED,
+  QUERY_COUNT
+};
+
+static const char *query_text[QUERY_COUNT] = {
+  [QUERY_SCHEMA] = "SELECT Data FROM Settings WHERE Value='Schema';",
+  [QUERY_FETCH_ALMANAC] = "SELECT Sunrise, Sunset FROM Almanac WHERE Date=?;",
+  [QUERY_UPDATE_ALMANAC] = "REPLACE INTO Almanac(Date,Sunrise,Sunset) VALUES(?,?,?);",
+  [QUERY_LAST_INTERVAL] = "SELECT MAX(DateTime) FROM DayData WHERE DateTime < date(?,'1 day') AND Inverter = ? AND Serial = ? ;",
+  [QUERY_SET_INTERVAL] = "REPLACE INTO DayData(DateTime, Inverter, Serial, CurrentPower, ETotalToday, Changetime) VALUES( ?, ?, ?, ?, ? /1000.0, datetime('now','localtime') );",
+  [QUERY_START_OF_DAY] = "SELECT DateTime, ETotalToday*1000 FROM DayData WHERE DateTime >= ? AND DateTime < date(?,'1 day') AND Inverter = ? AND Serial = ? ORDER BY DateTime ASC LIMIT 1;",
+  [QUERY_SET_POSTED] = "UPDATE DayData SET PVOutput=datetime('now','localtime') WHERE DateTime >= ? AND DateTime <= ? AND Inverter = ? AND Serial = ? ;",
+  [QUERY_SET_REJECTED] = "UPDATE DayData SET PVOutput='1970-01-01 00:00:00' WHERE DateTime >= ? AND DateTime <= ? AND Inverter = ? AND Serial = ? ;",
+  [QUERY_UNPOSTED] = "SELECT Datetime, strftime('%Y%m%d',Datetime),strftime('%H:%M',Datetime), ETotalToday*1000, CurrentPower FROM DayData WHERE DateTime >= ? AND Inverter = ? AND Serial = ? AND PVOutput IS NULL AND CurrentPower > 0 ORDER BY Datetime ASC ;"
+};
+
+static sqlite3_stmt *query_cache[QUERY_COUNT];
+
+/* Returns the statement for id ready to be bound, NULL if it does not prepare */
+static sqlite3_stmt *get_statement( enum query_id id )
+{
+  if( query_cache[id] == NULL )
+    sqlite3_prepare_v2( dbHandle, query_text[id], -1, &query_cache[id], NULL );
+  return query_cache[id];
+}
+
+/* Hands a statement back to the cache. Resetting ends its read transaction */
+static void put_statement( sqlite3_stmt *pStmt )
+{
+  sqlite3_reset( pStmt );
+  sqlite3_clear_bindings( pStmt );
+}
+
 int sqlite_open( void )
 {
   //already open?
@@ -40,6 +85,11 @@ int sqlite_open( void )
       log_error( "Error opening sqlite3 db %s:%s", sqlite_dbfile, sqlite3_errmsg(dbHandle) );
       dbHandle = NULL;
   }
+  else
+  {
+      //the daemon's uploader writes to the same file from another process
+      sqlite3_busy_timeout( dbHandle, 10000 );
+  }
   return result;
 }
 
@@ -48,12 +98,19 @@ int sqlite_open( void )
 void db_init(char *server, char *user, char *password, char *database)
 {
   strcpy( sqlite_dbfile, database );
+  daycache_clear();
 }
 
 
 /* Release memory used to store results and close connection */  
 void db_close()
 {
+  int i;
+  for( i = 0; i < QUERY_COUNT; i++ )
+  {
+    sqlite3_finalize( query_cache[i] );
+    query_cache[i] = NULL;
+  }
   int result = sqlite3_close( dbHandle );
   if( result  != SQLITE_OK  ) 
   {
@@ -132,9 +189,9 @@ int db_get_schema(){
     return -1;
   }
   
-  sqlite3_stmt *pStmt = NULL;
+  sqlite3_stmt *pStmt = get_statement( QUERY_SCHEMA );
   int schema = 0;
-  int result = sqlite3_prepare_v2( dbHandle, "SELECT Data FROM Settings WHERE Value='Schema';", -1, &pStmt, NULL );
+  int result;
   if( pStmt != NULL )
   {
     result = sqlite3_step( pStmt );
@@ -142,7 +199,7 @@ int db_get_schema(){
     {
       schema = sqlite3_column_int( pStmt, 0 );
     }
-    sqlite3_finalize( pStmt );
+    put_statement( pStmt );
   }
   
   return schema;
@@ -161,8 +218,8 @@ int db_fetch_almanac(struct tm *date, char * sunrise, char * sunset )
     return retval;
   }
   
-  sqlite3_stmt *pStmt = NULL;
-  int result = sqlite3_prepare_v2( dbHandle, "SELECT Sunrise, Sunset FROM Almanac WHERE Date=?;", -1, &pStmt, NULL );
+  sqlite3_stmt *pStmt = get_statement( QUERY_FETCH_ALMANAC );
+  int result;
   if( NULL == pStmt )
   {
     log_error( "db_fetch_almanac error: %s", sqlite3_errmsg( dbHandle) );
@@ -179,7 +236,7 @@ int db_fetch_almanac(struct tm *date, char * sunrise, char * sunset )
     strcpy( sunset, (char*)sqlite3_column_text( pStmt, 1 ));
     retval = 1;
   }
-  sqlite3_finalize( pStmt );
+  put_statement( pStmt );
   
   return retval;
   
@@ -195,8 +252,8 @@ int db_update_almanac(struct tm *date, const char * sunrise, const char * sunset
     return 0;
   }
   
-  sqlite3_stmt *pStmt = NULL;
-  int result = sqlite3_prepare_v2( dbHandle, "REPLACE INTO Almanac(Date,Sunrise,Sunset) VALUES(?,?,?);", -1, &pStmt, NULL );
+  sqlite3_stmt *pStmt = get_statement( QUERY_UPDATE_ALMANAC );
+  int result;
   if( NULL == pStmt )
   {
     log_error( "db_update_almanac error: %s", sqlite3_errmsg( dbHandle) );
@@ -211,23 +268,23 @@ int db_update_almanac(struct tm *date, const char * sunrise, const char * sunset
   result = sqlite3_step( pStmt );
   if( result == SQLITE_DONE )
   {
-    sqlite3_finalize( pStmt );
+    put_statement( pStmt );
     return 1;
   }
 
   log_error( "db_update_almanac error: %s", sqlite3_errmsg( dbHandle) );
-  sqlite3_finalize( pStmt );
+  put_statement( pStmt );
   return 0;  
 } 
 
 /*
- * get the last recorded interval datetime for the specified date
+ * get the last recorded interval datetime of one inverter for the specified date
  */
-struct tm db_get_last_recorded_interval_datetime(struct tm *date)
+struct tm db_get_last_recorded_interval_datetime(struct tm *date, char const *inverter, long unsigned int serial)
 {
   struct tm last_time;
   time_t gmt_zero = 0;
-  last_time = *(gmtime( &gmt_zero  ));
+  gmtime_r( &gmt_zero, &last_time );
 
   if( sqlite_open() != SQLITE_OK )
   {
@@ -235,8 +292,8 @@ struct tm db_get_last_recorded_interval_datetime(struct tm *date)
     return last_time;
   }
   
-  sqlite3_stmt *pStmt = NULL;
-  int result = sqlite3_prepare_v2( dbHandle, "SELECT MAX(DateTime) FROM DayData WHERE DateTime < date(?,'1 day') ;", -1, &pStmt, NULL );
+  sqlite3_stmt *pStmt = get_statement( QUERY_LAST_INTERVAL );
+  int result;
   if( NULL == pStmt )
   {
     log_error( "db_get_last_recorded_interval_datetime error: %s", sqlite3_errmsg( dbHandle) );
@@ -245,6 +302,8 @@ struct tm db_get_last_recorded_interval_datetime(struct tm *date)
   char chardate[25];
   strftime(chardate,25,"%Y-%m-%d", date);
   sqlite3_bind_text( pStmt, 1, chardate, -1, SQLITE_STATIC );
+  sqlite3_bind_text( pStmt, 2, inverter, -1, SQLITE_STATIC );
+  sqlite3_bind_int( pStmt, 3, serial );
 
   result = sqlite3_step( pStmt );
   if( result == SQLITE_ROW )
@@ -260,54 +319,85 @@ struct tm db_get_last_recorded_interval_datetime(struct tm *date)
     }
   }
    
-  sqlite3_finalize( pStmt );
+  put_statement( pStmt );
   return last_time;  
 }
 
 /* insert or update a single row in the database 
   Return 1 on success, 0 on failure
 */
-int db_set_interval_value( struct tm *date, char *inverter, long unsigned int serial, long current_power, long total_energy )
+int db_set_interval_value( struct tm *date, char const *inverter, long unsigned int serial, long current_power, long total_energy )
+{
+  interval_row row;
+  row.date = *date;
+  row.inverter = inverter;
+  row.serial = serial;
+  row.current_power = current_power;
+  row.total_energy = total_energy;
+  return db_set_interval_values( &row, 1 );
+}
+
+/* insert or update n rows in one transaction
+  Return 1 on success, 0 on failure
+*/
+int db_set_interval_values( interval_row *rows, int n )
 {
   if( sqlite_open() != SQLITE_OK )
   {
-    log_error( "db_set_interval_value error" );
+    log_error( "db_set_interval_values error" );
     return 0;
   }
-  
-  sqlite3_stmt *pStmt = NULL;
-  int result = sqlite3_prepare_v2( dbHandle, "REPLACE INTO DayData(DateTime, Inverter, Serial, CurrentPower, ETotalToday, Changetime) VALUES( ?, ?, ?, ?, ? /1000.0, datetime('now','localtime') );", -1, &pStmt, NULL );
+
+  sqlite3_stmt *pStmt = get_statement( QUERY_SET_INTERVAL );
   if( NULL == pStmt )
   {
-    log_error( "db_set_interval_value error: %s", sqlite3_errmsg( dbHandle) );
+    log_error( "db_set_interval_values error: %s", sqlite3_errmsg( dbHandle) );
     return 0;
   }
-  char interval_datetime[25];
-  strftime(interval_datetime,25,"%Y-%m-%d %H:%M:%S", date);
-  sqlite3_bind_text( pStmt, 1, interval_datetime, -1, SQLITE_STATIC );
-  sqlite3_bind_text( pStmt, 2, inverter , -1, SQLITE_STATIC);
-  sqlite3_bind_int( pStmt, 3, serial);
-  sqlite3_bind_int( pStmt, 4, current_power );
-  sqlite3_bind_int( pStmt, 5, total_energy );
-  result = sqlite3_step( pStmt );
-  if( result == SQLITE_DONE )
+
+  //one transaction, so one sync for all rows instead of one per row
+  if( sqlite3_exec( dbHandle, "BEGIN IMMEDIATE;", NULL, NULL, NULL ) != SQLITE_OK )
   {
-    sqlite3_finalize( pStmt );
-    return 1;
+    log_error( "db_set_interval_values error: %s", sqlite3_errmsg( dbHandle) );
+    return 0;
   }
-
-  log_error( "db_set_interval_value error: %s", sqlite3_errmsg( dbHandle) );
-  sqlite3_finalize( pStmt );
-  return 0;  
-  
+  int i;
+  for( i = 0; i < n; i++ )
+  {
+    char interval_datetime[25];
+    strftime(interval_datetime,25,"%Y-%m-%d %H:%M:%S", &rows[i].date);
+    sqlite3_bind_text( pStmt, 1, interval_datetime, -1, SQLITE_STATIC );
+    sqlite3_bind_text( pStmt, 2, rows[i].inverter , -1, SQLITE_STATIC);
+    sqlite3_bind_int( pStmt, 3, rows[i].serial);
+    sqlite3_bind_int( pStmt, 4, rows[i].current_power );
+    sqlite3_bind_int( pStmt, 5, rows[i].total_energy );
+    int result = sqlite3_step( pStmt );
+    if( result != SQLITE_DONE )
+      log_error( "db_set_interval_values error: %s", sqlite3_errmsg( dbHandle) );
+    put_statement( pStmt );
+    if( result != SQLITE_DONE )
+    {
+      sqlite3_exec( dbHandle, "ROLLBACK;", NULL, NULL, NULL );
+      return 0;
+    }
+  }
+  if( sqlite3_exec( dbHandle, "COMMIT;", NULL, NULL, NULL ) != SQLITE_OK )
+  {
+    log_error( "db_set_interval_values error: %s", sqlite3_errmsg( dbHandle) );
+    sqlite3_exec( dbHandle, "ROLLBACK;", NULL, NULL, NULL );
+    return 0;
+  }
+  for( i = 0; i < n; i++ )
+    daycache_update( rows[i].serial, &rows[i].date, rows[i].total_energy );
+  return 1;
 }
 
 
 /*
- * Get the start of day ETotalEnergy value for the specified day
+ * Get the start of day ETotalEnergy value of one inverter for the specified day
  * Returns 0.0f if there is no data.
  */
-long db_get_start_of_day_energy_value( struct tm *day )
+long db_get_start_of_day_energy_value( struct tm *day, char const *inverter, long unsigned int serial )
 {
   if( sqlite_open() != SQLITE_OK )
   {
@@ -315,9 +405,11 @@ long db_get_start_of_day_energy_value( struct tm *day )
     return 0;
   }
   long start_day_e = 0;
+  if( daycache_lookup( serial, day, &start_day_e ) )
+    return start_day_e;
   
-  sqlite3_stmt *pStmt = NULL;
-  int result = sqlite3_prepare_v2( dbHandle, "SELECT ETotalToday*1000 FROM DayData WHERE DateTime >= ? AND DateTime < date(?,'1 day') ORDER BY DateTime ASC;", -1, &pStmt, NULL );
+  sqlite3_stmt *pStmt = get_statement( QUERY_START_OF_DAY );
+  int result;
   if( NULL == pStmt )
   {
     log_error( "db_get_start_of_day_energy_value error: %s", sqlite3_errmsg( dbHandle) );
@@ -328,35 +420,51 @@ long db_get_start_of_day_energy_value( struct tm *day )
   strftime(charfromdate,25,"%Y-%m-%d", day);
   sqlite3_bind_text( pStmt, 1, charfromdate, -1, SQLITE_STATIC );
   sqlite3_bind_text( pStmt, 2, charfromdate, -1, SQLITE_STATIC );
+  sqlite3_bind_text( pStmt, 3, inverter, -1, SQLITE_STATIC );
+  sqlite3_bind_int( pStmt, 4, serial );
 
   result = sqlite3_step( pStmt );
   if( result == SQLITE_ROW )
   {
-    start_day_e = sqlite3_column_int( pStmt, 0 );
+    struct tm first_interval;
+    memset( &first_interval, 0, sizeof( first_interval ) );
+    strptime( (char*) sqlite3_column_text( pStmt, 0 ), "%Y-%m-%d %H:%M:%S", &first_interval );
+    start_day_e = sqlite3_column_int( pStmt, 1 );
+    daycache_store( serial, &first_interval, start_day_e );
   }
-  sqlite3_finalize( pStmt );
+  put_statement( pStmt );
   return start_day_e;  
 }
 
 
 /*
- * Set the upload date/time to NOW on the intervals between from_datetime and to_datetime inclusive
+ * Forget what has been cached of one inverter, as another connection has written intervals of it
+ */
+void db_forget_cached( long unsigned int serial )
+{
+  daycache_forget( serial );
+}
+
+
+/*
+ * Set the upload date/time of the intervals of one inverter between from_datetime and to_datetime inclusive,
+ * with the query id, on behalf of caller.
  * Return 1 for success, 0 for failure
  */
-int db_set_data_posted(struct tm *from_datetime, struct tm *to_datetime )
+static int set_data_uploaded( enum query_id id, char const *caller, struct tm *from_datetime, struct tm *to_datetime, char const *inverter, long unsigned int serial )
 {
   int retval = 0;
   if( sqlite_open() != SQLITE_OK )
   {
-    log_error( "db_set_data_posted error" );
+    log_error( "%s error", caller );
     return 0;
   }
   
-  sqlite3_stmt *pStmt = NULL;
-  int result = sqlite3_prepare_v2( dbHandle, "UPDATE DayData SET PVOutput=datetime('now','localtime') WHERE DateTime >= ? AND DateTime <= ? ;", -1, &pStmt, NULL );
+  sqlite3_stmt *pStmt = get_statement( id );
+  int result;
   if( NULL == pStmt )
   {
-    log_error( "db_set_data_posted error: %s", sqlite3_errmsg( dbHandle) );
+    log_error( "%s error: %s", caller, sqlite3_errmsg( dbHandle) );
     return 0;
   }
   char charfromdate[25];
@@ -365,6 +473,8 @@ int db_set_data_posted(struct tm *from_datetime, struct tm *to_datetime )
   strftime(chartodate,25,"%Y-%m-%d %H:%M:%S", to_datetime);
   sqlite3_bind_text( pStmt, 1, charfromdate, -1, SQLITE_STATIC );
   sqlite3_bind_text( pStmt, 2, chartodate, -1, SQLITE_STATIC );
+  sqlite3_bind_text( pStmt, 3, inverter, -1, SQLITE_STATIC );
+  sqlite3_bind_int( pStmt, 4, serial );
 
   result = sqlite3_step( pStmt );
   if( result == SQLITE_DONE )
@@ -372,20 +482,38 @@ int db_set_data_posted(struct tm *from_datetime, struct tm *to_datetime )
     retval = 1;
   }
    
-  sqlite3_finalize( pStmt );
+  put_statement( pStmt );
   return retval;  
   
 }
 
 /*
- * Return an opaque row handle pointer that can be iterated over to get the values for the specified day
+ * Set the upload date/time to NOW on the intervals of one inverter between from_datetime and to_datetime inclusive
+ * Return 1 for success, 0 for failure
+ */
+int db_set_data_posted(struct tm *from_datetime, struct tm *to_datetime, char const *inverter, long unsigned int serial )
+{
+  return set_data_uploaded( QUERY_SET_POSTED, "db_set_data_posted", from_datetime, to_datetime, inverter, serial );
+}
+
+/*
+ * Park the intervals of one inverter between from_datetime and to_datetime inclusive, PVOutput will never take them
+ * Return 1 for success, 0 for failure
+ */
+int db_set_data_rejected(struct tm *from_datetime, struct tm *to_datetime, char const *inverter, long unsigned int serial )
+{
+  return set_data_uploaded( QUERY_SET_REJECTED, "db_set_data_rejected", from_datetime, to_datetime, inverter, serial );
+}
+
+/*
+ * Return an opaque row handle pointer that can be iterated over to get the unposted values of one inverter
  * Column ID 0 = interval datetime
  * Column ID 1 = ETotalToday
  * Rows are in interval datetime order, ascending
  * Call db_row_get_column_value() and db_row_next() to get values and iterate, respectively.
  * Call db_row_handle_free() when done.
  */
-row_handle* db_get_unposted_data( struct tm *from_datetime )
+row_handle* db_get_unposted_data( struct tm *from_datetime, char const *inverter, long unsigned int serial )
 {
   if( sqlite_open() != SQLITE_OK )
   {
@@ -393,8 +521,8 @@ row_handle* db_get_unposted_data( struct tm *from_datetime )
     return NULL;
   }
   
-  sqlite3_stmt *pStmt = NULL;
-  int result = sqlite3_prepare_v2( dbHandle, "SELECT Datetime, strftime('%Y%m%d',Datetime),strftime('%H:%M',Datetime), ETotalToday*1000, CurrentPower FROM DayData WHERE DateTime >= ? AND PVOutput IS NULL AND CurrentPower > 0 ORDER BY Datetime ASC ;", -1, &pStmt, NULL );
+  sqlite3_stmt *pStmt = get_statement( QUERY_UNPOSTED );
+  int result;
   if( NULL == pStmt )
   {
     log_error( "db_get_unposted_data error: %s", sqlite3_errmsg( dbHandle) );
@@ -403,6 +531,9 @@ row_handle* db_get_unposted_data( struct tm *from_datetime )
   char charfromdate[25];
   strftime(charfromdate,25,"%Y-%m-%d %H:%M:%S", from_datetime);
   sqlite3_bind_text( pStmt, 1, charfromdate, -1, SQLITE_STATIC );
+  //the serial is bound as it is when the intervals are written
+  sqlite3_bind_text( pStmt, 2, inverter, -1, SQLITE_STATIC );
+  sqlite3_bind_int( pStmt, 3, serial );
   
   result = sqlite3_step( pStmt );
 
@@ -410,7 +541,7 @@ row_handle* db_get_unposted_data( struct tm *from_datetime )
   {
     return (row_handle*) pStmt;
   }
-  sqlite3_finalize( pStmt );
+  put_statement( pStmt );
   return NULL;
 }
 
@@ -463,5 +594,6 @@ int db_row_next( row_handle *row )
  */
 void db_row_handle_free( row_handle *row )
 {
-  sqlite3_finalize( (sqlite3_stmt*)row );
+  //the statement belongs to the cache
+  put_statement( (sqlite3_stmt*)row );
 }
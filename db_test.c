@@ -110,7 +110,7 @@ static char * test_db_get_last_recorded_interval_datetime() {
 
   struct tm date;
   strptime( tst_date,tst_format,&date); 
-  struct tm last_date = db_get_last_recorded_interval_datetime( &date );
+  struct tm last_date = db_get_last_recorded_interval_datetime( &date, "inv", 1234567890 );
   date.tm_min = 15;
   date.tm_sec = 0;
   
@@ -124,12 +124,34 @@ static char * test_db_get_last_recorded_interval_datetime() {
   return 0;
 }
 
+static char * test_db_get_last_recorded_interval_datetime_localtime() {
+
+  //smatool asks with what localtime() gave, the lookup must not overwrite it
+  struct tm date;
+  memset( &date, 0, sizeof( date ));
+  strptime( tst_date,tst_format,&date); 
+  date.tm_isdst = -1;
+  time_t when = mktime( &date );
+  struct tm last_date = db_get_last_recorded_interval_datetime( localtime( &when ), "inv", 1234567890 );
+  date.tm_min = 15;
+  date.tm_sec = 0;
+
+  char exp[DATE_STR_LENGTH];
+  char res[DATE_STR_LENGTH];
+  strftime(exp,DATE_STR_LENGTH, tst_format ,&date);
+  strftime(res,DATE_STR_LENGTH, tst_format ,&last_date);
+
+  mu_assert_equal_string( res, exp );
+
+  return 0;
+}
+
 static char * test_db_get_last_recorded_interval_datetime_not_found() {
 
   struct tm date;
   strptime( tst_date,tst_format,&date); 
   date.tm_year++;
-  struct tm last_date = db_get_last_recorded_interval_datetime( &date );
+  struct tm last_date = db_get_last_recorded_interval_datetime( &date, "inv", 1234567890 );
   //date should be 1970-01-01 if no record found
   mu_assert_equal_int( 70, last_date.tm_year );
   mu_assert_equal_int( 0, last_date.tm_mon );
@@ -142,7 +164,7 @@ static char * test_db_get_unposted_data()
 {
   struct tm date;
   strptime( tst_date,tst_format,&date); 
-  row_handle *row = db_get_unposted_data( &date );
+  row_handle *row = db_get_unposted_data( &date, "inv", 1234567890 );
   mu_assert("No rows found", row != NULL );
   
   date.tm_sec = 0;
@@ -153,9 +175,7 @@ static char * test_db_get_unposted_data()
 
   char *got = db_row_string_data( row, 0 );
   mu_assert_equal_string( exp, got );
-  sprintf(exp,"%d.%03d", energy1 / 1000 , energy1 % 1000 );
-  got = db_row_string_data( row, 1 );
-  mu_assert_equal_string( exp, got );
+  mu_assert_equal_int( energy1, db_row_int_data( row, 3 ) );
   //next row
   mu_assert_equal_int(1, db_row_next( row )  );
   
@@ -165,17 +185,7 @@ static char * test_db_get_unposted_data()
 
   got = db_row_string_data( row, 0 );
   mu_assert_equal_string( exp, got );
-  sprintf(exp,"%d.%03d", energy2 / 1000 , energy2 % 1000 );
-  got = db_row_string_data( row, 1 );
-  //code to ensure fetched number has 3 decimal places
-  char *dotPos = strchr(got,'.');
-  if( dotPos != NULL )
-  {    
-    strcat(got,"000");
-    *(dotPos+4)='\0'; 
-  }
-  //end ensure trailing zeros
-  mu_assert_equal_string( exp, got );
+  mu_assert_equal_int( energy2, db_row_int_data( row, 3 ) );
   
   db_row_handle_free( row );
   return 0;
@@ -191,16 +201,158 @@ static char * test_db_set_data_posted(){
   to_date = from_date;
   to_date.tm_min = 15;
 
-  int result = db_set_data_posted( &from_date, &to_date );
+  int result = db_set_data_posted( &from_date, &to_date, "inv", 1234567890 );
   mu_assert_equal_int(1, result );
 
   //assert there should be no rows
-  row_handle *row = db_get_unposted_data( &from_date );
+  row_handle *row = db_get_unposted_data( &from_date, "inv", 1234567890 );
   mu_assert("should be no unposted data", row == NULL );
 
   return 0;
 }
 
+static char * test_db_set_interval_values(){
+
+  interval_row rows[2];
+  strptime( tst_date,tst_format,&rows[0].date);
+  rows[0].date.tm_sec = 0;
+  rows[0].date.tm_min = 20;
+  rows[0].inverter = "inv";
+  rows[0].serial = 1234567890;
+  rows[0].current_power = power1;
+  rows[0].total_energy = energy1;
+  rows[1] = rows[0];
+  rows[1].date.tm_min = 25;
+  rows[1].current_power = power2;
+  rows[1].total_energy = energy2;
+  mu_assert_equal_int( 1, db_set_interval_values( rows, 2 ));
+
+  row_handle *row = db_get_unposted_data( &rows[0].date, "inv", 1234567890 );
+  mu_assert("No rows found", row != NULL );
+  char exp[DATE_STR_LENGTH];
+  strftime(exp,DATE_STR_LENGTH, tst_format ,&rows[0].date);
+  mu_assert_equal_string( exp, db_row_string_data( row, 0 ) );
+  mu_assert_equal_int(1, db_row_next( row )  );
+  strftime(exp,DATE_STR_LENGTH, tst_format ,&rows[1].date);
+  mu_assert_equal_string( exp, db_row_string_data( row, 0 ) );
+  mu_assert_equal_int(0, db_row_next( row )  );
+  db_row_handle_free( row );
+  return 0;
+}
+
+/* More rows than the mysql backend puts in one statement, so a full batch
+   and the rows after it both go in */
+#define BATCH_TEST_ROWS 53
+
+static char * test_db_set_interval_values_batch(){
+
+  interval_row rows[BATCH_TEST_ROWS];
+  char exp[DATE_STR_LENGTH];
+  int i;
+
+  for( i = 0; i < BATCH_TEST_ROWS; i++ ) {
+    memset( &rows[i].date, 0, sizeof( rows[i].date ));
+    strptime( "2011-02-24 00:05:00", tst_format, &rows[i].date );
+    rows[i].date.tm_min += 5 * i;
+    rows[i].date.tm_isdst = -1;
+    mktime( &rows[i].date );
+    rows[i].inverter = "inv";
+    rows[i].serial = 1234567890;
+    rows[i].current_power = 1000 + i;
+    rows[i].total_energy = 20000 + 10 * i;
+  }
+  mu_assert_equal_int( 1, db_set_interval_values( rows, BATCH_TEST_ROWS ));
+
+  row_handle *row = db_get_unposted_data( &rows[0].date, "inv", 1234567890 );
+  mu_assert("No rows found", row != NULL );
+  for( i = 0; i < BATCH_TEST_ROWS; i++ ) {
+    strftime(exp,DATE_STR_LENGTH, tst_format ,&rows[i].date);
+    mu_assert_equal_string( exp, db_row_string_data( row, 0 ) );
+    mu_assert_equal_int( rows[i].total_energy, db_row_int_data( row, 3 ) );
+    mu_assert_equal_int( rows[i].current_power, db_row_int_data( row, 4 ) );
+    mu_assert_equal_int( i < BATCH_TEST_ROWS - 1 ? 1 : 0, db_row_next( row ) );
+  }
+  db_row_handle_free( row );
+  return 0;
+}
+
+static char * test_db_get_start_of_day_energy_value(){
+
+  interval_row row;
+  strptime( tst_date,tst_format,&row.date);
+  mu_assert_equal_int( energy1, db_get_start_of_day_energy_value( &row.date, "inv", 1234567890 ));
+  //an earlier interval moves the start of the day
+  row.date.tm_sec = 0;
+  row.date.tm_min = 5;
+  row.inverter = "inv";
+  row.serial = 1234567890;
+  row.current_power = power1;
+  row.total_energy = energy1 - 1000;
+  mu_assert_equal_int( 1, db_set_interval_values( &row, 1 ));
+  mu_assert_equal_int( energy1 - 1000, db_get_start_of_day_energy_value( &row.date, "inv", 1234567890 ));
+  return 0;
+}
+
+/* The rows of another inverter on the same day are not part of any of the above */
+static char * test_db_inverters_kept_apart(){
+
+  interval_row row;
+  char exp[DATE_STR_LENGTH];
+  strptime( tst_date,tst_format,&row.date);
+  row.date.tm_sec = 0;
+  row.date.tm_min = 1;
+  row.inverter = "inv2";
+  row.serial = 987654321;
+  row.current_power = power2;
+  row.total_energy = 5000;
+  mu_assert_equal_int( 1, db_set_interval_values( &row, 1 ));
+  mu_assert_equal_int( energy1 - 1000, db_get_start_of_day_energy_value( &row.date, "inv", 1234567890 ));
+  mu_assert_equal_int( 5000, db_get_start_of_day_energy_value( &row.date, "inv2", 987654321 ));
+  struct tm last_date = db_get_last_recorded_interval_datetime( &row.date, "inv2", 987654321 );
+  mu_assert_equal_int( 1, last_date.tm_min );
+
+  row_handle *handle = db_get_unposted_data( &row.date, "inv2", 987654321 );
+  mu_assert("No rows found", handle != NULL );
+  strftime(exp,DATE_STR_LENGTH, tst_format ,&row.date);
+  mu_assert_equal_string( exp, db_row_string_data( handle, 0 ) );
+  mu_assert_equal_int(0, db_row_next( handle )  );
+  db_row_handle_free( handle );
+
+  mu_assert_equal_int( 1, db_set_data_posted( &row.date, &row.date, "inv2", 987654321 ));
+  mu_assert("inv2 should be posted", db_get_unposted_data( &row.date, "inv2", 987654321 ) == NULL );
+  handle = db_get_unposted_data( &row.date, "inv", 1234567890 );
+  mu_assert("inv should still be unposted", handle != NULL );
+  db_row_handle_free( handle );
+  return 0;
+}
+
+/* Parked intervals are not unposted any more */
+static char * test_db_set_data_rejected(){
+
+  interval_row rows[2];
+  strptime( tst_date,tst_format,&rows[0].date);
+  rows[0].date.tm_sec = 0;
+  rows[0].date.tm_min = 30;
+  rows[0].inverter = "inv2";
+  rows[0].serial = 987654321;
+  rows[0].current_power = power1;
+  rows[0].total_energy = 6000;
+  rows[1] = rows[0];
+  rows[1].date.tm_min = 35;
+  rows[1].total_energy = 7000;
+  mu_assert_equal_int( 1, db_set_interval_values( rows, 2 ));
+
+  mu_assert_equal_int( 1, db_set_data_rejected( &rows[0].date, &rows[0].date, "inv2", 987654321 ));
+  row_handle *row = db_get_unposted_data( &rows[0].date, "inv2", 987654321 );
+  mu_assert("No rows found", row != NULL );
+  char exp[DATE_STR_LENGTH];
+  strftime(exp,DATE_STR_LENGTH, tst_format ,&rows[1].date);
+  mu_assert_equal_string( exp, db_row_string_data( row, 0 ) );
+  mu_assert_equal_int(0, db_row_next( row )  );
+  db_row_handle_free( row );
+  return 0;
+}
+
 static char * all_tests() {
   if( do_install ) mu_run_test(test_db_install_tables);
   mu_run_test(test_db_get_schema);
@@ -209,9 +361,15 @@ static char * all_tests() {
   mu_run_test(test_db_fetch_almanac_not_found);
   mu_run_test(test_db_set_interval_value);
   mu_run_test(test_db_get_last_recorded_interval_datetime);
+  mu_run_test(test_db_get_last_recorded_interval_datetime_localtime);
   mu_run_test(test_db_get_last_recorded_interval_datetime_not_found);
   mu_run_test(test_db_get_unposted_data);
   mu_run_test(test_db_set_data_posted);
+  mu_run_test(test_db_set_interval_values);
+  mu_run_test(test_db_set_interval_values_batch);
+  mu_run_test(test_db_get_start_of_day_energy_value);
+  mu_run_test(test_db_inverters_kept_apart);
+  mu_run_test(test_db_set_data_rejected);
   return 0;
 }
  
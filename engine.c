@@ -0,0 +1,277 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * The engine loop: run every ready task until it waits, then epoll_wait
+ * until the next socket is ready or the next timer on the wheel is due.
+ */
+#include "engine.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define ENGINE_EVENTS 16
+
+/* The engine in engine_run(), tasks find it here. */
+static engine_p running = 0;
+
+static long long now_ms(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long engine_now(engine_p self)
+{
+        return (unsigned long)(now_ms() - self->start_ms);
+}
+
+static void timer_add(engine_p self, engine_task_p task, long timeout_ms)
+{
+        engine_task_p * slot;
+
+        task->expires = engine_now(self) + ( timeout_ms > 0 ? timeout_ms : 0 );
+        if( task->expires <= self->tick )
+                task->expires = self->tick + 1;
+        slot = &self->wheel[task->expires & (ENGINE_WHEEL_SLOTS - 1)];
+        task->timer_prev = 0;
+        task->timer_next = *slot;
+        if( *slot )
+                (*slot)->timer_prev = task;
+        *slot = task;
+}
+
+static void timer_del(engine_p self, engine_task_p task)
+{
+        if( task->timer_prev )
+                task->timer_prev->timer_next = task->timer_next;
+        else
+                self->wheel[task->expires & (ENGINE_WHEEL_SLOTS - 1)]
+                        = task->timer_next;
+        if( task->timer_next )
+                task->timer_next->timer_prev = task->timer_prev;
+        task->timer_next = task->timer_prev = 0;
+}
+
+/* Wakes the task, because its fd is ready or its time is up. */
+static void task_wake(engine_p self, engine_task_p task, int timed_out)
+{
+        timer_del(self, task);
+        if( task->state == es_waiting )
+                epoll_ctl(self->epfd, EPOLL_CTL_DEL, task->fd, 0);
+        task->timed_out = timed_out;
+        task->state = es_ready;
+}
+
+static void expire_slot(engine_p self, int slot, unsigned long upto)
+{
+        engine_task_p task = self->wheel[slot];
+        while( task ) {
+                engine_task_p const next = task->timer_next;
+                if( task->expires <= upto )
+                        task_wake(self, task, 1);
+                task = next;
+        }
+}
+
+/* Moves the wheel up to now and wakes whoever is due. */
+static void wheel_advance(engine_p self)
+{
+        unsigned long const now = engine_now(self);
+        int slot;
+
+        if( now - self->tick >= ENGINE_WHEEL_SLOTS ) {
+                /* a full turn or more passed, every slot is due for a look */
+                for( slot=0; slot<ENGINE_WHEEL_SLOTS; slot++ )
+                        expire_slot(self, slot, now);
+                self->tick = now;
+                return;
+        }
+        while( self->tick < now ) {
+                self->tick++;
+                expire_slot(self, self->tick & (ENGINE_WHEEL_SLOTS - 1),
+                            self->tick);
+        }
+}
+
+/* Milliseconds to the next timer due within one turn of the wheel. */
+static int wheel_next(engine_p self)
+{
+        unsigned long t;
+        for( t=self->tick+1; t<=self->tick+ENGINE_WHEEL_SLOTS; t++ ) {
+                engine_task_p task = self->wheel[t & (ENGINE_WHEEL_SLOTS - 1)];
+                for( ; task; task=task->timer_next )
+                        if( task->expires == t ) {
+                                long const wait = (long)t - (long)engine_now(self);
+                                return wait > 0 ? wait : 0;
+                        }
+        }
+        return ENGINE_WHEEL_SLOTS;
+}
+
+engine_p engine_constructor(void)
+{
+        engine_p self = (engine_p)calloc(1, sizeof(engine_t));
+        if( self == 0 )
+                return 0;
+        self->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if( self->epfd < 0 ) {
+                log_error("Could not create epoll instance. %s",
+                          strerror(errno));
+                free(self);
+                return 0;
+        }
+        self->start_ms = now_ms();
+        return self;
+}
+
+void engine_destructor(engine_p self)
+{
+        if( self == 0 )
+                return;
+        while( self->tasks ) {
+                engine_task_p const next = self->tasks->next;
+                free(self->tasks->stack);
+                free(self->tasks);
+                self->tasks = next;
+        }
+        close(self->epfd);
+        free(self);
+}
+
+static void task_entry(void)
+{
+        engine_task_p const task = running->current;
+        task->fn(task->arg);
+        task->state = es_done;
+        /* returning resumes uc_link, the engine loop */
+}
+
+int engine_spawn(engine_p self, engine_task_fn fn, void * arg)
+{
+        engine_task_p task = (engine_task_p)calloc(1, sizeof(engine_task_t));
+        engine_task_p * last;
+
+        if( task == 0 || ( task->stack = malloc(ENGINE_STACK_SIZE) ) == 0 ) {
+                free(task);
+                return -1;
+        }
+        getcontext(&task->context);
+        task->context.uc_stack.ss_sp = task->stack;
+        task->context.uc_stack.ss_size = ENGINE_STACK_SIZE;
+        task->context.uc_link = &self->main;
+        makecontext(&task->context, task_entry, 0);
+        task->fn = fn;
+        task->arg = arg;
+        task->fd = -1;
+        task->state = es_ready;
+        for( last = &self->tasks; *last; last = &(*last)->next )
+                ;
+        *last = task;
+        return 0;
+}
+
+void engine_run(engine_p self)
+{
+        struct epoll_event events[ENGINE_EVENTS];
+        engine_task_p task, * link;
+        int i, n;
+
+        running = self;
+        for(;;) {
+                for( task=self->tasks; task; task=task->next ) {
+                        if( task->state != es_ready )
+                                continue;
+                        self->current = task;
+                        swapcontext(&self->main, &task->context);
+                        self->current = 0;
+                }
+                /* finished tasks give their stack back */
+                for( link=&self->tasks; *link; ) {
+                        task = *link;
+                        if( task->state == es_done ) {
+                                *link = task->next;
+                                free(task->stack);
+                                free(task);
+                        } else
+                                link = &task->next;
+                }
+                if( self->tasks == 0 )
+                        break;
+
+                n = epoll_wait(self->epfd, events, ENGINE_EVENTS,
+                               wheel_next(self));
+                if( n < 0 && errno != EINTR )
+                        log_error("epoll_wait failed. %s", strerror(errno));
+                for( i=0; i<n; i++ )
+                        task_wake(self, (engine_task_p)events[i].data.ptr, 0);
+                wheel_advance(self);
+        }
+        running = 0;
+}
+
+engine_p engine_running(void)
+{
+        return running;
+}
+
+int engine_wait(int fd, unsigned int events, long timeout_ms)
+{
+        engine_task_p const task = running ? running->current : 0;
+        struct epoll_event ev;
+
+        if( task == 0 ) {
+                struct pollfd pfd;
+                pfd.fd = fd;
+                pfd.events = ( events & EPOLLIN ? POLLIN : 0 )
+                           | ( events & EPOLLOUT ? POLLOUT : 0 );
+                return poll(&pfd, 1, timeout_ms) > 0 ? 0 : -1;
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.ptr = task;
+        if( epoll_ctl(running->epfd, EPOLL_CTL_ADD, fd, &ev) < 0 ) {
+                log_error("Cannot wait for fd %d. %s", fd, strerror(errno));
+                return -1;
+        }
+        task->fd = fd;
+        task->events = events;
+        task->state = es_waiting;
+        timer_add(running, task, timeout_ms);
+        swapcontext(&task->context, &running->main);
+        return task->timed_out ? -1 : 0;
+}
+
+void engine_sleep(long ms)
+{
+        engine_task_p const task = running ? running->current : 0;
+
+        if( task == 0 ) {
+                struct timespec ts;
+                ts.tv_sec = ms / 1000;
+                ts.tv_nsec = (ms % 1000) * 1000000L;
+                nanosleep(&ts, 0);
+                return;
+        }
+        task->state = es_sleeping;
+        timer_add(running, task, ms);
+        swapcontext(&task->context, &running->main);
+}
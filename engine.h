@@ -0,0 +1,100 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef ENGINE_H
+#define ENGINE_H
+
+/*
+ * Runs many inverter sessions in one thread. Every session is a task with
+ * its own stack; when it has to wait for its socket or for time to pass it
+ * gives the thread back to the engine, which waits for all sockets at once
+ * with epoll. Timeouts live on a timer wheel.
+ *
+ * engine_wait() and engine_sleep() may also be called outside a task, they
+ * then simply block.
+ */
+
+#include "pvlogger.h"
+#include <ucontext.h>
+
+/* Stack of a task, PollInverter and the logging below it need about 32k. */
+#define ENGINE_STACK_SIZE (256*1024)
+/* Slots on the timer wheel, one per millisecond. Must be a power of 2. */
+#define ENGINE_WHEEL_SLOTS 1024
+
+enum engine_state_enum {
+        es_ready,       /* runs on the next turn */
+        es_waiting,     /* for its socket, with a timeout */
+        es_sleeping,    /* for its timer only */
+        es_done
+};
+typedef enum engine_state_enum engine_state_t;
+
+typedef void (*engine_task_fn)(void * arg);
+
+struct engine_task_struct
+{
+        ucontext_t context;
+        void * stack;
+        engine_task_fn fn;
+        void * arg;
+        engine_state_t state;
+        /* What the task waits for and whether the wait timed out. */
+        int fd;
+        unsigned int events;
+        int timed_out;
+        /* Timer wheel: tick at which the wait ends, list of the slot. */
+        unsigned long expires;
+        struct engine_task_struct * timer_next;
+        struct engine_task_struct * timer_prev;
+        struct engine_task_struct * next;
+};
+typedef struct engine_task_struct engine_task_t;
+typedef engine_task_t * engine_task_p;
+
+struct engine_struct
+{
+        int epfd;
+        ucontext_t main;
+        engine_task_p tasks;
+        engine_task_p current;
+        engine_task_p wheel[ENGINE_WHEEL_SLOTS];
+        /* Milliseconds since the engine was made, as far as the wheel got. */
+        unsigned long tick;
+        long long start_ms;
+};
+typedef struct engine_struct engine_t;
+typedef engine_t * engine_p;
+
+engine_p engine_constructor(void);
+void engine_destructor(engine_p self);
+
+/* Adds a task that runs fn(arg) on the next engine_run().
+ * Returns 0 on success, -1 if there is no memory for its stack. */
+int engine_spawn(engine_p self, engine_task_fn fn, void * arg);
+
+/* Runs all tasks until every one of them has returned. */
+void engine_run(engine_p self);
+
+/* The engine whose task is running, 0 outside of engine_run(). */
+engine_p engine_running(void);
+
+/* Waits until fd is ready for events (EPOLLIN, EPOLLOUT) or timeout_ms
+ * passed. Returns 0 if fd is ready, -1 on timeout. */
+int engine_wait(int fd, unsigned int events, long timeout_ms);
+
+/* Lets other tasks run for ms milliseconds. */
+void engine_sleep(long ms);
+
+#endif
@@ -0,0 +1,48 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef HDLC_H
+#define HDLC_H
+
+/*
+ * Escaping of the PPP style frames inside the bluetooth packets.
+ * 7d, 7e, 11, 12 and 13 are sent as 7d followed by the byte xor 20.
+ */
+
+#define HDLC_ESCAPE 0x7d
+#define HDLC_FLAG   0x7e
+
+#include <stdint.h>
+
+#define PPPINITFCS16 0xffff /* Initial FCS value    */
+#define PPPGOODFCS16 0xf0b8 /* Good final FCS value */
+
+/* Removes escapes from len bytes of src into dest, which may be the same
+ * buffer as src. An escape as the last byte is dropped.
+ * Returns the number of bytes written. */
+int hdlc_unescape(unsigned char * dest, unsigned char const * src, int len);
+
+/* Escapes len bytes of src into dest which must not overlap src and must
+ * have room for 2*len bytes.
+ * Returns the number of bytes written. */
+int hdlc_escape(unsigned char * dest, unsigned char const * src, int len);
+
+/* Calculates a new fcs given the current fcs and the new data. */
+uint16_t hdlc_fcs16(uint16_t fcs, void const * data, int len);
+
+/* Returns 1 if the unescaped frame content between the flags, fcs
+ * included, checks out. */
+int hdlc_fcs16_good(unsigned char const * frame, int len);
+
+#endif
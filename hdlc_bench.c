@@ -0,0 +1,181 @@
+/* benchmark for the escape codec and fcs of smatool
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Builds archive data frames like the ones sent back for $ARCHIVEDATA1
+ * (a 59 byte header followed by 12 byte records of time and total
+ * energy), escapes them and times unescaping them again against the old
+ * byte at a time loop. The fcs is timed the same way.
+ *
+ * hdlc_bench [frames]
+ */
+#include "hdlc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define FRAME_RECORDS 38
+#define FRAME_LEN (59 + FRAME_RECORDS*12)
+
+/* The loop read_bluetooth() used before the codec. */
+static int old_unescape(unsigned char * dest, unsigned char const * buf, int len)
+{
+    int i, rr = 0;
+    for (i=0;i<len;i++){
+        if (buf[i] == 0x7d){
+            switch (buf[i+1]){
+                case 0x5e : dest[rr] = 0x7e; break;
+                case 0x5d : dest[rr] = 0x7d; break;
+                default : dest[rr] = buf[i+1] ^ 0x20; break;
+            }
+            i++;
+        }
+        else {
+           dest[rr] = buf[i];
+        }
+        rr++;
+    }
+    return rr;
+}
+
+/* The byte at a time fcs loop of pppfcs16(), on a table built here. */
+static uint16_t old_fcstab[256];
+
+static uint16_t old_fcs16(uint16_t fcs, unsigned char const * cp, int len)
+{
+    while (len--)
+        fcs = (fcs >> 8) ^ old_fcstab[(fcs ^ *cp++) & 0xff];
+    return fcs;
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    int nframes = argc > 1 ? atoi(argv[1]) : 4000;
+    int const rounds = 50;
+    unsigned char raw[FRAME_LEN];
+    unsigned char * wire = malloc((size_t)nframes * FRAME_LEN * 2);
+    unsigned char * plain = malloc((size_t)nframes * FRAME_LEN);
+    int * wirelen = malloc(nframes * sizeof(int));
+    unsigned char out1[FRAME_LEN], out2[FRAME_LEN], esc[FRAME_LEN * 2];
+    unsigned long long energy = 12345678;
+    unsigned int t = 1300000000;
+    long total = 0;
+    int f, r, i, len1 = 0, len2 = 0;
+    double start, t_old, t_new, t_esc, t_fold, t_fcs;
+    // keeps the timed fcs loops from being optimised away
+    volatile uint16_t sink;
+
+    for( i=0; i<256; i++ ) {
+        uint16_t v = i;
+        int b;
+        for( b=0; b<8; b++ )
+            v = (v & 1) ? (v >> 1) ^ 0x8408 : v >> 1;
+        old_fcstab[i] = v;
+    }
+    srand(1);
+    for( f=0; f<nframes; f++ ) {
+        for( i=0; i<59; i++ )
+            raw[i] = rand() & 0xff;
+        for( i=0; i<FRAME_RECORDS; i++ ) {
+            unsigned char * rec = raw + 59 + i*12;
+            int b;
+            t += 300;
+            energy += rand() % 400;
+            for( b=0; b<4; b++ ) rec[b] = (t >> (8*b)) & 0xff;
+            for( b=0; b<8; b++ ) rec[4+b] = (energy >> (8*b)) & 0xff;
+        }
+        memcpy(plain + (size_t)f*FRAME_LEN, raw, FRAME_LEN);
+        wirelen[f] = hdlc_escape(wire + (size_t)f*FRAME_LEN*2, raw, FRAME_LEN);
+        total += wirelen[f];
+    }
+
+    start = now();
+    for( r=0; r<rounds; r++ )
+        for( f=0; f<nframes; f++ )
+            len1 = old_unescape(out1, wire + (size_t)f*FRAME_LEN*2, wirelen[f]);
+    t_old = now() - start;
+
+    start = now();
+    for( r=0; r<rounds; r++ )
+        for( f=0; f<nframes; f++ )
+            len2 = hdlc_unescape(out2, wire + (size_t)f*FRAME_LEN*2, wirelen[f]);
+    t_new = now() - start;
+
+    start = now();
+    for( r=0; r<rounds; r++ )
+        for( f=0; f<nframes; f++ )
+            hdlc_escape(esc, plain + (size_t)f*FRAME_LEN, FRAME_LEN);
+    t_esc = now() - start;
+
+    start = now();
+    for( r=0; r<rounds; r++ )
+        for( f=0; f<nframes; f++ )
+            sink = old_fcs16(PPPINITFCS16, wire + (size_t)f*FRAME_LEN*2, wirelen[f]);
+    t_fold = now() - start;
+
+    start = now();
+    for( r=0; r<rounds; r++ )
+        for( f=0; f<nframes; f++ )
+            sink = hdlc_fcs16(PPPINITFCS16, wire + (size_t)f*FRAME_LEN*2, wirelen[f]);
+    t_fcs = now() - start;
+    (void)sink;
+
+    // every frame, outside the timed loops: both unescapes give the frame
+    // back and escaping it again gives what was on the wire
+    for( f=0; f<nframes; f++ ) {
+        unsigned char const * w = wire + (size_t)f*FRAME_LEN*2;
+        len1 = old_unescape(out1, w, wirelen[f]);
+        len2 = hdlc_unescape(out2, w, wirelen[f]);
+        if( len1 != FRAME_LEN || len2 != FRAME_LEN
+            || memcmp(out1, plain + (size_t)f*FRAME_LEN, FRAME_LEN) != 0
+            || memcmp(out2, out1, FRAME_LEN) != 0 ) {
+            printf("MISMATCH between old and new unescape in frame %d\n", f);
+            return 1;
+        }
+        if( hdlc_escape(esc, out2, len2) != wirelen[f]
+            || memcmp(esc, w, wirelen[f]) != 0 ) {
+            printf("MISMATCH in escape of frame %d\n", f);
+            return 1;
+        }
+    }
+    for( f=0; f<nframes; f++ ) {
+        unsigned char const * w = wire + (size_t)f*FRAME_LEN*2;
+        if( old_fcs16(PPPINITFCS16, w, wirelen[f])
+            != hdlc_fcs16(PPPINITFCS16, w, wirelen[f]) ) {
+            printf("MISMATCH between old and new fcs in frame %d\n", f);
+            return 1;
+        }
+    }
+    printf("%d frames, %ld bytes on the wire, %d rounds\n", nframes, total, rounds);
+    printf("old unescape  %8.1f MB/s\n", total * rounds / t_old / 1e6);
+    printf("hdlc_unescape %8.1f MB/s\n", total * rounds / t_new / 1e6);
+    printf("hdlc_escape   %8.1f MB/s\n", (double)FRAME_LEN * nframes * rounds / t_esc / 1e6);
+    printf("old fcs16     %8.1f MB/s\n", total * rounds / t_fold / 1e6);
+    printf("hdlc_fcs16    %8.1f MB/s\n", total * rounds / t_fcs / 1e6);
+    free(wire);
+    free(plain);
+    free(wirelen);
+    return 0;
+}
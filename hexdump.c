@@ -1,82 +1,74 @@
 #include "logging.h"
 
 #include <stdio.h>
+#include <string.h>
 
 /* Print in hex format.
    This prints the address, the byte in hex and also the printable
    chars in ASCII.
 */
 #define HEXDUMP_LINE_LEN 16
-/* Limit plus some additional. */
-unsigned long const HEXDUMP_MAX_LINE_LEN = HEXDUMP_LINE_LEN*4+10+5;
+/* Address, hex part, ASCII part and the blanks between them. */
+#define HEXDUMP_TEXT_LEN (10 + HEXDUMP_LINE_LEN/2*5 + 1 + HEXDUMP_LINE_LEN)
+/* Lines rendered before they are handed on to the log. */
+#define HEXDUMP_BLOCK_LINES 32
 
-static char const *
-logging_hex_one_line(char * buf,
-                 char const * const data,
-                 unsigned long const line_start_addr,
-                 char const * const data_cur,
-                 char const * const data_start,
-                 char const * const data_end)
-{
-        char const * const line_end = data_cur + HEXDUMP_LINE_LEN;
-        char const * dcur = data_cur;
-        size_t size = 0;
-
-        /* Print address. */
-        size += snprintf(buf + size, HEXDUMP_MAX_LINE_LEN - size,
-                        "%08lx: ", line_start_addr);
+static char const hexdigit[16] = "0123456789abcdef";
 
-        /* Print hex part. */
-        for(unsigned long line_offset = 0 ; dcur<line_end;
-                        ++dcur, ++line_offset) {
-      if(data_start<=dcur && dcur<data_end) {
-          size += snprintf(buf + size, HEXDUMP_MAX_LINE_LEN - size,
-                           "%02x", (unsigned char)*dcur);
-      } else {
-          size += snprintf(buf + size, HEXDUMP_MAX_LINE_LEN - size, "  ");
-      }
-      if(line_offset%2==1)
-          size += snprintf(buf + size, HEXDUMP_MAX_LINE_LEN - size, " ");
-   }
+/* The ASCII column of every byte value. */
+static char hexdump_ascii[256];
+static int hexdump_ascii_ready = 0;
 
-   size += snprintf(buf + size, HEXDUMP_MAX_LINE_LEN - size, " ");
-
-   /* Print ASCII part. */
-   dcur = data_cur;
-   for(unsigned long line_offset = 0 ; dcur<line_end;
-                   ++dcur, ++line_offset)
-   {
-           if(data_start<=dcur && dcur<data_end) {
-               unsigned char const udata = (unsigned char)*dcur;
-               if(32<=udata && udata<127)
-                   size += snprintf(buf + size, HEXDUMP_MAX_LINE_LEN - size,
-                                        "%c", udata);
-               else
-                   size += snprintf(buf + size, HEXDUMP_MAX_LINE_LEN - size, ".");
-           } else {
-               size += snprintf(buf + size, HEXDUMP_MAX_LINE_LEN - size, " ");
-           }
-   }
-   return dcur;
+static void hexdump_ascii_init(void)
+{
+        int c;
+        for(c=0; c<256; c++)
+                hexdump_ascii[c] = ( 32<=c && c<127 ) ? c : '.';
+        hexdump_ascii_ready = 1;
 }
 
-static void
-logging_hex_with_offset(logging_p self, loglevel_t level,
-                char const * const desc, char const * const data,
-                unsigned long line_start_addr,
-                char const * const odata,
-                char const * const data_start,
-                char const * const data_end)
+/* Renders the line of addr, blanks for bytes outside [data_start, data_end).
+ * Returns the length written to out. */
+static int
+logging_hex_one_line(char * out, unsigned long addr,
+                     unsigned char const * const line,
+                     unsigned char const * const data_start,
+                     unsigned char const * const data_end,
+                     char const * const desc, size_t desclen)
 {
-        char const * data_cur = odata;
-        char buf[HEXDUMP_MAX_LINE_LEN + 1];
-        do
-        {
-                data_cur = logging_hex_one_line(buf, data, line_start_addr,
-                                data_cur, data_start, data_end);
-                line_start_addr += HEXDUMP_LINE_LEN;
-                logging_generic(self, level, "%s %s", buf, desc);
-        } while(data_cur < data_end);
+        char * o = out;
+        char * ascii;
+        int i;
+
+        for(i=7; i>=0; i--) {
+                o[i] = hexdigit[addr & 0xf];
+                addr >>= 4;
+        }
+        o += 8;
+        *o++ = ':';
+        *o++ = ' ';
+        ascii = o + HEXDUMP_LINE_LEN/2*5 + 1;
+        for(i=0; i<HEXDUMP_LINE_LEN; i++) {
+                unsigned char const * const p = line + i;
+                if(data_start<=p && p<data_end) {
+                        o[0] = hexdigit[*p >> 4];
+                        o[1] = hexdigit[*p & 0xf];
+                        ascii[i] = hexdump_ascii[*p];
+                } else {
+                        o[0] = o[1] = ' ';
+                        ascii[i] = ' ';
+                }
+                o += 2;
+                if(i%2==1)
+                        *o++ = ' ';
+        }
+        *o++ = ' ';
+        o += HEXDUMP_LINE_LEN;
+        *o++ = ' ';
+        memcpy(o, desc, desclen);
+        o += desclen;
+        *o++ = '\n';
+        return o - out;
 }
 
 void logging_hex(logging_p self, loglevel_t level, char const * const desc,
@@ -85,17 +77,32 @@ void logging_hex(logging_p self, loglevel_t level, char const * const desc,
 {
         if(self->loglevel>level) return;
 
-        char const * const data = (char const * const)vdata;
+        unsigned char const * const data = (unsigned char const *)vdata;
+        unsigned char const * const data_end = data + len;
         unsigned long line_start_addr
            = offset / HEXDUMP_LINE_LEN * HEXDUMP_LINE_LEN;
-    char const * const data_end = data + len;
-    unsigned long const offset_neg
-       = (offset % HEXDUMP_LINE_LEN == 0 )
-         ? 0
-         : offset % HEXDUMP_LINE_LEN;
+        unsigned char const * line = data - offset % HEXDUMP_LINE_LEN;
+        size_t const desclen = strlen(desc) < 64 ? strlen(desc) : 64;
+        char block[HEXDUMP_BLOCK_LINES * (HEXDUMP_TEXT_LEN + 1 + 64 + 1)];
+        int size = 0, lines = 0;
 
-    logging_hex_with_offset(self, level, desc, data, line_start_addr,
-                        data-offset_neg, data, data_end);
+        if(!hexdump_ascii_ready)
+                hexdump_ascii_init();
+        /* the lock is recursive, this keeps the lines of one dump together */
+        flockfile(self->logfile);
+        do {
+                size += logging_hex_one_line(block + size, line_start_addr,
+                                line, data, data_end, desc, desclen);
+                line += HEXDUMP_LINE_LEN;
+                line_start_addr += HEXDUMP_LINE_LEN;
+                if(++lines == HEXDUMP_BLOCK_LINES) {
+                        logging_lines(self, level, block, size);
+                        size = lines = 0;
+                }
+        } while(line < data_end);
+        if(size > 0)
+                logging_lines(self, level, block, size);
+        funlockfile(self->logfile);
 }
 
 #if 0
@@ -16,32 +16,143 @@
 
 /*
  * Implements basic logging.
+ *
+ * Lines are written straight to the log by the thread logging them, or
+ * after logging_start_async() queued on a ring and written by a thread of
+ * their own. Any thread may add to the ring without taking a lock: each
+ * slot carries a sequence number telling whether it is free for the
+ * position being added or holds the line of the position being written.
  */
 #include "logging.h"
 
 #include <stdlib.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <syslog.h>
 #include <sys/time.h>
 #include <time.h>
 #include <stdlib.h>
 
 logging_p logger;
 
-static void logging_timestamp(logging_p self)
+/* Room for a log line, longer ones are formatted straight to the file
+ * or, when queued, cut short. */
+#define LOG_LINE_MAX 512
+/* Buffer of the log file, written out at the flush level or when full. */
+#define LOG_BUFFER_SIZE (64*1024)
+/* Lines the writer thread may fall behind by. Must be a power of 2. */
+#define LOG_RING_SLOTS 1024
+
+struct logring_slot
+{
+        atomic_size_t seq;
+        loglevel_t level;
+        int len;
+        /* Where the message starts, behind timestamp and level. */
+        int msg;
+        char text[LOG_LINE_MAX];
+};
+
+struct logring_struct
+{
+        struct logring_slot slots[LOG_RING_SLOTS];
+        /* Next position to add a line at. */
+        atomic_size_t head;
+        /* Next position to write, only the writer thread moves it. */
+        size_t tail;
+        /* Position up to which lines are written and flushed. */
+        atomic_size_t written;
+        /* Lines lost to a full ring and lines cut to LOG_LINE_MAX. */
+        atomic_ulong dropped;
+        atomic_ulong truncated;
+        unsigned long dropped_reported;
+        /* The writer is waiting on wake for something to do. */
+        atomic_int idle;
+        atomic_int stop;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        pthread_t thread;
+};
+
+/* The logger with a writer thread, for the fork handlers. */
+static logging_p async_logger = 0;
+
+/* Writes the time of now to buf, the date is made only once a second. */
+static int logging_timestamp(char * buf)
 {
+    static __thread time_t stamp_sec;
+    static __thread char stamp[32];
+    static __thread int stamp_len = 0;
     struct timeval tv;
+    long usec;
+    int i;
+
     gettimeofday(&tv, 0);
+    if(stamp_len == 0 || tv.tv_sec != stamp_sec) {
+        struct tm localtime_res;
+        localtime_r(&tv.tv_sec, &localtime_res);
+        stamp_len = strftime(stamp, sizeof(stamp),
+                             "%Y-%m-%dT%H:%M:%S", &localtime_res);
+        stamp_sec = tv.tv_sec;
+    }
+    memcpy(buf, stamp, stamp_len);
+    buf += stamp_len;
+    *buf++ = '.';
+    usec = tv.tv_usec;
+    for(i=5; i>=0; i--) {
+        buf[i] = '0' + usec % 10;
+        usec /= 10;
+    }
+    buf[6] = ':';
+    return stamp_len + 8;
+}
 
-    struct tm localtime_res;
-    struct tm * result_localtime = localtime_r(&tv.tv_sec, &localtime_res);
+/* Formats a whole line, newline included, into line. Returns its length;
+ * *msg is set to where the message starts and *cut if it did not fit. */
+static int logging_format(char * line, int size, loglevel_t level, int * msg,
+                          int * cut, char const * format, va_list argp)
+{
+    char const * const type = level2type(level);
+    size_t const typelen = strlen(type);
+    int len, n;
 
-    char buf[64];
-    size_t const slen = strftime(buf, 64, "%Y-%m-%dT%H:%M:%S", result_localtime);
+    len = logging_timestamp(line);
+    memcpy(line + len, type, typelen);
+    len += typelen;
+    line[len++] = ':';
+    *msg = len;
+    n = vsnprintf(line + len, size - len - 1, format, argp);
+    *cut = n < 0 || len + n >= size - 1;
+    len = *cut ? size - 2 : len + n;
+    line[len++] = '\n';
+    return len;
+}
 
-    snprintf(buf + slen, 64 - slen - 1, ".%06ld:", tv.tv_usec);
+static int level2priority(loglevel_t level)
+{
+    static int const priority[] = {
+        LOG_DEBUG, LOG_DEBUG, LOG_INFO, LOG_INFO, LOG_WARNING, LOG_ERR,
+        LOG_CRIT
+    };
+    return priority[level];
+}
 
-    fprintf(self->logfile, buf);
+/* Puts a formatted line out to the sink. */
+static void logging_write(logging_p self, loglevel_t level,
+                          char const * line, int len, int msg)
+{
+    if(self->sink == ls_syslog) {
+        /* syslog has a timestamp of its own */
+        syslog(level2priority(level), "%.*s", len - msg - 1, line + msg);
+        return;
+    }
+    fwrite(line, 1, len, self->logfile);
+    if(level >= self->flushlevel)
+        fflush(self->logfile);
 }
 
 logging_p logging_constructor(FILE * logfile)
@@ -50,38 +161,366 @@ logging_p logging_constructor(FILE * logfile)
     assert(self!=0);
     self->logfile = logfile;
     self->loglevel = ll_info;
+    self->flushlevel = ll_warning;
+    self->sink = ls_file;
+    self->own_logfile = 0;
+    self->ring = 0;
+    setvbuf(logfile, 0, _IOFBF, LOG_BUFFER_SIZE);
     return self;
 }
 
 void logging_destructor(logging_p self)
 {
+    logging_stop_async(self);
     fflush(self->logfile);
     /* Do not close the logfile - this must be done by the caller.
      * This class just uses the logfile.
      * This makes it possible to use stdout or stderr for logging.
+     * Only a file opened by logging_set_target() is closed.
      */
+    if(self->own_logfile)
+        fclose(self->logfile);
+    if(self->sink == ls_syslog)
+        closelog();
     free(self);
 }
 
+int logging_set_target(logging_p self, char const * target)
+{
+    FILE * logfile;
+
+    assert(self->ring == 0);
+    if(strcmp(target, "syslog") == 0) {
+        openlog("smatool", LOG_PID, LOG_DAEMON);
+        self->sink = ls_syslog;
+        return 0;
+    }
+    if(strcmp(target, "stderr") == 0) {
+        logfile = stderr;
+    } else if((logfile = fopen(target, "a")) == 0) {
+        return -1;
+    } else {
+        setvbuf(logfile, 0, _IOFBF, LOG_BUFFER_SIZE);
+    }
+    fflush(self->logfile);
+    if(self->own_logfile)
+        fclose(self->logfile);
+    self->logfile = logfile;
+    self->own_logfile = ( logfile != stderr );
+    self->sink = ls_file;
+    return 0;
+}
+
 void logging_set_loglevel(logging_p self, loglevel_t loglevel)
 {
     self->loglevel = loglevel;
 }
 
+static void logring_wake(struct logring_struct * ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_signal(&ring->wake);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* Tells how many lines were lost since it was last told. */
+static void logring_report(logging_p self, struct logring_struct * ring)
+{
+    unsigned long const dropped = atomic_load(&ring->dropped);
+    char line[LOG_LINE_MAX];
+    int len, msg;
+
+    if(dropped == ring->dropped_reported)
+        return;
+    len = logging_timestamp(line);
+    len += snprintf(line + len, sizeof(line) - len, "%s:",
+                    level2type(ll_warning));
+    msg = len;
+    len += snprintf(line + len, sizeof(line) - len,
+                    "%lu log lines dropped, %lu cut short so far\n",
+                    dropped - ring->dropped_reported,
+                    atomic_load(&ring->truncated));
+    logging_write(self, ll_warning, line, len, msg);
+    ring->dropped_reported = dropped;
+}
+
+static void * logring_writer(void * arg)
+{
+    logging_p const self = (logging_p)arg;
+    struct logring_struct * const ring = self->ring;
+    struct logring_slot * slot;
+    struct timespec until;
+
+    for(;;) {
+        slot = &ring->slots[ring->tail & (LOG_RING_SLOTS - 1)];
+        if(atomic_load(&slot->seq) == ring->tail + 1) {
+            logging_write(self, slot->level, slot->text, slot->len, slot->msg);
+            atomic_store(&slot->seq, ring->tail + LOG_RING_SLOTS);
+            ring->tail++;
+            continue;
+        }
+        /* caught up: write out what piled up in the file buffer */
+        logring_report(self, ring);
+        if(self->sink == ls_file)
+            fflush(self->logfile);
+        atomic_store(&ring->written, ring->tail);
+        if(atomic_load(&ring->stop) && atomic_load(&ring->head) == ring->tail)
+            break;
+
+        pthread_mutex_lock(&ring->lock);
+        atomic_store(&ring->idle, 1);
+        if(atomic_load(&slot->seq) != ring->tail + 1
+           && !atomic_load(&ring->stop)) {
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec++;
+            pthread_cond_timedwait(&ring->wake, &ring->lock, &until);
+        }
+        atomic_store(&ring->idle, 0);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    return 0;
+}
+
+/* Takes the slot for the next line, 0 if the ring is full. */
+static struct logring_slot * logring_reserve(struct logring_struct * ring,
+                                             size_t * pos)
+{
+    struct logring_slot * slot;
+
+    *pos = atomic_load(&ring->head);
+    for(;;) {
+        slot = &ring->slots[*pos & (LOG_RING_SLOTS - 1)];
+        intptr_t const diff = (intptr_t)atomic_load(&slot->seq) - (intptr_t)*pos;
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak(&ring->head, pos, *pos + 1))
+                return slot;
+        } else if(diff < 0) {
+            atomic_fetch_add(&ring->dropped, 1);
+            return 0;
+        } else
+            *pos = atomic_load(&ring->head);
+    }
+}
+
+/* Hands the line in slot to the writer. */
+static void logring_publish(struct logring_struct * ring,
+                            struct logring_slot * slot, size_t pos)
+{
+    atomic_store(&slot->seq, pos + 1);
+    if(atomic_load(&ring->idle))
+        logring_wake(ring);
+}
+
+/* Adds a line to the ring. Returns -1 if the ring is full. */
+static int logring_put(logging_p self, loglevel_t level,
+                       char const * format, va_list argp)
+{
+    struct logring_struct * const ring = self->ring;
+    struct logring_slot * slot;
+    size_t pos;
+    int cut;
+
+    if((slot = logring_reserve(ring, &pos)) == 0)
+        return -1;
+    slot->level = level;
+    slot->len = logging_format(slot->text, sizeof(slot->text), level,
+                               &slot->msg, &cut, format, argp);
+    if(cut)
+        atomic_fetch_add(&ring->truncated, 1);
+    logring_publish(ring, slot, pos);
+    return 0;
+}
+
+static void logring_fork_prepare(void)
+{
+    if(async_logger)
+        logging_flush(async_logger);
+}
+
+static void logring_fork_child(void)
+{
+    /* the writer thread is not copied, the child writes its lines itself */
+    if(async_logger)
+        async_logger->ring = 0;
+    async_logger = 0;
+}
+
+int logging_start_async(logging_p self)
+{
+    static int atfork_done = 0;
+    struct logring_struct * ring;
+    size_t i;
+
+    if(self->ring)
+        return 0;
+    ring = (struct logring_struct *)calloc(1, sizeof(struct logring_struct));
+    if(ring == 0)
+        return -1;
+    for(i=0; i<LOG_RING_SLOTS; i++)
+        atomic_init(&ring->slots[i].seq, i);
+    pthread_mutex_init(&ring->lock, 0);
+    pthread_cond_init(&ring->wake, 0);
+    self->ring = ring;
+    if(pthread_create(&ring->thread, 0, logring_writer, self) != 0) {
+        self->ring = 0;
+        pthread_cond_destroy(&ring->wake);
+        pthread_mutex_destroy(&ring->lock);
+        free(ring);
+        return -1;
+    }
+    if(!atfork_done) {
+        pthread_atfork(logring_fork_prepare, 0, logring_fork_child);
+        atfork_done = 1;
+    }
+    async_logger = self;
+    return 0;
+}
+
+void logging_stop_async(logging_p self)
+{
+    struct logring_struct * const ring = self->ring;
+
+    if(ring == 0)
+        return;
+    atomic_store(&ring->stop, 1);
+    logring_wake(ring);
+    pthread_join(ring->thread, 0);
+    self->ring = 0;
+    if(async_logger == self)
+        async_logger = 0;
+    pthread_cond_destroy(&ring->wake);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+}
+
+void logging_flush(logging_p self)
+{
+    struct logring_struct * const ring = self->ring;
+    struct timespec const pause = { 0, 1000000 };
+    size_t target;
+
+    if(ring == 0) {
+        fflush(self->logfile);
+        return;
+    }
+    target = atomic_load(&ring->head);
+    logring_wake(ring);
+    while((intptr_t)(atomic_load(&ring->written) - target) < 0)
+        nanosleep(&pause, 0);
+}
+
 void logging_generic(logging_p self, loglevel_t level,
                 char const * format, ...)
 {
     if(self->loglevel>level) return;
 
+    char line[LOG_LINE_MAX];
     va_list argp;
+    int len, msg, cut;
+
+    if(self->ring && level < ll_fatal) {
+        va_start(argp, format);
+        logring_put(self, level, format, argp);
+        va_end(argp);
+        return;
+    }
+    /* a fatal line is the last thing that may get out, it goes after
+     * everything queued and is written before returning */
+    if(self->ring)
+        logging_flush(self);
+
+    /* Several inverters may be polled at once - keep each line whole */
+    flockfile(self->logfile);
     va_start(argp, format);
+    len = logging_format(line, sizeof(line), level, &msg, &cut, format, argp);
+    va_end(argp);
+    if(cut && self->sink == ls_file) {
+        fwrite(line, 1, msg, self->logfile);
+        va_start(argp, format);
+        vfprintf(self->logfile, format, argp);
+        va_end(argp);
+        fputc('\n', self->logfile);
+        if(level >= self->flushlevel)
+            fflush(self->logfile);
+    } else
+        logging_write(self, level, line, len, msg);
+    funlockfile(self->logfile);
+}
 
-    logging_timestamp(self);
-    fprintf(self->logfile, level2type(level));
-    fprintf(self->logfile, ":");
-    vfprintf(self->logfile, format, argp);
-    fprintf(self->logfile, "\n");
-    fflush(self->logfile);
+void logging_lines(logging_p self, loglevel_t level,
+                   char const * text, int len)
+{
+    if(self->loglevel>level) return;
+
+    char const * const type = level2type(level);
+    size_t const typelen = strlen(type);
+    char const * const end = text + len;
+    char block[8192];
+    int prefix, size = 0;
+
+    /* all lines get the time of the first */
+    prefix = logging_timestamp(block);
+    memcpy(block + prefix, type, typelen);
+    prefix += typelen;
+    block[prefix++] = ':';
+
+    if(self->ring) {
+        while(text < end) {
+            char const * const nl = memchr(text, '\n', end - text);
+            int const n = ( nl ? nl + 1 : end ) - text;
+            struct logring_slot * slot;
+            size_t pos;
+
+            if((slot = logring_reserve(self->ring, &pos)) != 0) {
+                int const room = sizeof(slot->text) - prefix;
+                int const take = n < room ? n : room;
+                memcpy(slot->text, block, prefix);
+                memcpy(slot->text + prefix, text, take);
+                if(take < n) {
+                    slot->text[prefix + take - 1] = '\n';
+                    atomic_fetch_add(&self->ring->truncated, 1);
+                }
+                slot->level = level;
+                slot->msg = prefix;
+                slot->len = prefix + take;
+                logring_publish(self->ring, slot, pos);
+            }
+            text += n;
+        }
+        return;
+    }
+
+    /* one write for as many lines as fit the block */
+    flockfile(self->logfile);
+    size = prefix;
+    while(text < end) {
+        char const * const nl = memchr(text, '\n', end - text);
+        int const n = ( nl ? nl + 1 : end ) - text;
+
+        if(self->sink == ls_syslog) {
+            syslog(level2priority(level), "%.*s", nl ? n - 1 : n, text);
+        } else {
+            if(size > prefix && size + prefix + n > (int)sizeof(block)) {
+                fwrite(block + prefix, 1, size - prefix, self->logfile);
+                size = prefix;
+            }
+            if(size + prefix + n > (int)sizeof(block)) {
+                /* longer than the whole block */
+                fwrite(block, 1, prefix, self->logfile);
+                fwrite(text, 1, n, self->logfile);
+            } else {
+                memcpy(block + size, block, prefix);
+                memcpy(block + size + prefix, text, n);
+                size += prefix + n;
+            }
+        }
+        text += n;
+    }
+    if(size > prefix)
+        fwrite(block + prefix, 1, size - prefix, self->logfile);
+    if(self->sink == ls_file && level >= self->flushlevel)
+        fflush(self->logfile);
+    funlockfile(self->logfile);
 }
 
 char const * level2type_array[] =
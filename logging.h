@@ -18,6 +18,7 @@
 
 #include "pvlogger.h"
 #include <stdio.h>
+#include <time.h>
 
 enum loglevel_enum {
         ll_trace, ll_debug, ll_verbose, ll_info, ll_warning, ll_error,
@@ -25,12 +26,33 @@ enum loglevel_enum {
 };
 typedef enum loglevel_enum loglevel_t;
 
+/* Levels below this are compiled out, e.g. -DLOG_MIN_LEVEL=ll_info
+ * for a build without any trace and debug output. */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL ll_trace
+#endif
+
+enum logsink_enum {
+        ls_file,        /* logfile, stderr by default */
+        ls_syslog
+};
+typedef enum logsink_enum logsink_t;
+
+struct logring_struct;
+
 struct logging_struct
 {
         /* The file where to output logging. */
         FILE * logfile;
         /* Loglevel: Everything greater or equal this will be logged. */
         loglevel_t loglevel;
+        /* Lines are buffered, this level and above flush them out. */
+        loglevel_t flushlevel;
+        logsink_t sink;
+        /* The logfile was opened by logging_set_target() and is closed here. */
+        int own_logfile;
+        /* Queue of the writer thread, 0 while lines are written directly. */
+        struct logring_struct * ring;
 };
 
 typedef struct logging_struct logging_t;
@@ -39,27 +61,55 @@ typedef logging_t * logging_p;
 logging_p logging_constructor(FILE * logfile);
 void logging_set_loglevel(logging_p self, loglevel_t loglevel);
 void logging_generic(logging_p self, loglevel_t level, char const * format, ...);
+/* Logs a block of lines, each ending in a newline, as one record: they
+ * share one timestamp and go out with as few writes as possible. */
+void logging_lines(logging_p self, loglevel_t level,
+                   char const * text, int len);
 void logging_hex(logging_p self, loglevel_t level, char const * const desc,
                 void const * const data, unsigned long const len,
                 unsigned long const offset);
+/* Sends the log to target: "stderr", "syslog" or the name of a file
+ * to append to. Returns 0 on success, -1 if the file cannot be opened. */
+int logging_set_target(logging_p self, char const * target);
+/* Hands writing the lines to a background thread. Lines that do not fit
+ * its queue are dropped and counted, a fatal line waits for the queue to
+ * be written out. Returns 0 on success, -1 if the thread did not start. */
+int logging_start_async(logging_p self);
+/* Writes out what is queued and ends the writer thread. */
+void logging_stop_async(logging_p self);
+/* Writes out what is queued or buffered, waiting for the writer thread. */
+void logging_flush(logging_p self);
 void logging_destructor(logging_p self);
 
+/* Whether a line at level would be written at all. */
+static inline int logging_enabled(logging_p self, loglevel_t level)
+{
+        return level >= LOG_MIN_LEVEL && level >= self->loglevel;
+}
+
 /* The global log instance. */
 extern logging_p logger;
 
-/* Helper / Utilities */
-#define log_trace(...) logging_generic(logger, ll_trace, __VA_ARGS__)
-#define log_debug(...) logging_generic(logger, ll_debug, __VA_ARGS__)
-#define log_verbose(...) logging_generic(logger, ll_verbose, __VA_ARGS__)
-#define log_info(...) logging_generic(logger, ll_info, __VA_ARGS__)
-#define log_warning(...) logging_generic(logger, ll_warning, __VA_ARGS__)
-#define log_error(...) logging_generic(logger, ll_error, __VA_ARGS__)
-#define log_fatal(...) logging_generic(logger, ll_fatal, __VA_ARGS__)
-
+/* Helper / Utilities
+ * The level is checked before the arguments are evaluated. */
+#define log_level(lEvEl, ...) \
+        do { if( logging_enabled(logger, lEvEl) ) \
+                logging_generic(logger, lEvEl, __VA_ARGS__); } while(0)
+#define log_trace(...) log_level(ll_trace, __VA_ARGS__)
+#define log_debug(...) log_level(ll_debug, __VA_ARGS__)
+#define log_verbose(...) log_level(ll_verbose, __VA_ARGS__)
+#define log_info(...) log_level(ll_info, __VA_ARGS__)
+#define log_warning(...) log_level(ll_warning, __VA_ARGS__)
+#define log_error(...) log_level(ll_error, __VA_ARGS__)
+#define log_fatal(...) log_level(ll_fatal, __VA_ARGS__)
+
+#define hlog_level(lEvEl, dEsC, dAtA, lEn, oFfSeT) \
+        do { if( logging_enabled(logger, lEvEl) ) \
+                logging_hex(logger, lEvEl, dEsC, dAtA, lEn, oFfSeT); } while(0)
 #define hlog_trace(dEsC, dAtA, lEn, oFfSeT) \
-        logging_hex(logger, ll_trace, dEsC, dAtA, lEn, oFfSeT)
+        hlog_level(ll_trace, dEsC, dAtA, lEn, oFfSeT)
 #define hlog_debug(dEsC, dAtA, lEn, oFfSeT) \
-        logging_hex(logger, ll_debug, dEsC, dAtA, lEn, oFfSeT)
+        hlog_level(ll_debug, dEsC, dAtA, lEn, oFfSeT)
 
 char const * const level2type(loglevel_t level);
 
@@ -29,10 +29,36 @@ char * sunrise( float latitude, float longitude );
 
 /* bluetooth.c */
 
-int read_bluetooth(time_t const bt_timeout, int const sfd, int *rr,
+/* Size of the receive ring, must be a power of 2. */
+#define BT_READER_SIZE 4096
+
+/* Buffers what has been received on a socket and splits it into packets. */
+struct bt_reader_struct
+{
+        int sfd;
+        unsigned char buf[BT_READER_SIZE];
+        /* Position of the first unread byte and number of unread bytes. */
+        int start;
+        int len;
+};
+
+typedef struct bt_reader_struct bt_reader_t;
+typedef bt_reader_t * bt_reader_p;
+
+void bt_reader_init(bt_reader_p self, int const sfd);
+int bt_reader_frame(bt_reader_p self, long const timeout_ms,
+                unsigned char *frame, int const size);
+int bt_reader_drain(bt_reader_p self, long const quiet_ms);
+
+int read_bluetooth(time_t const bt_timeout, bt_reader_p reader, int *rr,
+                unsigned char *received, int cc, unsigned char *last_sent,
+                int *terminated );
+int read_bluetooth_ms(long const timeout_ms, bt_reader_p reader, int *rr,
                 unsigned char *received, int cc, unsigned char *last_sent,
                 int *terminated );
 void fix_length_received(unsigned char *received, int *len);
+int write_bluetooth(int const sfd, unsigned char const *buf, int len,
+                long const timeout_ms);
 
 #endif
 
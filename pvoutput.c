@@ -0,0 +1,143 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Persistent PVOutput client.
+ */
+#include "logging.h"
+#include "pvoutput.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static size_t pvoutput_response(void * ptr, size_t size, size_t nmemb,
+                void * data)
+{
+    pvoutput_p self = (pvoutput_p)data;
+    size_t const len = size * nmemb;
+    size_t room = sizeof(self->response) - 1 - self->response_len;
+
+    if( len < room )
+        room = len;
+    memcpy(self->response + self->response_len, ptr, room);
+    self->response_len += room;
+    self->response[self->response_len] = '\0';
+    return len;
+}
+
+pvoutput_p pvoutput_constructor(char const * url, char const * key,
+                char const * sid, double rate)
+{
+    char header[255];
+    pvoutput_p self = (pvoutput_p)calloc(1, sizeof(pvoutput_t));
+
+    if( self == 0 ) {
+        log_error("No memory for the PVOutput client");
+        return 0;
+    }
+    self->curl = curl_easy_init();
+    if( self->curl == 0 ) {
+        log_error("Unable to set up curl for PVOutput");
+        free(self);
+        return 0;
+    }
+    snprintf(self->url, sizeof(self->url), "%s", url);
+    // r2 service - key and sid are sent as headers, not in the url
+    snprintf(header, sizeof(header), "X-Pvoutput-Apikey: %s", key);
+    self->headers = curl_slist_append(self->headers, header);
+    snprintf(header, sizeof(header), "X-Pvoutput-SystemId: %s", sid);
+    self->headers = curl_slist_append(self->headers, header);
+
+    curl_easy_setopt(self->curl, CURLOPT_HTTPHEADER, self->headers);
+    curl_easy_setopt(self->curl, CURLOPT_ERRORBUFFER, self->error);
+    curl_easy_setopt(self->curl, CURLOPT_WRITEFUNCTION, pvoutput_response);
+    curl_easy_setopt(self->curl, CURLOPT_WRITEDATA, self);
+    curl_easy_setopt(self->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(self->curl, CURLOPT_CONNECTTIMEOUT, 20L);
+    curl_easy_setopt(self->curl, CURLOPT_TIMEOUT, 60L);
+    curl_easy_setopt(self->curl, CURLOPT_NOSIGNAL, 1L);
+
+    self->rate = rate > 0 ? rate : 1;
+    self->burst = PVOUTPUT_BURST;
+    self->tokens = self->burst;
+    gettimeofday(&self->last_refill, 0);
+    return self;
+}
+
+void pvoutput_destructor(pvoutput_p self)
+{
+    if( self == 0 )
+        return;
+    curl_slist_free_all(self->headers);
+    curl_easy_cleanup(self->curl);
+    free(self);
+}
+
+/* Blocks until a token is available and takes it. */
+static void pvoutput_wait_token(pvoutput_p self)
+{
+    for( ;; ) {
+        struct timeval now;
+        gettimeofday(&now, 0);
+        self->tokens += ((now.tv_sec - self->last_refill.tv_sec)
+                + (now.tv_usec - self->last_refill.tv_usec) / 1e6) * self->rate;
+        if( self->tokens > self->burst )
+            self->tokens = self->burst;
+        self->last_refill = now;
+        if( self->tokens >= 1 ) {
+            self->tokens -= 1;
+            return;
+        }
+        usleep((useconds_t)((1 - self->tokens) / self->rate * 1e6));
+    }
+}
+
+int pvoutput_post(pvoutput_p self, char const * data)
+{
+    char * compurl;
+    CURLcode result;
+    long status = 0;
+
+    pvoutput_wait_token(self);
+
+    compurl = (char *)malloc(strlen(self->url) + strlen(data) + 8);
+    sprintf(compurl, "%s?data=%s", self->url, data);
+    log_debug("url = %s", compurl);
+    curl_easy_setopt(self->curl, CURLOPT_URL, compurl);
+    self->error[0] = '\0';
+    self->response_len = 0;
+    self->response[0] = '\0';
+
+    result = curl_easy_perform(self->curl);
+    free(compurl);
+    if( result != CURLE_OK ) {
+        log_error("Unable to post data to PVOutput.  CURL result = %d", result);
+        log_error("Error message = %s", self->error);
+        return PVOUTPUT_RETRY;
+    }
+    curl_easy_getinfo(self->curl, CURLINFO_RESPONSE_CODE, &status);
+    log_debug("PVOutput response %ld: %s", status, self->response);
+    if( status >= 200 && status <= 299 )
+        return 0;
+    log_error("PVOutput rejected the post with %ld: %s",
+              status, self->response);
+    // 401 bad key, 403 read only key or too many requests, 429 too many requests
+    if( status >= 400 && status <= 499
+        && status != 401 && status != 403 && status != 429 )
+        return PVOUTPUT_REJECTED;
+    return PVOUTPUT_RETRY;
+}
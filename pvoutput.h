@@ -0,0 +1,67 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef PVOUTPUT_H
+#define PVOUTPUT_H
+
+/*
+ * Client for the PVOutput r2 service. One curl handle is kept for all
+ * posts, so the connection to the server stays open between batches,
+ * and a token bucket keeps the request rate within what the service
+ * allows.
+ */
+
+#include <curl/curl.h>
+#include <sys/time.h>
+
+/* Requests that may go out back to back before the rate applies. */
+#define PVOUTPUT_BURST 2
+
+struct pvoutput_struct
+{
+        CURL * curl;
+        struct curl_slist * headers;
+        char error[CURL_ERROR_SIZE];
+        /* Start of the response of the last post, for logging. */
+        char response[256];
+        int response_len;
+        char url[256];
+        /* Token bucket: tokens refill at rate per second up to burst. */
+        double rate;
+        double tokens;
+        double burst;
+        struct timeval last_refill;
+};
+typedef struct pvoutput_struct pvoutput_t;
+typedef pvoutput_t * pvoutput_p;
+
+/* url is the addstatus service, rate the number of posts per second.
+ * Returns 0 if curl cannot be set up. */
+pvoutput_p pvoutput_constructor(char const * url, char const * key,
+                char const * sid, double rate);
+void pvoutput_destructor(pvoutput_p self);
+
+/* Results of pvoutput_post when the server did not accept the data. */
+/* Transport errors, 5xx and the 4xx about the key or the request rate,
+ * the same data may go through later. */
+#define PVOUTPUT_RETRY -1
+/* Any other 4xx, the server will never take this data. */
+#define PVOUTPUT_REJECTED -2
+
+/* Posts one batch of status data (the value of the data parameter),
+ * waiting for the rate limit first.
+ * Returns 0 when the server accepted it, else one of the above. */
+int pvoutput_post(pvoutput_p self, char const * data);
+
+#endif
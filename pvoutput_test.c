@@ -0,0 +1,193 @@
+/* PVOutput client test program for smatool
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Runs the client against a stand-in for the r2 service on the loopback
+ * interface. The stand-in answers every post with the status code given
+ * as its data and sends the system id header back as the body, so one
+ * connection covers each kind of answer.
+ */
+
+#include "logging.h"
+#include "pvoutput.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "minunit.h"
+
+int tests_run = 0;
+char url[64];
+pid_t standin = -1;
+
+/* Reads one request up to the blank line. Returns its length, 0 when the client has gone */
+static int read_request( int s, char *request, int size )
+{
+  int len = 0, n;
+  request[0] = '\0';
+  while( strstr( request, "\r\n\r\n" ) == NULL )
+  {
+    if( len >= size - 1 || ( n = recv( s, request + len, size - 1 - len, 0 )) <= 0 )
+      return 0;
+    len += n;
+    request[len] = '\0';
+  }
+  return len;
+}
+
+/* The stand-in itself, answers posts until it is killed */
+static void run_standin( int listener )
+{
+  char request[4096], response[512], sid[64];
+  int s;
+
+  while(( s = accept( listener, NULL, NULL )) >= 0 )
+  {
+    //the client keeps the connection open between posts
+    while( read_request( s, request, sizeof( request )) > 0 )
+    {
+      char *data = strstr( request, "?data=" );
+      char *header = strstr( request, "X-Pvoutput-SystemId: " );
+      int status = data ? atoi( data + 6 ) : 400;
+      sid[0] = '\0';
+      if( header )
+        sscanf( header + 21, "%63s", sid );
+      int len = snprintf( response, sizeof( response ),
+                          "HTTP/1.1 %d Test\r\nContent-Length: %d\r\n\r\n%s",
+                          status, (int)strlen( sid ), sid );
+      if( send( s, response, len, 0 ) != len )
+        break;
+    }
+    close( s );
+  }
+  exit( 0 );
+}
+
+/* Starts the stand-in on a free port and sets url. Returns 0 on success */
+static int start_standin( void )
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof( addr );
+  int listener = socket( AF_INET, SOCK_STREAM, 0 );
+
+  memset( &addr, 0, sizeof( addr ));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  if( listener < 0
+      || bind( listener, (struct sockaddr *)&addr, sizeof( addr )) < 0
+      || listen( listener, 4 ) < 0
+      || getsockname( listener, (struct sockaddr *)&addr, &addrlen ) < 0 )
+    return -1;
+  sprintf( url, "http://127.0.0.1:%d/service/r2/addstatus.jsp", ntohs( addr.sin_port ));
+  if(( standin = fork()) < 0 )
+    return -1;
+  if( standin == 0 )
+    run_standin( listener );
+  close( listener );
+  return 0;
+}
+
+static void stop_standin( void )
+{
+  if( standin > 0 )
+  {
+    kill( standin, SIGTERM );
+    waitpid( standin, NULL, 0 );
+    standin = -1;
+  }
+}
+
+static char * test_pvoutput_accepted()
+{
+  pvoutput_p pvoutput = pvoutput_constructor( url, "key", "1234", 100 );
+  mu_assert("No client", pvoutput != NULL );
+  mu_assert_equal_int( 0, pvoutput_post( pvoutput, "200" ));
+  //the system id went as a header
+  mu_assert_equal_string( "1234", pvoutput->response );
+  mu_assert_equal_int( 0, pvoutput_post( pvoutput, "201" ));
+  pvoutput_destructor( pvoutput );
+  return 0;
+}
+
+static char * test_pvoutput_rejected()
+{
+  pvoutput_p pvoutput = pvoutput_constructor( url, "key", "1234", 100 );
+  mu_assert("No client", pvoutput != NULL );
+  mu_assert_equal_int( PVOUTPUT_REJECTED, pvoutput_post( pvoutput, "400" ));
+  mu_assert_equal_int( PVOUTPUT_REJECTED, pvoutput_post( pvoutput, "404" ));
+  //the key and the request rate are not about the data
+  mu_assert_equal_int( PVOUTPUT_RETRY, pvoutput_post( pvoutput, "401" ));
+  mu_assert_equal_int( PVOUTPUT_RETRY, pvoutput_post( pvoutput, "403" ));
+  mu_assert_equal_int( PVOUTPUT_RETRY, pvoutput_post( pvoutput, "429" ));
+  //and the connection is still good after all of them
+  mu_assert_equal_int( 0, pvoutput_post( pvoutput, "200" ));
+  pvoutput_destructor( pvoutput );
+  return 0;
+}
+
+static char * test_pvoutput_server_error()
+{
+  pvoutput_p pvoutput = pvoutput_constructor( url, "key", "1234", 100 );
+  mu_assert("No client", pvoutput != NULL );
+  mu_assert_equal_int( PVOUTPUT_RETRY, pvoutput_post( pvoutput, "500" ));
+  mu_assert_equal_int( PVOUTPUT_RETRY, pvoutput_post( pvoutput, "503" ));
+  pvoutput_destructor( pvoutput );
+  return 0;
+}
+
+static char * test_pvoutput_no_server()
+{
+  pvoutput_p pvoutput = pvoutput_constructor( url, "key", "1234", 100 );
+  mu_assert("No client", pvoutput != NULL );
+  stop_standin();
+  mu_assert_equal_int( PVOUTPUT_RETRY, pvoutput_post( pvoutput, "200" ));
+  pvoutput_destructor( pvoutput );
+  return 0;
+}
+
+static char * all_tests() {
+  mu_run_test(test_pvoutput_accepted);
+  mu_run_test(test_pvoutput_rejected);
+  mu_run_test(test_pvoutput_server_error);
+  mu_run_test(test_pvoutput_no_server);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  log_init();
+  logging_set_loglevel( logger, ll_fatal );
+  if( start_standin() < 0 )
+  {
+    puts("Cannot start the PVOutput stand-in");
+    return 1;
+  }
+
+  char *result = all_tests();
+  if (result != 0) {
+      printf("Test %s failed. %s.\n", t_name, result);
+  }
+  else {
+      printf("ALL TESTS PASSED\n");
+  }
+  printf("Tests run: %d\n", tests_run);
+  stop_standin();
+
+  return result != 0;
+}
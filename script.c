@@ -0,0 +1,239 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Compiles the command file once so the send/receive loops do not have
+ * to tokenise and look up every line on every exchange.
+ */
+#include "script.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+static char const * accepted_strings[] = {
+"$END",
+"$ADDR",
+"$TIME",
+"$SER",
+"$CRC",
+"$POW",
+"$DTOT",
+"$ADD2",
+"$CHAN",
+"$ITIME",
+"$TMMI",
+"$TMPL",
+"$TIMESTRING",
+"$TIMEFROM1",
+"$TIMETO1",
+"$TIMEFROM2",
+"$TIMETO2",
+"$TESTDATA",
+"$ARCHIVEDATA1",
+"$PASSWORD",
+"$SIGNAL",
+"$UNKNOWN",
+"$INVCODE",
+"$ARCHCODE",
+"$INVERTERDATA",
+"$CNT",         /*Counter of sent packets*/
+"$TIMEZONE",    /*Timezone seconds +1 from GMT*/
+"$TIMESET"      /*Unknown string involved in time setting*/
+};
+
+#define NUM_ACCEPTED_STRINGS \
+        ((int)(sizeof(accepted_strings)/sizeof(*accepted_strings)))
+
+static int select_str(char const * s)
+{
+    int i;
+    for (i=0; i < NUM_ACCEPTED_STRINGS; i++)
+    {
+       if (!strcmp(s, accepted_strings[i])) return i;
+    }
+    return -1;
+}
+
+char const * script_var_name(script_var_t var)
+{
+    if( var < 0 || var >= NUM_ACCEPTED_STRINGS )
+        return "bytes";
+    return accepted_strings[var];
+}
+
+static int is_hex_byte(char const * s)
+{
+    return strlen(s) == 2 && isxdigit((unsigned char)s[0])
+            && isxdigit((unsigned char)s[1]);
+}
+
+static void script_add_op(script_p self, script_optype_t type, int line,
+                char const * label)
+{
+    self->ops = (script_op_t *)realloc(self->ops,
+                    sizeof(script_op_t) * (self->nops + 1));
+    script_op_t * op = self->ops + self->nops;
+    op->type = type;
+    op->line = line;
+    strncpy(op->label, label ? label : "", sizeof(op->label) - 1);
+    op->label[sizeof(op->label) - 1] = '\0';
+    op->first_item = self->nitems;
+    op->nitems = 0;
+    self->nops++;
+}
+
+static void script_add_var(script_p self, script_var_t var)
+{
+    self->items = (script_item_t *)realloc(self->items,
+                    sizeof(script_item_t) * (self->nitems + 1));
+    script_item_t * item = self->items + self->nitems;
+    item->var = var;
+    item->offset = 0;
+    item->len = 0;
+    self->nitems++;
+    self->ops[self->nops - 1].nitems++;
+}
+
+/* Literal bytes following each other are packed into one run. */
+static void script_add_byte(script_p self, unsigned char byte)
+{
+    script_op_t * op = self->ops + self->nops - 1;
+    script_item_t * last = op->nitems > 0
+            ? self->items + self->nitems - 1 : 0;
+
+    self->bytes = (unsigned char *)realloc(self->bytes, self->nbytes + 1);
+    self->bytes[self->nbytes] = byte;
+    if( last != 0 && last->var == sv_bytes
+        && last->offset + last->len == self->nbytes ) {
+        last->len++;
+    } else {
+        script_add_var(self, sv_bytes);
+        self->items[self->nitems - 1].offset = self->nbytes;
+        self->items[self->nitems - 1].len = 1;
+    }
+    self->nbytes++;
+}
+
+/* Compiles one line. Returns 0 on success, -1 on error. */
+static int script_compile_line(script_p self, char * line, int linenum)
+{
+    static char const delim[] = " \t;\r\n";
+    char * token = strtok(line, delim);
+    script_optype_t type;
+
+    if( token == 0 )
+        return 0;
+    if( token[0] == ':' ) {
+        script_add_op(self, so_label, linenum, token);
+        return 0;
+    }
+    if( !strcmp(token, "S") )
+        type = so_send;
+    else if( !strcmp(token, "R") )
+        type = so_receive;
+    else if( !strcmp(token, "E") )
+        type = so_extract;
+    else
+        return 0; /* comments and anything else are ignored */
+
+    script_add_op(self, type, linenum, 0);
+    while(( token = strtok(0, delim) ) != 0 ) {
+        if( token[0] == '$' ) {
+            int var = select_str(token);
+            if( var < 0 ) {
+                log_error("[%d] Unknown variable [%s] in command file",
+                          linenum, token);
+                return -1;
+            }
+            if( var == sv_end )
+                return 0;
+            script_add_var(self, (script_var_t)var);
+        } else if( is_hex_byte(token) ) {
+            if( type == so_extract ) {
+                log_error("[%d] Bytes [%s] in an extract line",
+                          linenum, token);
+                return -1;
+            }
+            script_add_byte(self,
+                            (unsigned char)strtoul(token, 0, 16));
+        } else {
+            log_error("[%d] Cannot understand [%s] in command file",
+                      linenum, token);
+            return -1;
+        }
+    }
+    log_error("[%d] Line does not end with $END", linenum);
+    return -1;
+}
+
+script_p script_constructor(char const * filename)
+{
+    FILE * fp;
+    char line[400];
+    int linenum = 0;
+
+    if(( fp=fopen(filename,"r")) == (FILE *)NULL )
+    {
+        log_fatal("Error! Could not open file %s", filename);
+        return 0;
+    }
+    script_p self = (script_p)calloc(1, sizeof(script_t));
+    while (fgets(line,400,fp) != NULL) {
+        linenum++;
+        /* The unit conversion table is read by InitReturnKeys. */
+        if( strncmp(line, ":unit conversions", 17) == 0 )
+            break;
+        if( script_compile_line(self, line, linenum) < 0 ) {
+            fclose(fp);
+            script_destructor(self);
+            return 0;
+        }
+    }
+    fclose(fp);
+    log_debug("Compiled %s: %d ops, %d items, %d bytes",
+              filename, self->nops, self->nitems, self->nbytes);
+    return self;
+}
+
+void script_destructor(script_p self)
+{
+    free(self->ops);
+    free(self->items);
+    free(self->bytes);
+    free(self);
+}
+
+int script_label(script_p self, char const * label)
+{
+    int pc;
+    for( pc=0; pc<self->nops; pc++ ) {
+        if( self->ops[pc].type == so_label
+            && !strcmp(self->ops[pc].label, label) )
+            return pc + 1;
+    }
+    return -1;
+}
+
+int script_next_label(script_p self, int pc)
+{
+    for( pc++; pc<self->nops; pc++ ) {
+        if( self->ops[pc].type == so_label )
+            break;
+    }
+    return pc;
+}
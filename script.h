@@ -0,0 +1,91 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+/*
+ * The command file (sma.in.new) compiled into a program.
+ * Every S/R/E line becomes an op holding a list of items. An item is
+ * either a run of literal bytes or one of the $ variables.
+ */
+
+/* The $ variables - in the same order as their names in script.c */
+enum script_var_enum {
+        sv_end, sv_addr, sv_time, sv_ser, sv_crc, sv_pow, sv_dtot, sv_add2,
+        sv_chan, sv_itime, sv_tmmi, sv_tmpl, sv_timestring, sv_timefrom1,
+        sv_timeto1, sv_timefrom2, sv_timeto2, sv_testdata, sv_archivedata1,
+        sv_password, sv_signal, sv_unknown, sv_invcode, sv_archcode,
+        sv_inverterdata, sv_cnt, sv_timezone, sv_timeset,
+        /* Item is a run of literal bytes, not a variable. */
+        sv_bytes = -1
+};
+typedef enum script_var_enum script_var_t;
+
+enum script_op_enum {
+        so_send, so_receive, so_extract, so_label
+};
+typedef enum script_op_enum script_optype_t;
+
+struct script_item_struct
+{
+        script_var_t var;
+        /* Literal bytes: position and length in the program byte pool. */
+        int offset;
+        int len;
+};
+typedef struct script_item_struct script_item_t;
+
+struct script_op_struct
+{
+        script_optype_t type;
+        /* Line in the command file, for logging. */
+        int line;
+        /* Label name, only for so_label. */
+        char label[40];
+        /* Items of this op are items[first_item .. first_item+nitems-1]. */
+        int first_item;
+        int nitems;
+};
+typedef struct script_op_struct script_op_t;
+
+struct script_struct
+{
+        script_op_t * ops;
+        int nops;
+        script_item_t * items;
+        int nitems;
+        unsigned char * bytes;
+        int nbytes;
+};
+typedef struct script_struct script_t;
+typedef script_t * script_p;
+
+/* Compiles the command file. Returns 0 if the file cannot be read or
+ * contains something that is not understood. */
+script_p script_constructor(char const * filename);
+void script_destructor(script_p self);
+
+/* Returns the index of the op following the label, -1 if there is no
+ * such label. */
+int script_label(script_p self, char const * label);
+
+/* Returns the index of the first label after op pc, nops if there is
+ * none. */
+int script_next_label(script_p self, int pc);
+
+/* Returns the name of a $ variable, for logging. */
+char const * script_var_name(script_var_t var);
+
+#endif
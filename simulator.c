@@ -0,0 +1,540 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Simulated SMA inverters, to load test the poller without hardware.
+ */
+#define _GNU_SOURCE /* for posix_openpt and accept4, before the includes */
+#include "simulator.h"
+#include "logging.h"
+#include "hdlc.h"
+#include "engine.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Start of the made up energy counters, 2000-01-01. */
+#define SIM_EPOCH 946684800L
+/* Where the data of a PPP frame starts in its first packet. */
+#define SIM_DATA 59
+
+/* Live values sent, by the two bytes that tell the channel. */
+static unsigned char const sim_channels[][2] = {
+        { 0x3f, 0x26 },         /* total power */
+        { 0x40, 0x46 },         /* output phase 1 */
+        { 0x48, 0x46 },         /* line voltage phase 1 */
+        { 0x50, 0x46 },         /* line current phase 1 */
+        { 0x57, 0x46 }          /* grid frequency */
+};
+#define SIM_CHANNELS (int)(sizeof(sim_channels) / sizeof(sim_channels[0]))
+
+struct sim_connection_struct
+{
+        sim_p sim;
+        int fd;
+};
+
+static void put_le(unsigned char * p, uint32_t v, int len)
+{
+        int i;
+        for( i=0; i<len; i++, v >>= 8 )
+                p[i] = v & 0xff;
+}
+
+static uint32_t get_le(unsigned char const * p, int len)
+{
+        uint32_t v = 0;
+        while( len-- > 0 )
+                v = ( v << 8 ) | p[len];
+        return v;
+}
+
+/* Address bytes run from 20 to 6f, clear of what has to be escaped. */
+static unsigned char sim_digit(int index, int place)
+{
+        while( place-- > 0 )
+                index /= 80;
+        return 0x20 + index % 80;
+}
+
+sim_p sim_constructor(int index, char const * dir, long latency_ms, int loss)
+{
+        sim_p self;
+        struct sockaddr_un addr;
+        struct termios tio;
+        char const * name;
+        int i;
+
+        self = (sim_p)calloc(1, sizeof(sim_t));
+        if( self == 0 )
+                return 0;
+        for( i=0; i<3; i++ )
+                self->address[i] = sim_digit(index, i);
+        self->address[3] = 0x25;
+        self->address[4] = 0x80;
+        self->address[5] = 0x00;
+        for( i=0; i<6; i++ )
+                self->address2[i] = 0x2a + i;
+        put_le(self->serial, 2100000000UL + index, 4);
+        snprintf(self->btaddress, sizeof(self->btaddress),
+                 "00:80:25:%02X:%02X:%02X",
+                 self->address[2], self->address[1], self->address[0]);
+        self->latency_ms = latency_ms;
+        self->loss = loss;
+        self->days = 7;
+        self->seed = index + 1;
+        if( dir == 0 ) {
+                self->pty = 1;
+                if(( self->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0
+                   ||( grantpt(self->fd) < 0 )||( unlockpt(self->fd) < 0 )
+                   ||(( name = ptsname(self->fd)) == 0 )) {
+                        log_error("Cannot open a pty. %s", strerror(errno));
+                        goto failed;
+                }
+                strncpy(self->path, name, sizeof(self->path) - 1);
+                // the packets go through as they are
+                if( tcgetattr(self->fd, &tio) == 0 ) {
+                        cfmakeraw(&tio);
+                        tcsetattr(self->fd, TCSANOW, &tio);
+                }
+                return self;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(self->path, sizeof(self->path), "%s/sim%d.sock", dir, index);
+        strcpy(addr.sun_path, self->path);
+        unlink(self->path);
+        if(( self->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0
+           ||( bind(self->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 )
+           ||( listen(self->fd, 128) < 0 )) {
+                log_error("Cannot listen on %s. %s", self->path, strerror(errno));
+                goto failed;
+        }
+        return self;
+failed:
+        if( self->fd >= 0 )
+                close(self->fd);
+        free(self);
+        return 0;
+}
+
+void sim_destructor(sim_p self)
+{
+        if( self == 0 )
+                return;
+        close(self->fd);
+        if( !self->pty )
+                unlink(self->path);
+        free(self);
+}
+
+/* Sends a packet, unless the loss rate says it is lost. */
+static int sim_send(sim_p self, int fd, unsigned char * packet, int len)
+{
+        packet[1] = len & 0xff;
+        packet[2] = len >> 8;
+        packet[3] = packet[0] ^ packet[1] ^ packet[2];
+        if(( self->loss > 0 )&&( rand_r(&self->seed) % 100 < self->loss )) {
+                self->lost++;
+                return 0;
+        }
+        self->packets++;
+        return write_bluetooth(fd, packet, len, SIM_IDLE_MS);
+}
+
+/* The start of a packet from the inverter to dest, before the length is known. */
+static void sim_header(sim_p self, unsigned char * packet,
+                unsigned char const * dest, int cmd)
+{
+        packet[0] = HDLC_FLAG;
+        memcpy(packet + 4, self->address, 6);
+        if( dest )
+                memcpy(packet + 10, dest, 6);
+        else
+                memset(packet + 10, 0, 6);
+        packet[16] = cmd & 0xff;
+        packet[17] = cmd >> 8;
+}
+
+/* What the inverter says as soon as it is connected. */
+static int sim_hello(sim_p self, int fd)
+{
+        unsigned char packet[31];
+
+        memset(packet, 0, sizeof(packet));
+        sim_header(self, packet, 0, 0x0002);
+        packet[19] = 0x04;
+        packet[20] = 0x70;
+        packet[22] = 0x01;      /* invcode */
+        packet[27] = 0x01;
+        return sim_send(self, fd, packet, sizeof(packet));
+}
+
+static int sim_address_reply(sim_p self, int fd)
+{
+        unsigned char packet[34];
+
+        memset(packet, 0, sizeof(packet));
+        sim_header(self, packet, 0, 0x0005);
+        memcpy(packet + 18, self->address, 6);
+        packet[25] = 0x01;
+        memcpy(packet + 26, self->address2, 6);
+        return sim_send(self, fd, packet, sizeof(packet));
+}
+
+static int sim_signal_reply(sim_p self, int fd)
+{
+        unsigned char packet[24];
+
+        memset(packet, 0, sizeof(packet));
+        sim_header(self, packet, 0, 0x0004);
+        packet[18] = 0x05;
+        packet[22] = 0xb4;      /* signal strength, about 70% */
+        return sim_send(self, fd, packet, sizeof(packet));
+}
+
+/*
+ * Fills in the header of a PPP frame answering request, the frame starts
+ * after the 7e at 18 of the packet so data goes at SIM_DATA-19 in ppp.
+ */
+static void sim_ppp_header(sim_p self, unsigned char * ppp,
+                unsigned char const * request, int rlen, int togo)
+{
+        memset(ppp, 0, SIM_DATA - 19);
+        ppp[0] = 0xff;
+        ppp[1] = 0x03;
+        ppp[2] = 0x60;
+        ppp[3] = 0x65;
+        ppp[5] = 0xa0;
+        if( rlen >= 39 )
+                memcpy(ppp + 6, request + 33, 6);
+        ppp[14] = 0x63;         /* SUSy id */
+        memcpy(ppp + 16, self->serial, 4);
+        put_le(ppp + 24, togo, 2);
+        if( rlen >= SIM_DATA ) {
+                ppp[26] = request[45];
+                ppp[27] = 0x80;
+                memcpy(ppp + 28, request + 47, SIM_DATA - 47);
+                ppp[28] |= 0x01;
+        }
+}
+
+/*
+ * Sends the len bytes of a PPP frame, without flags and fcs, in packets of
+ * at most SIM_PACKET_DATA bytes. The last packet carries the fcs and the
+ * closing 7e, packets before it have command 08 00.
+ */
+static int sim_send_frame(sim_p self, int fd, unsigned char * ppp, int len)
+{
+        unsigned char packet[18 + 2 + 2 * SIM_PACKET_DATA];
+        uint16_t fcs;
+        int off, n, cc, last;
+
+        fcs = hdlc_fcs16(PPPINITFCS16, ppp, len) ^ 0xffff;
+        ppp[len++] = fcs & 0xff;
+        ppp[len++] = fcs >> 8;
+        for( off=0; off<len; off+=n ) {
+                n = len - off;
+                if( n > SIM_PACKET_DATA )
+                        n = SIM_PACKET_DATA;
+                last = ( off + n == len );
+                sim_header(self, packet, self->address2, last ? 0x0001 : 0x0008);
+                cc = 18;
+                if( off == 0 )
+                        packet[cc++] = HDLC_FLAG;
+                cc += hdlc_escape(packet + cc, ppp + off, n);
+                if( last )
+                        packet[cc++] = HDLC_FLAG;
+                if( sim_send(self, fd, packet, cc) < 0 )
+                        return -1;
+        }
+        return 0;
+}
+
+/* Wh made by the end of the five minutes at t, a steady output per inverter. */
+static uint64_t sim_energy(sim_p self, time_t t)
+{
+        return 5000000ULL + (uint64_t)( t - SIM_EPOCH ) / 300
+                          * ( 100 + get_le(self->serial, 4) % 50 );
+}
+
+/* Logon and everything not known: the serial as record[16..19] */
+static int sim_info_reply(sim_p self, int fd, unsigned char const * request, int rlen)
+{
+        unsigned char ppp[SIM_FRAME_MAX];
+        unsigned char * data = ppp + SIM_DATA - 19;
+
+        sim_ppp_header(self, ppp, request, rlen, 0);
+        memset(data, 0, 28);
+        data[0] = 0x01;
+        data[1] = 0x1e;
+        data[2] = 0x82;
+        data[3] = 0x40;
+        put_le(data + 4, time(0), 4);
+        memcpy(data + 8, self->serial, 4);
+        memcpy(data + 16, self->serial, 4);
+        return sim_send_frame(self, fd, ppp, SIM_DATA - 19 + 28);
+}
+
+static int sim_time_reply(sim_p self, int fd, unsigned char const * request, int rlen)
+{
+        unsigned char ppp[SIM_FRAME_MAX];
+        unsigned char * data = ppp + SIM_DATA - 19;
+        time_t const now = time(0);
+
+        sim_ppp_header(self, ppp, request, rlen, 0);
+        memset(data, 0, 28);
+        data[0] = 0x01;
+        data[1] = 0x6d;
+        data[2] = 0x23;
+        put_le(data + 4, now, 4);
+        put_le(data + 8, now, 4);
+        put_le(data + 12, now, 4);
+        put_le(data + 16, 3600, 4);     /* time zone */
+        put_le(data + 20, 0x4f000000UL, 4);     /* when it was last set */
+        data[24] = 0x01;
+        return sim_send_frame(self, fd, ppp, SIM_DATA - 19 + 28);
+}
+
+static int sim_live_reply(sim_p self, int fd, unsigned char const * request, int rlen)
+{
+        unsigned char ppp[SIM_FRAME_MAX];
+        unsigned char * data = ppp + SIM_DATA - 19;
+        time_t const now = time(0);
+        uint32_t const power = 12 * ( 100 + get_le(self->serial, 4) % 50 );
+        uint32_t const values[SIM_CHANNELS] =
+                { power, power, 23000, power * 1000 / 230, 5000 };
+        int i;
+
+        sim_ppp_header(self, ppp, request, rlen, 0);
+        for( i=0; i<SIM_CHANNELS; i++, data += 28 ) {
+                memset(data, 0, 28);
+                data[0] = 0x01;
+                data[1] = sim_channels[i][0];
+                data[2] = sim_channels[i][1];
+                data[3] = 0x40;
+                put_le(data + 4, now, 4);
+                put_le(data + 8, values[i], 4);
+        }
+        return sim_send_frame(self, fd, ppp, data - ppp);
+}
+
+/*
+ * Five minute records of time and total energy from the request's from
+ * up to its to, as far as the inverter's history and the clock go. They
+ * come in frames of SIM_ARCHIVE_RECORDS, each telling how many follow.
+ */
+static int sim_archive_reply(sim_p self, int fd, unsigned char const * request, int rlen)
+{
+        unsigned char ppp[SIM_FRAME_MAX];
+        unsigned char * data;
+        time_t const now = time(0);
+        time_t from, to, t, oldest;
+        int frames, frame, i;
+
+        from = get_le(request + 51, 4);
+        to = get_le(request + 55, 4);
+        oldest = now - self->days * 86400L;
+        if( from < oldest )
+                from = oldest;
+        from = ( from + 299 ) / 300 * 300;
+        if( to > now )
+                to = now;
+        frames = ( to >= from ) ? (( to - from ) / 300 / SIM_ARCHIVE_RECORDS ) + 1 : 1;
+        t = from;
+        for( frame=frames-1; frame>=0; frame-- ) {
+                sim_ppp_header(self, ppp, request, rlen, frame);
+                data = ppp + SIM_DATA - 19;
+                for( i=0; ( i<SIM_ARCHIVE_RECORDS )&&( t<=to ); i++, t+=300, data+=12 ) {
+                        put_le(data, t, 4);
+                        put_le(data + 4, sim_energy(self, t) & 0xffffffffUL, 4);
+                        put_le(data + 8, sim_energy(self, t) >> 32, 4);
+                }
+                if( sim_send_frame(self, fd, ppp, data - ppp) < 0 )
+                        return -1;
+        }
+        return 0;
+}
+
+/* Answers a PPP frame of the poller, by the command at 47..50 */
+static int sim_ppp_reply(sim_p self, int fd, unsigned char const * request, int rlen)
+{
+        unsigned char const * const op = request + 47;
+
+        if( rlen < 51 )
+                return sim_info_reply(self, fd, request, rlen);
+        if(( op[0] == 0x0e )&&( op[1] == 0x01 ))
+                return 0;       /* logoff, no answer */
+        if(( op[0] == 0x0a )&&( op[1] == 0x02 )&&( op[3] == 0xf0 ))
+                return sim_time_reply(self, fd, request, rlen);
+        if(( op[0] == 0x00 )&&( op[1] == 0x02 )&&( op[3] == 0x70 )&&( rlen >= SIM_DATA ))
+                return sim_archive_reply(self, fd, request, rlen);
+        if(( op[0] == 0x00 )&&( op[1] == 0x02 )&&( op[3] == 0x51 ))
+                return sim_live_reply(self, fd, request, rlen);
+        return sim_info_reply(self, fd, request, rlen);
+}
+
+/*
+ * Reads the next request into packet. Requests are framed by 7e and their
+ * length only: smatool's length fixups leave the check byte wrong for some
+ * lengths and inverters do not mind. Returns its length, -1 when the
+ * connection is closed or idle for too long.
+ */
+static int sim_request(int fd, unsigned char * buf, int * have, unsigned char * packet)
+{
+        int len, got;
+
+        for(;;) {
+                while(( *have > 0 )&&( buf[0] != HDLC_FLAG ))
+                        memmove(buf, buf + 1, --(*have));
+                if( *have >= 3 ) {
+                        len = buf[1] | ( buf[2] << 8 );
+                        if(( len < 18 )||( len > SIM_FRAME_MAX )) {
+                                memmove(buf, buf + 1, --(*have));
+                                continue;
+                        }
+                        if( *have >= len ) {
+                                memcpy(packet, buf, len);
+                                memmove(buf, buf + len, *have - len);
+                                *have -= len;
+                                return len;
+                        }
+                }
+                if( engine_wait(fd, EPOLLIN, SIM_IDLE_MS) < 0 )
+                        return -1;
+                got = read(fd, buf + *have, 2 * SIM_FRAME_MAX - *have);
+                if(( got < 0 )&&( errno == EAGAIN ))
+                        continue;
+                if( got <= 0 )
+                        return -1;
+                *have += got;
+        }
+}
+
+/* One connection of the poller, until it goes quiet or away */
+static void sim_session(sim_p self, int fd)
+{
+        unsigned char buf[2 * SIM_FRAME_MAX];
+        unsigned char packet[SIM_FRAME_MAX], request[SIM_FRAME_MAX];
+        int len, rlen, have = 0, status = 0;
+
+        self->connections++;
+        log_debug("Simulated inverter %s connected", self->btaddress);
+        if( sim_hello(self, fd) < 0 )
+                return;
+        while(( status == 0 )
+              &&(( len = sim_request(fd, buf, &have, packet)) > 0 )) {
+                memcpy(request, packet, 3);
+                rlen = 3 + hdlc_unescape(request + 3, packet + 3, len - 3);
+                if( rlen < 18 )
+                        continue;
+                self->requests++;
+                if( self->latency_ms > 0 )
+                        engine_sleep(self->latency_ms);
+                switch( request[16] | ( request[17] << 8 )) {
+                case 0x0002:
+                        status = sim_address_reply(self, fd);
+                        break;
+                case 0x0003:
+                        status = sim_signal_reply(self, fd);
+                        break;
+                case 0x0001:
+                        if( request[18] == HDLC_FLAG )
+                                status = sim_ppp_reply(self, fd, request, rlen);
+                        break;
+                }
+        }
+        log_verbose("Simulated inverter %s: %lu requests, %lu packets sent, %lu lost",
+                    self->btaddress, self->requests, self->packets, self->lost);
+}
+
+static void sim_connection_task(void * arg)
+{
+        struct sim_connection_struct * const conn = (struct sim_connection_struct *)arg;
+
+        sim_session(conn->sim, conn->fd);
+        close(conn->fd);
+        free(conn);
+}
+
+static void sim_listen_task(void * arg)
+{
+        sim_p const self = (sim_p)arg;
+        struct sim_connection_struct * conn;
+        int fd;
+
+        for(;;) {
+                if( engine_wait(self->fd, EPOLLIN, SIM_IDLE_MS) < 0 )
+                        continue;
+                if(( fd = accept4(self->fd, 0, 0, SOCK_NONBLOCK)) < 0 )
+                        continue;
+                conn = (struct sim_connection_struct *)malloc(sizeof(*conn));
+                if( conn == 0 ) {
+                        close(fd);
+                        continue;
+                }
+                conn->sim = self;
+                conn->fd = fd;
+                if( engine_spawn(engine_running(), sim_connection_task, conn) < 0 ) {
+                        close(fd);
+                        free(conn);
+                }
+        }
+}
+
+/* A pty has one connection at a time: from when its slave is opened
+ * until the last one closes it, as seen by the hangup on the master. */
+static void sim_pty_task(void * arg)
+{
+        sim_p const self = (sim_p)arg;
+        struct pollfd pfd;
+
+        for(;;) {
+                pfd.fd = self->fd;
+                pfd.events = POLLIN;
+                if(( poll(&pfd, 1, 0) >= 0 )&&( pfd.revents & POLLHUP )) {
+                        engine_sleep(100);
+                        continue;
+                }
+                sim_session(self, self->fd);
+        }
+}
+
+void sim_run(sim_p * sims, int n)
+{
+        engine_p engine;
+        int i;
+
+        // a poller going away must not take the simulator with it
+        signal(SIGPIPE, SIG_IGN);
+        if(( engine = engine_constructor()) == 0 )
+                return;
+        for( i=0; i<n; i++ )
+                engine_spawn(engine, sims[i]->pty ? sim_pty_task : sim_listen_task, sims[i]);
+        engine_run(engine);
+        engine_destructor(engine);
+}
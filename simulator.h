@@ -0,0 +1,73 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+/*
+ * Plays SMA inverters for load tests without bluetooth hardware. A
+ * simulated inverter sits behind a Unix socket or a pseudo terminal and
+ * answers what sma.in.new sends in :init, :setup, :getlivevalues and
+ * :getrangedata: the hello and address packets, the signal strength,
+ * logon, the inverter time, live values and five minute archive records
+ * made up on the fly. Every reply waits latency_ms and each packet of it
+ * is lost with a chance of loss percent, to see how the poller's timeouts
+ * and retries hold up.
+ *
+ * The inverters run as tasks of an engine, sim_run() serves them until
+ * the process is killed.
+ */
+
+#include "pvlogger.h"
+
+/* Largest packet sent or taken, that of bt_reader_frame(). */
+#define SIM_FRAME_MAX 1024
+/* Archive records, of 12 bytes, in one PPP frame. */
+#define SIM_ARCHIVE_RECORDS 38
+/* PPP bytes, unescaped, in one bluetooth packet. */
+#define SIM_PACKET_DATA 100
+/* A connection that sends nothing for this long is dropped. */
+#define SIM_IDLE_MS 3600000L
+
+struct sim_struct
+{
+        /* In the order of the packets, the last byte of the address first. */
+        unsigned char address[6];
+        /* The address the inverter reports the poller's adapter as. */
+        unsigned char address2[6];
+        unsigned char serial[4];
+        char btaddress[20];
+        long latency_ms;
+        int loss;
+        /* Days back archive data goes. */
+        int days;
+        /* Listening socket or pty master and its name. */
+        int fd;
+        int pty;
+        char path[108];
+        unsigned int seed;
+        unsigned long connections, requests, packets, lost;
+};
+typedef struct sim_struct sim_t;
+typedef sim_t * sim_p;
+
+/* Makes the index-th simulated inverter. It listens on a Unix socket in
+ * dir, or on a new pty if dir is 0. Returns 0 on failure. */
+sim_p sim_constructor(int index, char const * dir, long latency_ms, int loss);
+void sim_destructor(sim_p self);
+
+/* Serves the n inverters until the process ends. */
+void sim_run(sim_p * sims, int n);
+
+#endif
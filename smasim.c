@@ -0,0 +1,84 @@
+/* tool to read power production data for SMA solar power convertors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Plays SMA inverters on ptys or Unix sockets, for running smatool against
+ * without bluetooth hardware:
+ *
+ *      smasim -n 3 -l 50 -p 1 &
+ *      smatool --transport /dev/pts/5 --address 00:80:25:20:20:20 ...
+ *
+ * Each inverter is printed with its bluetooth address and where it listens.
+ */
+#include "simulator.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void PrintHelp( void )
+{
+    printf( "Usage: smasim [OPTION]\n" );
+    printf( "  -n INVERTERS       number of simulated inverters default 1\n" );
+    printf( "  -l MS              latency of every answer default 0\n" );
+    printf( "  -p PERCENT         packets lost default 0\n" );
+    printf( "  -s DIRECTORY       listen on Unix sockets in DIRECTORY instead of ptys\n" );
+    printf( "  -v, -d             verbose or debug output\n" );
+}
+
+int main( int argc, char **argv )
+{
+    sim_p *sims;
+    char const *dir = NULL;
+    long latency = 0;
+    int i, n = 1, loss = 0;
+    loglevel_t loglevel = ll_info;
+
+    log_init();
+    for( i=1; i<argc; i++ ) {
+        if(( strcmp( argv[i], "-n" ) == 0 )&&( i+1 < argc ))
+            n = atoi( argv[++i] );
+        else if(( strcmp( argv[i], "-l" ) == 0 )&&( i+1 < argc ))
+            latency = atol( argv[++i] );
+        else if(( strcmp( argv[i], "-p" ) == 0 )&&( i+1 < argc ))
+            loss = atoi( argv[++i] );
+        else if(( strcmp( argv[i], "-s" ) == 0 )&&( i+1 < argc ))
+            dir = argv[++i];
+        else if( strcmp( argv[i], "-v" ) == 0 )
+            loglevel = ll_verbose;
+        else if( strcmp( argv[i], "-d" ) == 0 )
+            loglevel = ll_debug;
+        else {
+            PrintHelp();
+            exit( 0 );
+        }
+    }
+    logging_set_loglevel( logger, loglevel );
+    if(( n < 1 )||(( sims = (sim_p *)calloc( n, sizeof( sim_p ))) == NULL ))
+        exit( -1 );
+    for( i=0; i<n; i++ ) {
+        if(( sims[i] = sim_constructor( i, dir, latency, loss )) == NULL )
+            exit( -1 );
+        printf( "%s %s\n", sims[i]->btaddress, sims[i]->path );
+    }
+    fflush( stdout );
+    sim_run( sims, n );
+    for( i=0; i<n; i++ )
+        sim_destructor( sims[i] );
+    free( sims );
+    return 0;
+}
@@ -20,9 +20,16 @@
 
 #include "pvlogger.h"
 #include "logging.h"
+#include "script.h"
+#include "hdlc.h"
+#include "pvoutput.h"
+#include "engine.h"
+#include "capture.h"
+#include "simulator.h"
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
@@ -31,9 +38,17 @@
 #include <string.h>
 #include <assert.h>
 #include <sys/types.h>
-#include <curl/curl.h>
 #include "db_interface.h"
 #include <math.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <sys/time.h>
+#include <termios.h>
 
 /*
  * u16 represents an unsigned 16-bit number.  Adjust the typedef for
@@ -41,8 +56,6 @@
  */
 typedef u_int16_t u16;
 
-#define PPPINITFCS16 0xffff /* Initial FCS value    */
-#define PPPGOODFCS16 0xf0b8 /* Good final FCS value */
 #define ASSERT(x) assert(x)
 #define SCHEMA_VALUE 2      /* Current database schema */
 
@@ -63,121 +76,102 @@ typedef struct{
     char PVOutputURL[80];           /*--pvouturl     -url   */
     char PVOutputKey[80];           /*--pvoutkey     -key   */
     char PVOutputSid[20];           /*--pvoutsid     -sid   */
+    float PVOutputRate;             /* posts per second */
     char Setting[80];               /* inverter model data  */
     unsigned char InverterCode[4];  /* Unknown code inverter specific*/
     unsigned int ArchiveCode;       /* Code for archive data */
+    int  poll_interval;             /*--interval     -n     */
+    int  max_sessions;              /* inverters polled at the same time */
+    int  archive_window;            /* seconds of archive data per request */
+    int  archive_depth;             /* archive requests sent ahead */
+    char LogTarget[80];             /*--log                 */
+    char Capture[80];               /*--capture             */
+    char Replay[80];                /*--replay              */
+    char Transport[120];            /*--transport           */
+    int  sim_inverters;             /*--simulate            */
+    long sim_latency;               /*--sim-latency         */
+    int  sim_loss;                  /*--sim-loss            */
 } ConfType;
 
+/* State of a connection to an inverter, kept between polls in daemon mode */
+typedef struct{
+    int  s;                         /* rfcomm socket, -1 if not connected */
+    int  initialised;               /* :init has been run on this connection */
+    int  setuppc;                   /* command following :setup */
+    int  logged_on;                 /* logon went through and was not rejected since */
+    int  replay_fd;                 /* other end of s when replaying a capture, else -1 */
+    unsigned char address[6];
+    unsigned char address2[6];
+    unsigned char serial[4];
+    unsigned char timestr[25];
+    unsigned char tzhex[2];
+    unsigned char timeset[4];
+    unsigned char chan[1];
+    unsigned char send_count;
+    int  invcode;
+    bt_reader_t reader;             /* buffers what is received on s */
+} SessionType;
+
+/* Reading the records of a reply, see OpenStream */
+typedef struct{
+    ConfType *conf;
+    bt_reader_p reader;
+    unsigned char *stream;          /* the packet received last */
+    int  *streamlen;
+    unsigned char *last_sent;
+    int  cc;
+    int  *terminated;
+    int  pos;                       /* next record in stream */
+    int  end;                       /* end of the data in stream */
+    int  fcs_from;
+    u16  fcs;
+    int  status;                    /* -1 once reading failed or the frame is bad */
+    unsigned char spill[64];        /* a record that runs over two packets */
+} StreamType;
+
+struct archdata_type
+{
+    time_t date;
+    char const *inverter;           /* the Inverter of its conf */
+    long unsigned int serial;
+    long  accum_value;
+    long  current_value;
+};
+
+/* Archive records are committed this many at a time, a day of 5 minute values. */
+#define ARCHIVE_CHUNK 288
+
+/* Interval values of the inverters polled in one cycle, written to the
+ * database a chunk at a time while the archive streams in and the rest
+ * once every inverter is done. Rows the database did not take stay for
+ * the next write. */
+typedef struct{
+    interval_row *rows;
+    int  count;
+    int  size;
+} IntervalBatch;
+
 typedef struct{
     unsigned int    key1;
     unsigned int    key2;
     char            description[20];
     char            units[20];
     float           divisor;
+    float           scale;          /* 1/divisor */
 } ReturnType;
 
-char *accepted_strings[] = {
-"$END",
-"$ADDR",
-"$TIME",
-"$SER",
-"$CRC",
-"$POW",
-"$DTOT",
-"$ADD2",
-"$CHAN",
-"$ITIME",
-"$TMMI",
-"$TMPL",
-"$TIMESTRING",
-"$TIMEFROM1",
-"$TIMETO1",
-"$TIMEFROM2",
-"$TIMETO2",
-"$TESTDATA",
-"$ARCHIVEDATA1",
-"$PASSWORD",
-"$SIGNAL",
-"$UNKNOWN",
-"$INVCODE",
-"$ARCHCODE",
-"$INVERTERDATA",
-"$CNT",         /*Counter of sent packets*/
-"$TIMEZONE",    /*Timezone seconds +1 from GMT*/
-"$TIMESET"      /*Unknown string involved in time setting*/
-};
+/* Channels are looked up by the two key bytes of a record, key1<<8|key2,
+ * in a table holding their place in the returnkeylist plus one. */
+#define RETURN_KEY_CODES 65536
 
-int cc;
 int skip_daylight_check = 0;
-unsigned char fl[1024] = { 0 };
-
-static u16 fcstab[256] = {
-   0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
-   0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
-   0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
-   0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
-   0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
-   0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
-   0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
-   0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
-   0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
-   0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
-   0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
-   0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
-   0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
-   0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
-   0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
-   0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
-   0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
-   0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
-   0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
-   0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
-   0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
-   0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
-   0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
-   0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
-   0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
-   0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
-   0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
-   0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
-   0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
-   0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
-   0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
-   0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
-};
-
-/*
- * Calculate a new fcs given the current fcs and the new data.
- */
-u16 pppfcs16(u16 fcs, void *_cp, int len)
-{
-    register unsigned char *cp = (unsigned char *)_cp;
-    /* don't worry about the efficiency of these asserts here.  gcc will
-     * recognise that the asserted expressions are constant and remove them.
-     * Whether they are usefull is another question. 
-     */
-
-    ASSERT(sizeof (u16) == 2);
-    ASSERT(((u16) -1) > 0);
-    while (len--)
-        fcs = (fcs >> 8) ^ fcstab[(fcs ^ *cp++) & 0xff];
-    return (fcs);
-}
 
 /*
  * Strip escapes (7D) as they aren't includes in fcs
  */
 void strip_escapes(unsigned char *cp, int *len)
 {
-    int i,j;
-
-    for( i=0; i<(*len); i++ ) {
-      if( cp[i] == 0x7d ) { /*Found escape character. Need to convert*/
-        cp[i] = cp[i+1]^0x20;
-        for( j=i+1; j<(*len)-1; j++ ) cp[j] = cp[j+1];
-        (*len)--;
-      }
-   }
+    (*len) = hdlc_unescape( cp, cp, (*len) );
 }
 
 /*
@@ -185,22 +179,12 @@ void strip_escapes(unsigned char *cp, int *len)
  */
 void add_escapes(unsigned char *cp, int *len)
 {
-    int i,j;
-
-    for( i=19; i<(*len); i++ ) {
-      switch( cp[i] ) {
-        case 0x7d :
-        case 0x7e :
-        case 0x11 :
-        case 0x12 :
-        case 0x13 :
-          for( j=(*len); j>i; j-- ) cp[j] = cp[j-1];
-          cp[i+1] = cp[i]^0x20;
-          cp[i]=0x7d;
-          (*len)++;
-          break;
-      }
-   }
+    unsigned char escaped[2048];
+
+    if( (*len) <= 19 )
+        return;
+    (*len) = 19 + hdlc_escape( escaped, cp+19, (*len)-19 );
+    memcpy( cp+19, escaped, (*len)-19 );
 }
 
 /*
@@ -249,29 +233,27 @@ void fix_length_send(unsigned char *cp, int *len)
         case 0x61: cp[3]=0x1f; break;
         case 0x62: cp[3]=0x1e; break;
         default:
-                log_fatal("NO CONVERSION!");
-                abort();
+                // escapes in a timestamp can give any length, the check byte is their xor
+                cp[3] = cp[0] ^ cp[1] ^ cp[2];
+                log_debug("no conversion for length [%x]", cp[1]);
                 break;
       }
       log_debug("new sum [%x]", cp[1]+cp[3]);
 }
 
 /*
- * How to use the fcs
+ * How to use the fcs: writes the fcs of len bytes at cp to fcs[0..1]
  */
-void tryfcs16(unsigned char *cp, int len)
+void tryfcs16(unsigned char *cp, int len, unsigned char *fcs)
 {
     u16 trialfcs;
-    unsigned char stripped[1024] = { 0 };
 
-    memcpy( stripped, cp, len );
     /* add on output */
     hlog_trace("String to calculate FCS", cp, len, 0);
-    trialfcs = pppfcs16( PPPINITFCS16, stripped, len );
+    trialfcs = hdlc_fcs16( PPPINITFCS16, cp, len );
     trialfcs ^= 0xffff;                 /* complement */
-    fl[cc] = (trialfcs & 0x00ff);       /* least significant byte first */
-    fl[cc+1] = ((trialfcs >> 8) & 0x00ff);
-    cc+=2;
+    fcs[0] = (trialfcs & 0x00ff);       /* least significant byte first */
+    fcs[1] = ((trialfcs >> 8) & 0x00ff);
     log_trace("FCS = [%x%x] [%x]",
               (trialfcs & 0x00ff),((trialfcs >> 8) & 0x00ff), trialfcs);
 }
@@ -319,113 +301,23 @@ unsigned char conv(char *nn){
         tt = nn[i] - 48;
         break;
         }
-        res = res + (tt * pow(16,1-i));
+        res = (res << 4) | tt;
         }
         return res;
 }
 
+/*
+ * Check for a reply straight after sending, waiting at most 5ms
+ */
 int
-check_send_error( ConfType * conf, int *s, int *rr, unsigned char *received, int cc, unsigned char *last_sent, int *terminated, int *already_read )
+check_send_error( ConfType * conf, bt_reader_p reader, int *rr, unsigned char *received, int cc, unsigned char *last_sent, int *terminated, int *already_read )
 {
-    int bytes_read,i;
-    unsigned char buf[1024]; /*read buffer*/
-    unsigned char header[3]; /*read buffer*/
-    struct timeval tv;
-    fd_set readfds;
-
-    tv.tv_sec = 0; // set timeout of reading
-    tv.tv_usec = 5000;
-    memset(buf,0,1024);
-
-    FD_ZERO(&readfds);
-    FD_SET((*s), &readfds);
-                
-    select((*s)+1, &readfds, NULL, NULL, &tv);
-                
-    (*terminated) = 0; // Tag to tell if string has 7e termination
-    // first read the header to get the record length
-    if (FD_ISSET((*s), &readfds)){    // did we receive anything within 5 seconds
-        bytes_read = recv((*s), header, sizeof(header), 0); //Get length of string
-    (*rr) = 0;
-        for( i=0; i<sizeof(header); i++ ) {
-            received[(*rr)] = header[i];
-            log_debug("%02x ", received[(*rr)]);
-            (*rr)++;
-        }
-    }
-    else
-    {
-        log_warning("Timeout reading bluetooth socket");
-        (*rr) = 0;
-        memset(received,0,1024);
-        return -1;
-    }
-    if (FD_ISSET((*s), &readfds)){    // did we receive anything within 5 seconds
-        bytes_read = recv((*s), buf, header[1]-3, 0); //Read the length specified by header
-    }
-    else
-    {
-        log_warning("Timeout reading bluetooth socket");
-        (*rr) = 0;
-        memset(received,0,1024);
+    if( read_bluetooth_ms( 5, reader, rr, received, cc, last_sent, terminated ) != 0 )
         return -1;
-    }
-    if ( bytes_read > 0){
-        hlog_debug("Receiving - header", header, sizeof(header), 12);
-        hlog_debug("Receiving - body  ", buf, bytes_read, 0);
-
-        if ((cc==bytes_read)&&(memcmp(received,last_sent,cc) == 0)){
-           log_error( "ERROR received what we sent!" );
-           abort;
-           //Need to do something
-        }
-        if( buf[ bytes_read-1 ] == 0x7e )
-           (*terminated) = 1;
-        else
-           (*terminated) = 0;
-        for (i=0;i<bytes_read;i++){ //start copy the rec buffer in to received
-            if (buf[i] == 0x7d){ //did we receive the escape char
-            switch (buf[i+1]){   // act depending on the char after the escape char
-                    
-            case 0x5e :
-                    received[(*rr)] = 0x7e;
-                break;
-                               
-            case 0x5d :
-                received[(*rr)] = 0x7d;
-                break;
-                            
-            default :
-                received[(*rr)] = buf[i+1] ^ 0x20;
-                break;
-            }
-            i++;
-        }
-        else { 
-               received[(*rr)] = buf[i];
-        }
-        log_debug("%02x ", received[(*rr)]);
-        (*rr)++;
-    }
-    fix_length_received( received, rr );
-    hlog_debug("received", received, *rr, 0);
-
     (*already_read)=1;
-    }    
     return 0;
 }
 
-int select_str(char *s)
-{
-    int i;
-    for (i=0; i < sizeof(accepted_strings)/sizeof(*accepted_strings);i++)
-    {
-       //printf( "\ni=%d accepted=%s string=%s", i, accepted_strings[i], s );
-       if (!strcmp(s, accepted_strings[i])) return i;
-    }
-    return -1;
-}
-
 unsigned char *  get_timezone_in_seconds( unsigned char *tzhex )
 {
     time_t curtime;
@@ -472,22 +364,13 @@ unsigned char *  get_timezone_in_seconds( unsigned char *tzhex )
     return tzhex;
 }
 
-int auto_set_dates( int * daterange, int mysql, char * datefrom, char * dateto )
-/*  If there are no dates set - get last updated date and go from there to NOW */
+int auto_set_dates( int * daterange, char * datefrom, char * dateto )
+/*  If there are no dates set - go to NOW. Each inverter starts from its own last
+    updated date, see InverterDateFrom, this is where one without any starts */
 {
     time_t      curtime;
     struct tm     loctime;
     curtime = time(NULL);  //get time in seconds since epoch (1/1/1970)    
-    loctime = *(localtime(&curtime));
-    if( mysql == 1 )
-    {
-      struct tm last;
-      last = db_get_last_recorded_interval_datetime(&loctime);
-      if( last.tm_year > 100 ) //ie, after year 2000
-      {
-        strftime(datefrom, 25, "%Y-%m-%d %H:%M:%S", &last );
-      }
-    }
     if( strlen( datefrom ) == 0 )
         strcpy( datefrom, "2000-01-01 00:00:00" );
 
@@ -526,41 +409,70 @@ int is_light( )
     return 0;
 }
 
-//Convert a recieved string to a value
-long ConvertStreamtoLong( unsigned char * stream, int length, long unsigned int * value )
+/* Little endian loads of the stream, which need not be aligned. */
+static inline uint16_t GetU16( unsigned char const * p )
 {
-   int    i, nullvalue;
-   
-   (*value) = 0;
-   nullvalue = 1;
+   return (uint16_t)( p[0] | ( p[1] << 8 ));
+}
 
-   for( i=0; i < length; i++ ) 
-   {
-      if( stream[i] != 0xff ) //check if all ffs which is a null value 
-        nullvalue = 0;
-      (*value) = (*value) + stream[i]*pow(256,i);
+static inline uint32_t GetU32( unsigned char const * p )
+{
+   return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t GetU64( unsigned char const * p )
+{
+   return (uint64_t)GetU32( p ) | ((uint64_t)GetU32( p+4 ) << 32);
+}
+
+/* The inverter sends all ffs for a value it does not have, or only the
+ * sign bit for the 4 and 8 byte signed ones. */
+#define SMA_NAN_S32 0x80000000UL
+#define SMA_NAN_S64 0x8000000000000000ULL
+
+/* Reads a value of length (at most 8) bytes, 0 for the null values. */
+static uint64_t StreamValue( unsigned char const * stream, int length )
+{
+   uint64_t value, null;
+   int      i;
+
+   switch( length ) {
+   case 2:
+      value = GetU16( stream );
+      break;
+   case 4:
+      value = GetU32( stream );
+      if( value == SMA_NAN_S32 )
+         return 0;
+      break;
+   case 8:
+      value = GetU64( stream );
+      if( value == SMA_NAN_S64 )
+         return 0;
+      break;
+   default:
+      value = 0;
+      for( i=length-1; i >= 0; i-- )
+         value = ( value << 8 ) | stream[i];
+      break;
    }
-   if( nullvalue == 1 )
-      (*value) = 0; //Asigning null to 0 at this stage unless it breaks something
+   null = ( length >= 8 ) ? ~(uint64_t)0 : ((uint64_t)1 << ( 8*length )) - 1;
+   if( value == null )
+      return 0; //Asigning null to 0 at this stage unless it breaks something
+   return value;
+}
+
+//Convert a recieved string to a value
+long ConvertStreamtoLong( unsigned char * stream, int length, long unsigned int * value )
+{
+   (*value) = StreamValue( stream, length );
    return (*value);
 }
 
 //Convert a recieved string to a value
 float ConvertStreamtoFloat( unsigned char * stream, int length, float * value )
 {
-   int    i, nullvalue;
-   
-   (*value) = 0;
-   nullvalue = 1;
-
-   for( i=0; i < length; i++ ) 
-   {
-      if( stream[i] != 0xff ) //check if all ffs which is a null value 
-        nullvalue = 0;
-      (*value) = (*value) + stream[i]*pow(256,i);
-   }
-   if( nullvalue == 1 )
-      (*value) = 0; //Asigning null to 0 at this stage unless it breaks something
+   (*value) = StreamValue( stream, length );
    return (*value);
 }
 
@@ -636,44 +548,56 @@ InitReturnKeys( ConfType * conf, ReturnType * returnkeylist, int * num_return_ke
     return returnkeylist;
 }
 
+/* Builds the channel lookup of the returnkeylist, the first entry of a code wins. */
+unsigned short *
+IndexReturnKeys( ReturnType * returnkeylist, int num_return_keys )
+{
+    unsigned short *index;
+    int        j, code;
+
+    index = (unsigned short *)calloc( RETURN_KEY_CODES, sizeof( unsigned short ));
+    if( index == NULL )
+        return NULL;
+    for( j=num_return_keys-1; j >= 0; j-- ) {
+        returnkeylist[j].scale = 1.0f / returnkeylist[j].divisor;
+        if(( returnkeylist[j].key1 > 0xff )||( returnkeylist[j].key2 > 0xff ))
+            continue; // can never match a record
+        code = ( returnkeylist[j].key1 << 8 ) | returnkeylist[j].key2;
+        index[code] = j + 1;
+    }
+    return index;
+}
+
+/* Returns the channel of a live value record, NULL if it is not in the list. */
+static inline ReturnType *
+LookupReturnKey( ReturnType * returnkeylist, unsigned short const * returnkeyindex, unsigned char const * record )
+{
+    unsigned short const j = returnkeyindex[( record[1] << 8 ) | record[2]];
+    return j ? &returnkeylist[j-1] : NULL;
+}
+
 //Convert a recieved string to a value
 int ConvertStreamtoInt( unsigned char * stream, int length, int * value )
 {
-   int    i, nullvalue;
-   
-   (*value) = 0;
-   nullvalue = 1;
-
-   for( i=0; i < length; i++ ) 
-   {
-      if( stream[i] != 0xff ) //check if all ffs which is a null value 
-        nullvalue = 0;
-      (*value) = (*value) + stream[i]*pow(256,i);
-   }
-   if( nullvalue == 1 )
-      (*value) = 0; //Asigning null to 0 at this stage unless it breaks something
+   (*value) = StreamValue( stream, length );
    return (*value);
 }
 
 //Convert a recieved string to a value
 time_t ConvertStreamtoTime( unsigned char * stream, int length, time_t * value )
 {
-   int    i, nullvalue;
-   
-   (*value) = 0;
-   nullvalue = 1;
-
-   for( i=0; i < length; i++ ) 
-   {
-      if( stream[i] != 0xff ) //check if all ffs which is a null value 
-        nullvalue = 0;
-      (*value) = (*value) + stream[i]*pow(256,i);
-   }
-   if( nullvalue == 1 )
-      (*value) = 0; //Asigning null to 0 at this stage unless it breaks something
+   (*value) = StreamValue( stream, length );
    return (*value);
 }
 
+/* The PVOutput variables are all set */
+static int PVOutputConfigured( ConfType *conf )
+{
+    return(( strlen(conf->PVOutputURL) > 0 )
+         &&( strlen(conf->PVOutputKey) > 0 )
+         &&( strlen(conf->PVOutputSid) > 0 ));
+}
+
 // Set switches to save lots of strcmps
 void  SetSwitches( ConfType *conf, char * datefrom, char * dateto, int *location, int *mysql, int *post, int *file, int *daterange, int *test )  
 {
@@ -691,15 +615,16 @@ void  SetSwitches( ConfType *conf, char * datefrom, char * dateto, int *location
         (*mysql)=1;
     else
         (*mysql)=0;
+    //Don't let the daemon hammer the inverter
+    if( conf->poll_interval < 10 )
+        conf->poll_interval = 10;
     //Check if all File variables are set
     if( strlen(conf->File) > 0 )
         (*file)=1;
     else
         (*file)=0;
     //Check if all PVOutput variables are set
-    if(( strlen(conf->PVOutputURL) > 0 )
-     &&( strlen(conf->PVOutputKey) > 0 )
-     &&( strlen(conf->PVOutputSid) > 0 ))
+    if( PVOutputConfigured( conf ))
         (*post)=1;
     else
         (*post)=0;
@@ -710,48 +635,124 @@ void  SetSwitches( ConfType *conf, char * datefrom, char * dateto, int *location
         (*daterange)=0;
 }
 
-unsigned char *
-ReadStream( ConfType * conf, int * s, unsigned char * stream, int * streamlen, unsigned char * datalist, int * datalen, unsigned char * last_sent, int cc, int * terminated, int * togo )
+/*
+ * Walks the fixed size records of a reply straight out of the receive buffer.
+ * The PPP frame may run over several packets: it starts after the 7e at 18 of
+ * the first one and the continuation packets carry it from 18. A record split
+ * over two packets is put together in spill. A first packet without the 7e,
+ * such as a continuation whose frame lost its start, is not read at all.
+ */
+void OpenStream( StreamType *st, ConfType *conf, bt_reader_p reader, unsigned char *stream, int *streamlen,
+                 unsigned char *last_sent, int cc, int *terminated, int *togo )
 {
-   int    finished;
-   int    finished_record;
-   int  i, j=0;
-
-   (*togo)=ConvertStreamtoInt( stream+43, 2, togo );
+   st->conf = conf;
+   st->reader = reader;
+   st->stream = stream;
+   st->streamlen = streamlen;
+   st->last_sent = last_sent;
+   st->cc = cc;
+   st->terminated = terminated;
+   st->fcs_from = 19;
+   st->fcs = PPPINITFCS16;
+   st->status = 0;
+   if( stream[18] != HDLC_FLAG )
+   {
+       log_warning("Reply does not start a frame");
+       st->status = -1;
+       (*togo) = 0;
+   }
+   else
+       (*togo)=ConvertStreamtoInt( stream+43, 2, togo );
    log_debug("togo=%d", (*togo));
-   i=59; //Initial position of data stream
-   (*datalen)=0;
-   datalist=(unsigned char *)malloc(sizeof(char));
-   finished=0;
-   finished_record=0;
-   while( finished != 1 ) {
-     datalist=(unsigned char *)realloc(datalist,sizeof(char)*((*datalen)+(*streamlen)-i));
-     while( finished_record != 1 ) {
-        if( i> 500 ) break; //Somthing has gone wrong
-        
-        if(( i < (*streamlen) )&&(( (*terminated) != 1)||(i+3 < (*streamlen) ))) 
-    {
-           datalist[j]=stream[i];
-           j++;
-           (*datalen)=j;
-           i++;
-        }
-        else
-           finished_record = 1;
-           
-     }
-     finished_record = 0;
-     if( (*terminated) == 0 )
-     {
-         read_bluetooth( conf->bt_timeout, *s, streamlen, 
-                            stream, cc, last_sent, terminated );
-         i=18;
-     }
-     else
-         finished = 1;
+   st->pos = 59; //Initial position of data stream
+   // the fcs and the closing 7e of the last packet are not data
+   st->end = (*terminated) ? (*streamlen)-3 : (*streamlen);
+}
+
+/* Moves on to the next packet of the frame. Returns 0 when there is one,
+ * 1 after the last packet, -1 if reading it failed or it starts another frame. */
+static int NextStreamPacket( StreamType *st )
+{
+   if( *st->terminated )
+       return 1;
+   if( (*st->streamlen) > st->fcs_from )
+       st->fcs = hdlc_fcs16( st->fcs, st->stream+st->fcs_from, (*st->streamlen)-st->fcs_from );
+   if( read_bluetooth( st->conf->bt_timeout, st->reader, st->streamlen,
+                      st->stream, st->cc, st->last_sent, st->terminated ) != 0 )
+   {
+       st->status = -1;
+       return -1;
+   }
+   if(( (*st->streamlen) > 19 )&&( st->stream[18] == HDLC_FLAG ))
+   {
+       // the packets between were lost, only a frame's first packet has data after a 7e at 18
+       log_warning("Frame cut short by the start of another");
+       st->status = -1;
+       return -1;
+   }
+   st->pos = 18;
+   st->fcs_from = 18;
+   st->end = (*st->terminated) ? (*st->streamlen)-3 : (*st->streamlen);
+   return 0;
+}
+
+/* Returns the next size bytes at the current record, if they are all in this packet. */
+unsigned char *StreamPeek( StreamType *st, int size )
+{
+   if(( st->status < 0 )||( st->end - st->pos < size ))
+       return NULL;
+   return st->stream + st->pos;
+}
+
+/*
+ * Returns the next record of size bytes, NULL at the end of the frame or if it
+ * could not be read. The record is only good until the next call.
+ */
+unsigned char *StreamRecord( StreamType *st, int size )
+{
+   unsigned char *record;
+   int have = 0, n;
+
+   if(( st->status < 0 )||( size > (int)sizeof( st->spill )))
+       return NULL;
+   if( st->end - st->pos >= size ) {
+       record = st->stream + st->pos;
+       st->pos += size;
+       return record;
+   }
+   while( have < size ) {
+       n = st->end - st->pos;
+       if( n > size - have )
+           n = size - have;
+       if( n > 0 ) {
+           memcpy( st->spill + have, st->stream + st->pos, n );
+           have += n;
+           st->pos += n;
+       }
+       if(( have < size )&&( NextStreamPacket( st ) != 0 ))
+           return NULL;
+   }
+   return st->spill;
+}
+
+/* Skips what was not read and checks the fcs of the whole frame.
+ * Returns 0 if the frame is good, -1 if not or if it could not be read. */
+int CloseStream( StreamType *st )
+{
+   int more;
+
+   while(( more = NextStreamPacket( st )) == 0 )
+       ;
+   if(( more < 0 )||( st->status < 0 ))
+       return -1;
+   if( (*st->streamlen) > st->fcs_from )
+       st->fcs = hdlc_fcs16( st->fcs, st->stream+st->fcs_from, (*st->streamlen)-st->fcs_from-1 );
+   if( st->fcs != PPPGOODFCS16 )
+   {
+       log_warning("FCS error in data stream");
+       return -1;
    }
-   hlog_debug("Datalist", datalist, *datalen, 0);
-   return datalist;
+   return 0;
 }
 
 /* Init Config to default values */
@@ -774,78 +775,113 @@ void InitConfig( ConfType *conf, char * datefrom, char * dateto )
     strcpy( conf->PVOutputURL, "http://pvoutput.org/service/r2/addstatus.jsp" );  
     strcpy( conf->PVOutputKey, "" );  
     strcpy( conf->PVOutputSid, "" );
+    conf->PVOutputRate = 1;
     conf->InverterCode[0]=0;
     conf->InverterCode[1]=0;
     conf->InverterCode[2]=0;
     conf->InverterCode[3]=0;
     conf->ArchiveCode=0;
+    conf->poll_interval=300;
+    conf->max_sessions=4;
+    conf->archive_window=86400;
+    conf->archive_depth=1;
+    strcpy( conf->LogTarget, "stderr" );
+    strcpy( conf->Capture, "" );
+    strcpy( conf->Replay, "" );
+    strcpy( conf->Transport, "bluetooth" );
+    conf->sim_inverters=0;
+    conf->sim_latency=0;
+    conf->sim_loss=0;
     strcpy( datefrom, "" );  
     strcpy( dateto, "" );  
     log_trace ("Finished InitConfig");
 }
 
-/* read Config from file */
-int GetConfig( ConfType *conf )
+/* Set one variable read from smatool.conf */
+static void SetConfigValue( ConfType *conf, char *variable, char *value )
+{
+    if( strcmp( variable, "Inverter" ) == 0 )
+       strcpy( conf->Inverter, value );  
+    if( strcmp( variable, "BTAddress" ) == 0 )
+       strcpy( conf->BTAddress, value );  
+    if( strcmp( variable, "BTTimeout" ) == 0 )
+       conf->bt_timeout =  atoi(value);  
+    if( strcmp( variable, "Password" ) == 0 )
+       strcpy( conf->Password, value );  
+    if( strcmp( variable, "File" ) == 0 )
+       strcpy( conf->File, value );  
+    if( strcmp( variable, "Latitude" ) == 0 )
+       conf->latitude_f = atof(value) ;  
+    if( strcmp( variable, "Longitude" ) == 0 )
+       conf->longitude_f = atof(value) ;  
+    if( strcmp( variable, "MySqlHost" ) == 0 )
+       strcpy( conf->MySqlHost, value );  
+    if( strcmp( variable, "MySqlDatabase" ) == 0 )
+       strcpy( conf->MySqlDatabase, value );  
+    if( strcmp( variable, "MySqlUser" ) == 0 )
+       strcpy( conf->MySqlUser, value );  
+    if( strcmp( variable, "MySqlPwd" ) == 0 )
+       strcpy( conf->MySqlPwd, value );  
+    if( strcmp( variable, "PVOutputURL" ) == 0 )
+       strcpy( conf->PVOutputURL, value );  
+    if( strcmp( variable, "PVOutputKey" ) == 0 )
+       strcpy( conf->PVOutputKey, value );  
+    if( strcmp( variable, "PVOutputSid" ) == 0 )
+       strcpy( conf->PVOutputSid, value );  
+    if( strcmp( variable, "PVOutputRate" ) == 0 )
+       conf->PVOutputRate = atof( value );  
+    if( strcmp( variable, "PollInterval" ) == 0 )
+       conf->poll_interval = atoi(value);  
+    if( strcmp( variable, "MaxSessions" ) == 0 )
+       conf->max_sessions = atoi(value);  
+    if( strcmp( variable, "ArchiveWindow" ) == 0 )
+       conf->archive_window = atoi(value);  
+    if( strcmp( variable, "ArchiveDepth" ) == 0 )
+       conf->archive_depth = atoi(value);  
+    if( strcmp( variable, "LogTarget" ) == 0 )
+       strcpy( conf->LogTarget, value );  
+    if( strcmp( variable, "Transport" ) == 0 )
+       strcpy( conf->Transport, value );  
+}
+
+static FILE *OpenConfig( ConfType *conf )
 {
     FILE     *fp;
-    char    line[400];
-    char    variable[400];
-    char    value[400];
 
     if (strlen(conf->Config) > 0 )
     {
         if(( fp=fopen(conf->Config,"r")) == (FILE *)NULL )
-        {
            log_fatal("Error! Could not open file %s", conf->Config);
-           return( -1 ); //Could not open file
-        }
     }
     else
     {
         if(( fp=fopen("./smatool.conf","r")) == (FILE *)NULL )
-        {
            log_fatal("Error! Could not open file ./smatool.conf");
-           return( -1 ); //Could not open file
-        }
     }
+    return( fp );
+}
+
+/* read Config from file, up to the first [inverter] section */
+int GetConfig( ConfType *conf )
+{
+    FILE     *fp;
+    char    line[400];
+    char    variable[400];
+    char    value[400];
+
+    if(( fp = OpenConfig( conf )) == (FILE *)NULL )
+        return( -1 ); //Could not open file
     while (!feof(fp)){    
     if (fgets(line,400,fp) != NULL){                //read line from smatool.conf
+            if( line[0] == '[' )
+                break;
             if( line[0] != '#' ) 
             {
                 strcpy( value, "" ); //Null out value
                 sscanf( line, "%s %s", variable, value );
                 log_debug("variable [%s] value [%s]", variable, value );
                 if( value[0] != '\0' )
-                {
-                    if( strcmp( variable, "Inverter" ) == 0 )
-                       strcpy( conf->Inverter, value );  
-                    if( strcmp( variable, "BTAddress" ) == 0 )
-                       strcpy( conf->BTAddress, value );  
-                    if( strcmp( variable, "BTTimeout" ) == 0 )
-                       conf->bt_timeout =  atoi(value);  
-                    if( strcmp( variable, "Password" ) == 0 )
-                       strcpy( conf->Password, value );  
-                    if( strcmp( variable, "File" ) == 0 )
-                       strcpy( conf->File, value );  
-                    if( strcmp( variable, "Latitude" ) == 0 )
-                       conf->latitude_f = atof(value) ;  
-                    if( strcmp( variable, "Longitude" ) == 0 )
-                       conf->longitude_f = atof(value) ;  
-                    if( strcmp( variable, "MySqlHost" ) == 0 )
-                       strcpy( conf->MySqlHost, value );  
-                    if( strcmp( variable, "MySqlDatabase" ) == 0 )
-                       strcpy( conf->MySqlDatabase, value );  
-                    if( strcmp( variable, "MySqlUser" ) == 0 )
-                       strcpy( conf->MySqlUser, value );  
-                    if( strcmp( variable, "MySqlPwd" ) == 0 )
-                       strcpy( conf->MySqlPwd, value );  
-                    if( strcmp( variable, "PVOutputURL" ) == 0 )
-                       strcpy( conf->PVOutputURL, value );  
-                    if( strcmp( variable, "PVOutputKey" ) == 0 )
-                       strcpy( conf->PVOutputKey, value );  
-                    if( strcmp( variable, "PVOutputSid" ) == 0 )
-                       strcpy( conf->PVOutputSid, value );  
-                }
+                    SetConfigValue( conf, variable, value );
             }
         }
     }
@@ -853,6 +889,46 @@ int GetConfig( ConfType *conf )
     return( 0 );
 }
 
+/*
+ * Every [inverter] section of the config file describes one inverter. A
+ * section starts as a copy of conf and its lines override conf for that
+ * inverter only. Without sections conf itself is the only inverter.
+ * Returns the number of inverters in *inverters, -1 on error.
+ */
+int GetInverterSections( ConfType *conf, ConfType **inverters )
+{
+    FILE     *fp;
+    char    line[400];
+    char    variable[400];
+    char    value[400];
+    int     count = 0;
+
+    *inverters = NULL;
+    if(( fp = OpenConfig( conf )) == (FILE *)NULL )
+        return( -1 ); //Could not open file
+    while (!feof(fp)){
+        if (fgets(line,400,fp) != NULL){
+            if( strncmp( line, "[inverter]", 10 ) == 0 ) {
+                *inverters = (ConfType *)realloc( *inverters, sizeof( ConfType )*(count+1) );
+                (*inverters)[count++] = *conf;
+            }
+            else if(( count > 0 )&&( line[0] != '#' ))
+            {
+                strcpy( value, "" ); //Null out value
+                sscanf( line, "%s %s", variable, value );
+                if( value[0] != '\0' )
+                    SetConfigValue( &(*inverters)[count-1], variable, value );
+            }
+        }
+    }
+    fclose( fp );
+    if( count == 0 ) {
+        *inverters = (ConfType *)malloc( sizeof( ConfType ));
+        (*inverters)[count++] = *conf;
+    }
+    return( count );
+}
+
 /* read  Inverter Settings from file */
 int GetInverterSetting( ConfType *conf )
 {
@@ -954,9 +1030,17 @@ void PrintHelp()
     printf( "  -v,  --verbose                           Give more verbose output\n" );
     printf( "  -d,  --debug                             Show debug\n" );
     printf( "       --trace                             Show trace\n" );
+    printf( "       --log stderr|syslog|LOGFILE         Where the log goes default stderr\n" );
+    printf( "       --capture CAPTUREFILE               Save the packets exchanged with the inverters\n" );
+    printf( "       --replay CAPTUREFILE                Talk to a capture instead of the inverters\n" );
+    printf( "       --simulate INVERTERS                Poll this many simulated inverters instead\n" );
+    printf( "       --sim-latency MS                    simulated inverters answer after MS default 0\n" );
+    printf( "       --sim-loss PERCENT                  simulated inverters lose PERCENT of packets\n" );
     printf( "  -f,  --force                             Force inverter query, even if not daytime\n" );
     printf( "  -c,  --config CONFIGFILE                 Set config file default smatool.conf\n" );
     printf( "       --test                              Run in test mode - don't update data\n" );
+    printf( "       --daemon                            Keep running and poll the inverter on a schedule\n" );
+    printf( "  -n,  --interval SECONDS                  daemon poll interval default 300\n" );
     printf( "\n" );
     printf( "Dates are no longer required - defaults to last update if using mysql\n" );
     printf( "or 2000 to now if not using mysql\n" );
@@ -967,6 +1051,7 @@ void PrintHelp()
     printf( "  -i,  --inverter INVERTER_MODEL           inverter model\n" );
     printf( "  -a,  --address INVERTER_ADDRESS          inverter BT address\n" );
     printf( "  -t,  --timeout TIMEOUT                   bluetooth timeout (secs) default 5\n" );
+    printf( "       --transport bluetooth|unix:SOCKET|TTY  link to the inverter default bluetooth\n" );
     printf( "  -p,  --password PASSWORD                 inverter user password default 0000\n" );
     printf( "  -f,  --file FILENAME                     command file default sma.in.new\n" );
     printf( "Location Information to calculate sunset and sunrise so inverter is not\n" );
@@ -993,7 +1078,7 @@ void PrintHelp()
 /* Init Config to default values */
 int ReadCommandConfig( ConfType *conf, int argc, char **argv, char *datefrom, 
                         char *dateto, loglevel_t *loglevel, int *skip_daylight_check, 
-                        int *repost, int *test, int *install, int *update )
+                        int *repost, int *test, int *install, int *update, int *daemon_mode )
 {
     int    i;
 
@@ -1014,6 +1099,55 @@ int ReadCommandConfig( ConfType *conf, int argc, char **argv, char *datefrom,
             }
         }
         else if (strcmp(argv[i],"--test")==0) (*test)=1;
+        else if (strcmp(argv[i],"--daemon")==0) (*daemon_mode)=1;
+        else if (strcmp(argv[i],"--log")==0) {
+            i++;
+            if(i<argc){
+                strcpy(conf->LogTarget,argv[i]);
+            }
+        }
+        else if (strcmp(argv[i],"--capture")==0) {
+            i++;
+            if(i<argc){
+                strcpy(conf->Capture,argv[i]);
+            }
+        }
+        else if (strcmp(argv[i],"--replay")==0) {
+            i++;
+            if(i<argc){
+                strcpy(conf->Replay,argv[i]);
+            }
+        }
+        else if (strcmp(argv[i],"--transport")==0) {
+            i++;
+            if(i<argc){
+                strcpy(conf->Transport,argv[i]);
+            }
+        }
+        else if (strcmp(argv[i],"--simulate")==0) {
+            i++;
+            if(i<argc){
+                conf->sim_inverters = atoi(argv[i]);
+            }
+        }
+        else if (strcmp(argv[i],"--sim-latency")==0) {
+            i++;
+            if(i<argc){
+                conf->sim_latency = atol(argv[i]);
+            }
+        }
+        else if (strcmp(argv[i],"--sim-loss")==0) {
+            i++;
+            if(i<argc){
+                conf->sim_loss = atoi(argv[i]);
+            }
+        }
+        else if ((strcmp(argv[i],"-n")==0)||(strcmp(argv[i],"--interval")==0)) {
+            i++;
+            if(i<argc){
+                conf->poll_interval = atoi(argv[i]);
+            }
+        }
         else if ((strcmp(argv[i],"-from")==0)||(strcmp(argv[i],"--datefrom")==0))   {
             i++;
             if(i<argc){
@@ -1136,55 +1270,16 @@ int ReadCommandConfig( ConfType *conf, int argc, char **argv, char *datefrom,
     return( 0 );
 }
 
-size_t write_data(void *ptr, size_t size, size_t nmemb, void *stream) 
-{
-    size_t written;
-
-    written = fwrite(ptr, size, nmemb, stream);
-    return written;
-}
-
-int curl_post_this_query( char *compurl, char *pvOutputKey, char *pvOutputSid, loglevel_t loglevel)
-{
-  CURL *curl;
-  CURLcode result;
-  char *curlErrorText = (char*)malloc(CURL_ERROR_SIZE);
-  char header[255];
-
-  curlErrorText[0] = '\0';
-  curl = curl_easy_init();
-  if (curl){
-    log_debug( "url = %s",compurl );
-    if (loglevel >= ll_debug){
-        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curlErrorText);
-    }
-
-    struct curl_slist *slist=NULL;
-
-    sprintf(header, "X-Pvoutput-Apikey: %s",pvOutputKey );
-    slist = curl_slist_append(slist, header);
-    sprintf(header, "X-Pvoutput-SystemId: %s",pvOutputSid );
-    slist = curl_slist_append(slist, header);
-
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
-    curl_easy_setopt(curl, CURLOPT_URL, compurl);
-
-    result = curl_easy_perform(curl);
-    log_debug( "result = %d",result );
-    log_debug( "Error message = %s",curlErrorText );
-    if (result != 0){
-        log_error( "Unable to post data to PVOutput.  CURL result = %d",result );
-        log_error( "Error message = %s",curlErrorText );
-    }
-    curl_slist_free_all(slist);
-    curl_easy_cleanup(curl);
-    free(curlErrorText);
-    return result;
-  }
-  return -1;
-}
-
-void post_interval_data(char *pvOutputUrl, char *pvOutputKey, char *pvOutputSid, int repost, char *datefrom, char *dateto, loglevel_t loglevel)
+/*
+ * Post the unposted intervals of one inverter to PVOutput, 30 at a time,
+ * under the system id of its section.
+ * Each batch is read and its statement released before posting, so the
+ * database is not held while waiting on the network. A batch PVOutput
+ * rejects for good is logged and parked in the database, so it is not
+ * sent again, and the ones after it still go.
+ * Returns 0 when everything has been posted or parked, -1 if a post failed.
+ */
+int post_interval_data(pvoutput_p pvoutput, ConfType *inverter, long unsigned int serial, int repost, char *datefrom, char *dateto)
 {
   time_t prior = time(NULL) - ( 60 * 60 * 24 * 14 ); //up to 14 days before now (r2 service)
   struct tm from_datetime = *(localtime( &prior ) );
@@ -1203,297 +1298,473 @@ void post_interval_data(char *pvOutputUrl, char *pvOutputKey, char *pvOutputSid,
                  from_datetime.tm_hour, from_datetime.tm_min );
   }
 
-  row_handle *row = db_get_unposted_data( &from_datetime );
-  if( row == NULL )
-  {
-    log_debug ( "No data posted because db_get_unposted_data returned NULL " );
-    log_debug ( "for from_datetime = %04d-%02d-%02d %02d:%02d", from_datetime.tm_year+1900, 
-                 from_datetime.tm_mon+1, from_datetime.tm_mday, from_datetime.tm_hour, from_datetime.tm_min );
-    return; //nothing to post, db_get_unposted_data returns NULL if no results
-  }
-
-  int rows_processed = 0;
   struct tm start_datetime, this_datetime;
-  int more_rows = 1;
-  int string_end = 0;
-  char posturl[2048];
+  char postdata[2048];
   long startOfDayWh = 0;
+  int startOfDay = -1;
   int curlResult = -1;
-  while( more_rows )
+  for( ;; )
   {
-    if( 0 == rows_processed )
-    {
-        start_datetime = db_row_datetime_data( row, 0  );
-        // r2 service - key and sid are sent as headers, not in the url
-        string_end = sprintf(posturl,"%s?data=",pvOutputUrl);
-        startOfDayWh = db_get_start_of_day_energy_value(&start_datetime);
-    }
-    this_datetime = db_row_datetime_data( row, 0 );
-    if( start_datetime.tm_mday != this_datetime.tm_mday )
+    row_handle *row = db_get_unposted_data( &from_datetime, inverter->Inverter, serial );
+    if( row == NULL )
     {
-      startOfDayWh = db_get_start_of_day_energy_value(&this_datetime);
+      log_debug ( "No more data of %lu to post for from_datetime = %04d-%02d-%02d %02d:%02d", serial, from_datetime.tm_year+1900, 
+                   from_datetime.tm_mon+1, from_datetime.tm_mday, from_datetime.tm_hour, from_datetime.tm_min );
+      return 0; //nothing (left) to post, db_get_unposted_data returns NULL if no results
     }
-    string_end += sprintf( posturl + string_end ,"%s,%s,%ld,%s;", db_row_string_data(row,1), db_row_string_data(row,2), db_row_int_data(row,3) - startOfDayWh, db_row_string_data(row,4)  );
-    rows_processed++;
 
-    more_rows = db_row_next( row ); //db_next_row returns 0 if we cannot move to next row in result set, 1 otherwise
+    int rows_processed = 0;
+    int string_end = 0;
+    int more_rows = 1;
     //r2 service - can process upto 30 rows at a time
-    if( 30 == rows_processed || 0 == more_rows  )
+    while(( more_rows > 0 )&&( rows_processed < 30 ))
     {
-      //if post requires last ; to be stripped... posturl[string_end] = '\0';
-      curlResult = curl_post_this_query(posturl, pvOutputKey, pvOutputSid, loglevel);
-      if ( curlResult == 0 )
+      this_datetime = db_row_datetime_data( row, 0 );
+      if( 0 == rows_processed )
+          start_datetime = this_datetime;
+      if( startOfDay != this_datetime.tm_yday )
       {
-        db_set_data_posted(&start_datetime, &this_datetime );  //date range covering possibly 1, but at most 30, values
-        rows_processed = 0;
-        sleep(2); //pvoutput api says we can't post more than once a second.
-      } else {
-          log_error( "CURL post failed, CURL result was %d",curlResult );
+        startOfDayWh = db_get_start_of_day_energy_value(&this_datetime, inverter->Inverter, serial);
+        startOfDay = this_datetime.tm_yday;
       }
+      string_end += sprintf( postdata + string_end ,"%s,%s,%ld,%s;", db_row_string_data(row,1), db_row_string_data(row,2), db_row_int_data(row,3) - startOfDayWh, db_row_string_data(row,4)  );
+      rows_processed++;
+      more_rows = db_row_next( row ); //db_next_row returns 0 if we cannot move to next row in result set, 1 otherwise
+    }
+    db_row_handle_free( row );
+
+    //if post requires last ; to be stripped... postdata[string_end] = '\0';
+    //the client keeps the connection open and spaces the posts as the api asks
+    curlResult = pvoutput_post( pvoutput, postdata );
+    if ( curlResult == PVOUTPUT_REJECTED )
+    {
+      log_error( "PVOutput will not take this data of %lu, parked: %s", serial, postdata );
+      if( db_set_data_rejected(&start_datetime, &this_datetime, inverter->Inverter, serial ) == 0 )
+        return -1;
+      continue;
+    }
+    if ( curlResult != 0 )
+    {
+      //the rest stays unposted for the next try
+      log_error( "PVOutput post failed, result was %d",curlResult );
+      return -1;
     }
+    //date range covering possibly 1, but at most 30, values
+    if( db_set_data_posted(&start_datetime, &this_datetime, inverter->Inverter, serial ) == 0 )
+      return -1;
   }
+}
+
+/* The serial of the inverter on a session, as it is stored with its intervals */
+static long unsigned int SessionSerial( SessionType *session )
+{
+    long unsigned int serial = 0;
 
-  db_row_handle_free( row ); 
+    ConvertStreamtoLong( session->serial, 4, &serial );
+    return serial;
 }
 
+/*
+ * With the dates set automatically an inverter goes on from its own last
+ * stored interval, looked up in own once its serial is known.
+ * Returns the start of the range of the inverter.
+ */
+static char *InverterDateFrom( ConfType *conf, SessionType *session, int autodates, int mysql, char *datefrom, char *own )
+{
+    time_t now = time(NULL);
+    struct tm today, last;
+
+    if(( autodates == 0 )||( mysql == 0 ))
+        return datefrom;
+    if( own[0] == '\0' ) {
+        strcpy( own, datefrom );
+        localtime_r( &now, &today );
+        last = db_get_last_recorded_interval_datetime( &today, conf->Inverter, SessionSerial( session ));
+        if( last.tm_year > 100 ) //ie, after year 2000
+            strftime( own, 25, "%Y-%m-%d %H:%M:%S", &last );
+        log_verbose( "Auto set dates of %lu from [%s]", SessionSerial( session ), own );
+    }
+    return own;
+}
+
+/*
+ * Post the new intervals of inverter i, setting up the PVOutput client of
+ * its section on first use. Inverters whose section has no PVOutput
+ * settings are left out.
+ * Returns as post_interval_data.
+ */
+static int PostInverterData( pvoutput_p *pvoutputs, ConfType *inverters, int i, long unsigned int serial,
+                             int repost, char *datefrom, char *dateto )
+{
+    ConfType *inverter = &inverters[i];
 
+    if( !PVOutputConfigured( inverter ))
+        return 0;
+    if( pvoutputs[i] == NULL )
+        pvoutputs[i] = pvoutput_constructor( inverter->PVOutputURL, inverter->PVOutputKey, inverter->PVOutputSid, inverter->PVOutputRate );
+    if( pvoutputs[i] == NULL )
+        return -1;
+    return post_interval_data( pvoutputs[i], inverter, serial, repost, datefrom, dateto );
+}
 
-int main(int argc, char **argv)
+
+static unsigned char const default_timeset[4] = { 0x30,0xfe,0x7e,0x00 };
+
+/* Open the rfcomm connection to the inverter, retrying up to 20 times. Returns the socket, -1 on failure */
+static int ConnectBluetooth( ConfType *conf )
 {
-    FILE *fp = 0;
-    unsigned char * last_sent;
-    ConfType conf;
-    ReturnType *returnkeylist = NULL;
-    int num_return_keys=0;
     struct sockaddr_rc addr = { 0 };
+    int i, s = -1, err, status = -1;
+    socklen_t errlen;
+
+    for( i=1; i<20; i++ ){
+        // allocate a socket, it never blocks so other sessions go on while this one waits
+        s = socket(AF_BLUETOOTH, SOCK_STREAM | SOCK_NONBLOCK, BTPROTO_RFCOMM);
+
+        // set the connection parameters (who to connect to)
+        addr.rc_family = AF_BLUETOOTH;
+        addr.rc_channel = (uint8_t) 1;
+        str2ba( conf->BTAddress, &addr.rc_bdaddr );
+
+        // connect to server
+        status = connect(s, (struct sockaddr *)&addr, sizeof(addr));
+        if(( status < 0 )&&( errno == EINPROGRESS )) {
+            if( engine_wait( s, EPOLLOUT, conf->bt_timeout*1000L ) < 0 )
+                errno = ETIMEDOUT;
+            else {
+                errlen = sizeof( err );
+                if( getsockopt( s, SOL_SOCKET, SO_ERROR, &err, &errlen ) < 0 )
+                    err = errno;
+                if( err == 0 )
+                    status = 0;
+                errno = err;
+            }
+        }
+
+        if (status <0) {
+            log_error( "Error connecting to %s. Errno=%i. %s",conf->BTAddress, errno, strerror( errno ) );
+            close( s );
+        }
+        else
+           break;
+    }
+    return( status < 0 ? -1 : s );
+}
+
+/* Connect to an inverter, usually a simulated one, listening on a Unix socket */
+static int ConnectUnix( char const *path )
+{
+    struct sockaddr_un addr;
+    int s;
+
+    memset( &addr, 0, sizeof( addr ));
+    addr.sun_family = AF_UNIX;
+    strncpy( addr.sun_path, path, sizeof( addr.sun_path )-1 );
+    if(( s = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0 )) < 0 )
+        return( -1 );
+    if( connect( s, (struct sockaddr *)&addr, sizeof( addr )) < 0 ) {
+        log_error( "Error connecting to %s. %s", path, strerror( errno ));
+        close( s );
+        return( -1 );
+    }
+    return( s );
+}
+
+/* Open a serial line or a pty to the inverter, the packets go through it raw */
+static int OpenTty( char const *path )
+{
+    struct termios tio;
+    int s;
+
+    if(( s = open( path, O_RDWR | O_NOCTTY | O_NONBLOCK )) < 0 ) {
+        log_error( "Error opening %s. %s", path, strerror( errno ));
+        return( -1 );
+    }
+    if( tcgetattr( s, &tio ) == 0 ) {
+        cfmakeraw( &tio );
+        tcsetattr( s, TCSANOW, &tio );
+    }
+    return( s );
+}
+
+/*
+ * Connect to the inverter over conf->Transport: bluetooth, unix:SOCKET or
+ * the path of a tty. A replay stands in for all of them.
+ */
+int ConnectInverter( ConfType *conf, SessionType *session )
+{
+    char btaddress[20];
+    char *saveptr;
+    static int replays = 0;
+
+    if( conf->Replay[0] != '\0' ) {
+        // a capture plays the inverter, each connection the next one in it
+        session->s = capture_replay( conf->Replay, replays++, &session->replay_fd );
+    }
+    else if( strncmp( conf->Transport, "unix:", 5 ) == 0 )
+        session->s = ConnectUnix( conf->Transport+5 );
+    else if( conf->Transport[0] == '/' )
+        session->s = OpenTty( conf->Transport );
+    else
+        session->s = ConnectBluetooth( conf );
+    if( session->s < 0 ) {
+        session->s = -1;
+        return( -1 );
+    }
+    if( capture )
+        capture_connection( capture, session->s );
+
+    bt_reader_init( &session->reader, session->s );
+
+    // convert address - strtok_r works on a copy so a later reconnect still has the full address
+    strcpy( btaddress, conf->BTAddress[0] ? conf->BTAddress : "00:00:00:00:00:00" );
+    session->address[5] = conv(strtok_r(btaddress,":",&saveptr));
+    session->address[4] = conv(strtok_r(NULL,":",&saveptr));
+    session->address[3] = conv(strtok_r(NULL,":",&saveptr));
+    session->address[2] = conv(strtok_r(NULL,":",&saveptr));
+    session->address[1] = conv(strtok_r(NULL,":",&saveptr));
+    session->address[0] = conv(strtok_r(NULL,":",&saveptr));
+    // sent by :setinverter before the inverter's own is read in :startsetup
+    memcpy( session->timeset, default_timeset, sizeof( session->timeset ));
+    session->initialised = 0;
+    session->logged_on = 0;
+    return( 0 );
+}
+
+/* Close the rfcomm connection; the next poll reconnects and runs :init again */
+void DisconnectInverter( SessionType *session )
+{
+    if( session->s >= 0 ) {
+        close( session->s );
+        log_debug( "Disconnected from inverter" );
+    }
+    if( session->replay_fd >= 0 )
+        close( session->replay_fd );
+    session->s = -1;
+    session->replay_fd = -1;
+    session->initialised = 0;
+    session->logged_on = 0;
+}
+
+/* Convert a date of the range to fetch, -1 if it cannot be read */
+static time_t RangeTime( char *date )
+{
+    struct tm tm;
+    time_t t;
+
+    memset( &tm, 0, sizeof( tm ));
+    if( strptime( date, "%Y-%m-%d %H:%M:%S", &tm) == 0 ) 
+    {
+        log_error("Time Coversion Error, date [%s]", date );
+        return -1;
+    }
+    tm.tm_isdst=-1;
+    if(( t = mktime(&tm)) == -1 ) {
+        log_error("Bad date [%s]", date );
+        t = 0;
+    }
+    return t;
+}
+
+/* Rows kept for another try while the database cannot take them, a week of 5 minute values */
+#define INTERVAL_BATCH_KEEP ( ARCHIVE_CHUNK * 7 )
+
+/*
+ * Write the batch to the database. Rows that could not be written stay in the
+ * batch and go with the next flush, up to INTERVAL_BATCH_KEEP of them. Beyond
+ * that the oldest are dropped and logged as lost.
+ */
+static void FlushIntervalBatch( IntervalBatch *batch )
+{
+    int lost;
+
+    if( batch->count == 0 )
+        return;
+    if( db_set_interval_values( batch->rows, batch->count ) != 0 ) {
+        batch->count = 0;
+        return;
+    }
+    log_error( "Could not store %d interval values, kept for the next try", batch->count );
+    if( batch->count > INTERVAL_BATCH_KEEP ) {
+        lost = batch->count - INTERVAL_BATCH_KEEP;
+        log_error( "Lost %d interval values, the oldest from %04d-%02d-%02d %02d:%02d", lost,
+                   batch->rows[0].date.tm_year+1900, batch->rows[0].date.tm_mon+1, batch->rows[0].date.tm_mday,
+                   batch->rows[0].date.tm_hour, batch->rows[0].date.tm_min );
+        memmove( batch->rows, batch->rows + lost, sizeof( interval_row )*INTERVAL_BATCH_KEEP );
+        batch->count = INTERVAL_BATCH_KEEP;
+    }
+}
+
+/*
+ * Move the archive records after the leading dummy into the batch, writing the
+ * batch out once it holds ARCHIVE_CHUNK rows or when flush is set. The last
+ * record stays behind as the dummy of whatever follows.
+ * Returns the date of the last record moved, 0 if there was none.
+ */
+static time_t CommitArchiveData( struct archdata_type *archdatalist, int *archdatalen, IntervalBatch *batch, int flush )
+{
+    int i;
+
+    if( *archdatalen > 1 ) {
+        if( batch->count + *archdatalen > batch->size ) {
+            batch->size = batch->count + *archdatalen;
+            batch->rows = (interval_row *)realloc( batch->rows, sizeof( interval_row )*batch->size );
+        }
+        for( i=1; i<*archdatalen; i++ ) //Start at 1 as the first record is a dummy
+        {
+            interval_row *row = batch->rows + batch->count++;
+            localtime_r( &((archdatalist+i)->date), &row->date );
+            row->inverter = (archdatalist+i)->inverter;
+            row->serial = (archdatalist+i)->serial;
+            row->current_power = (archdatalist+i)->current_value;
+            row->total_energy = (archdatalist+i)->accum_value;
+        }
+        archdatalist[0] = archdatalist[*archdatalen-1];
+        *archdatalen = 1;
+    }
+    if(( flush )||( batch->count >= ARCHIVE_CHUNK ))
+        FlushIntervalBatch( batch );
+    return ( *archdatalen == 1 ) ? archdatalist[0].date : 0;
+}
+
+/*
+ * Replies to the archive windows of a download that is given up on may still
+ * be on their way, they are thrown away so the retry does not take them for
+ * its own.
+ */
+static void DropOutstandingWindows( ConfType *conf, SessionType *session, int *windows_out )
+{
+    if( *windows_out == 0 )
+        return;
+    log_verbose( "Dropped %d bytes of %d outstanding archive windows",
+                 bt_reader_drain( &session->reader, conf->bt_timeout * 1000L ), *windows_out );
+    *windows_out = 0;
+}
+
+/*
+ * Run the command file against a connected inverter and add the archive data to the batch.
+ * On a fresh connection the whole file is run, after that the poll starts at :setup
+ * as :init can only be run once per connection.
+ * Returns 0 on success, 1 if the data was bad and not stored, -1 if the bluetooth link failed.
+ */
+int PollInverter( ConfType *conf, SessionType *session, script_p program, ReturnType *returnkeylist, unsigned short const *returnkeyindex,
+                  char *datefrom, char *dateto, int daterange, int autodates, int mysql, time_t reporttime, IntervalBatch *batch )
+{
+    unsigned char * last_sent;
+    unsigned char fl[1024] = { 0 };     /* packet being built */
+    int cc = 0;
     unsigned char received[1024];
-    unsigned char datarecord[1024];
-    unsigned char * data;
-    unsigned char send_count = 0x0;
-    int return_key;
+    StreamType stream;
+    unsigned char * record;
+    int framestart, window_first;
+    ReturnType *channel;
     int gap=1;
-    int datalen = 0;
     int archdatalen=0;
+    int archdatasize=0;             /* records archdatalist has room for, kept over retries */
     int failedbluetooth=0;
     int terminated=0;
-    int s,i,j,status,mysql=0,post=0,repost=0,test=0,file=0,daterange=0;
-    int install=0, update=0, already_read=0;
-    int location=0, error=0;
+    int i,j,already_read=0;
+    int error=0, result=0;
     int found,crc_at_end=0, finished=0;
     int togo=0;
     int initstarted=0,setupstarted=0,rangedatastarted=0;
-    long returnpos;
-    int  returnline;
-    char datefrom[100];
-    char dateto[100];
+    int  pc, returnpc, k;
+    int  keepalive=0, reused=0;
+    time_t checkpoint=0;            /* last archive record committed */
+    time_t committed;
+    time_t range_from=0, range_to=0;    /* archive range being fetched */
+    char ownfrom[25] = "";          /* datefrom of this inverter, see InverterDateFrom */
+    time_t window_sent=0;           /* start of the first window not requested yet */
+    time_t window_read=0;           /* start of the window the next reply answers */
+    time_t window_end;
+    int  windows_out=0;             /* windows requested and not read yet */
+    int  requestpc=0, is_request=0, next_window=0;
+    script_op_t *op;
+    script_item_t *item;
     int  pass_i;
-    char line[400];
-    unsigned char address[6] = { 0 };
-    unsigned char address2[6] = { 0 };
-    unsigned char timestr[25] = { 0 };
-    unsigned char serial[4] = { 0 };
-    unsigned char tzhex[2] = { 0 };
-    unsigned char timeset[4] = { 0x30,0xfe,0x7e,0x00 };
-    int  invcode;
-    char *lineread;
-    time_t curtime;
-    time_t reporttime;
     time_t fromtime;
     time_t totime;
     time_t idate;
     time_t prev_idate;
     struct tm *loctime;
+    struct tm loctm;
     struct tm tm;
     int day,month,year,hour,minute,second;
     char tt[10] = {48,48,48,48,48,48,48,48,48,48}; 
     char ti[3];    
-    char chan[1];
     float currentpower_total;
     int   rr;
     int linenum = 0;
     float dtotal;
-    float gtotal;
-    float ptotal;
+    long long gtotal;
+    long long ptotal;
     float strength;
-    struct archdata_type
-    {
-        time_t date;
-        char   inverter[20];
-        long unsigned int serial;
-        long  accum_value;
-        long  current_value;
-    } *archdatalist;
-
-    char sunrise_time[6],sunset_time[6];
-    loglevel_t loglevel = ll_info;
-   
-    log_init();
-    log_info("Starting pvlogger");
+    struct archdata_type *archdatalist = NULL;
 
     memset(received,0,1024);
     last_sent = (unsigned  char *)malloc( sizeof( unsigned char ));
-    /* get the report time - used in various places */
-    reporttime = time(NULL);  //get time in seconds since epoch (1/1/1970)    
-    
-    // set config to defaults
-    InitConfig( &conf, datefrom, dateto );
-    // read command arguments needed so can get config
-    if( ReadCommandConfig( &conf, argc, argv, datefrom, dateto, &loglevel, 
-            &skip_daylight_check, &repost, &test, &install, &update) < 0 )
-        exit(0);
-    // read Config file
-    if( GetConfig( &conf ) < 0 )
-        exit(-1);
-    // read command arguments  again - they overide config
-    if( ReadCommandConfig( &conf, argc, argv, datefrom, dateto, &loglevel, 
-            &skip_daylight_check, &repost, &test, &install, &update) < 0 )
-        exit(0);
-    // Log level may have been reset by command line.
-    logging_set_loglevel(logger, loglevel);
 
-    // read Inverter Setting file
-    if( GetInverterSetting( &conf ) < 0 )
-        exit(-1);
-    // set switches used through the program
-    SetSwitches( &conf, datefrom, dateto, &location, &mysql, &post, &file, &daterange, &test );  
-    
-    if(( install==1 )&&( mysql==1 )) {
-        db_init( conf.MySqlHost, conf.MySqlUser, conf.MySqlPwd, conf.MySqlDatabase );
-        int result = db_install_tables();
-        db_close();
-        exit(result);
-    }
-    if(( update==1 )&&( mysql==1 )) {
-        db_init( conf.MySqlHost, conf.MySqlUser, conf.MySqlPwd, conf.MySqlDatabase );
-        int result = 0; //db_update_schema( SCHEMA_VALUE ); //TODO implement this
-        db_close();
-        exit(result);
-    }
-
-    db_init( conf.MySqlHost, conf.MySqlUser, conf.MySqlPwd, conf.MySqlDatabase );
-
-    if( mysql==1 ) {
-       if( db_get_schema() != SCHEMA_VALUE ) {
-            log_fatal( "Please Update database schema. Use --UPDATE" );
-            db_close();
-            exit(-1);
-       }
+    if(( session->logged_on )&&(( pc = script_label( program, ":keepalive" )) > 0 )) {
+        // still logged on from the last poll, a signal exchange instead of the logon
+        log_debug( "Reusing session, logon skipped" );
+        keepalive = 1;
+        reused = 1;
     }
-    // Set value for inverter type
-    // SetInverterType( &conf );
-    // Get Return Value lookup from file
-    returnkeylist = InitReturnKeys( &conf, returnkeylist, &num_return_keys );
-    // Get Local Timezone offset in seconds
-    get_timezone_in_seconds( tzhex );
-    // Location based information to avoid quering Inverter in the dark
-    if((location==1)&&(mysql==1)) {
-        curtime = time(NULL);
-        loctime = localtime( &curtime );
-        if( !db_fetch_almanac( loctime , sunrise_time, sunset_time ) ) {
-            sprintf( sunrise_time, "%s", sunrise(conf.latitude_f,conf.longitude_f ));
-            sprintf( sunset_time, "%s", sunset(conf.latitude_f, conf.longitude_f ));
-            db_update_almanac( loctime, sunrise_time, sunset_time );
-        }
-        log_verbose( "sunrise=%s sunset=%s", sunrise_time, sunset_time );
-           
-    }
-    if(daterange==0 ) //auto set the dates
-        auto_set_dates( &daterange, mysql, datefrom, dateto );
+    else if( session->initialised )
+        pc = session->setuppc;
     else
-        log_verbose( "QUERY RANGE    from %s to %s", datefrom, dateto ); 
-    
-    int isLight = is_light();
-    log_verbose("is_light() =  %u",isLight );
-    
-    if(( daterange==1 )&&((location==0)||(mysql==0)||is_light( ))) {
-        log_verbose( "Address %s",conf.BTAddress );
-
-        if (file ==1)
-            fp=fopen(conf.File,"r");
-        else
-            fp=fopen("/etc/sma.in","r");
-        for( i=1; i<20; i++ ){
-            // allocate a socket
-            s = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
-
-            // set the connection parameters (who to connect to)
-            addr.rc_family = AF_BLUETOOTH;
-            addr.rc_channel = (uint8_t) 1;
-            str2ba( conf.BTAddress, &addr.rc_bdaddr );
-
-            // connect to server
-            log_debug( "datefrom=%s dateto=%s", datefrom, dateto );
-            status = connect(s, (struct sockaddr *)&addr, sizeof(addr));
-
-            if (status <0) {
-                log_error( "Error connecting to %s. Errno=%i. %s",conf.BTAddress, errno, strerror( errno ) );
-                close( s );
-            }
-            else
-               break;
-        }
-        if (status < 0 ) {
-            return( -1 );
-        }
+        pc = 0;
+    returnpc = pc;
+    log_debug( "datefrom=%s dateto=%s", datefrom, dateto );
 
-       // convert address
-       address[5] = conv(strtok(conf.BTAddress,":"));
-       address[4] = conv(strtok(NULL,":"));
-       address[3] = conv(strtok(NULL,":"));
-       address[2] = conv(strtok(NULL,":"));
-       address[1] = conv(strtok(NULL,":"));
-       address[0] = conv(strtok(NULL,":"));
-    
-        while (!feof(fp)){    
+        for( ; pc < program->nops; pc++ ){
             start:
-        if (fgets(line,400,fp) != NULL){                //read line from sma.in
-            linenum++;
-            lineread = strtok(line," ;");
-            if(!strcmp(lineread,"R")){        //See if line is something we need to receive
+            op = program->ops + pc;
+            linenum = op->line;
+            if( op->type == so_receive ){        //See if line is something we need to receive
                 log_debug( "[%d] Waiting for string",linenum );
                 cc = 0;
-                do{
-                    lineread = strtok(NULL," ;");
-                    log_trace( "Read command [%s]", lineread );
-                    switch(select_str(lineread)) {
+                for( k=0; k<op->nitems; k++ ){
+                    item = program->items + op->first_item + k;
+                    log_trace( "Read command [%s]", script_var_name( item->var ) );
+                    switch( item->var ) {
         
-                    case 0: // $END
-                    //do nothing
-                    break;            
+                    case sv_bytes: // literal bytes
+                    memcpy( fl+cc, program->bytes+item->offset, item->len );
+                    cc += item->len;
+                    break;
 
-                    case 1: // $ADDR
+                    case sv_addr: // $ADDR
                     for (i=0;i<6;i++){
-                        fl[cc] = address[i];
+                        fl[cc] = session->address[i];
                         cc++;
                     }
                     break;    
 
-                    case 3: // $SER
+                    case sv_ser: // $SER
                     for (i=0;i<4;i++){
-                        fl[cc] = serial[i];
+                        fl[cc] = session->serial[i];
                         cc++;
                     }
                     break;    
                     
-                    case 7: // $ADD2
+                    case sv_add2: // $ADD2
                     for (i=0;i<6;i++){
-                        fl[cc] = address2[i];
+                        fl[cc] = session->address2[i];
                         cc++;
                     }
                     break;    
 
-                    case 8: // $CHAN
-                    fl[cc] = chan[0];
+                    case sv_chan: // $CHAN
+                    fl[cc] = session->chan[0];
                     cc++;
                     break;
 
                     default :
-                    fl[cc] = conv(lineread);
-                    cc++;
                     break;
                     }
 
-                } while (strcmp(lineread,"$END"));
+                }
                 {
                     char buf[128];
                     snprintf(buf, 127, "[%d] waiting for", linenum);
@@ -1505,20 +1776,24 @@ int main(int argc, char **argv)
                 do {
                     if( already_read == 0 )
                         rr=0;
-                    if(( already_read == 0 )&&( read_bluetooth( conf.bt_timeout, s, &rr, received, cc, last_sent, &terminated ) != 0 ))
+                    if(( already_read == 0 )&&( read_bluetooth( conf->bt_timeout, &session->reader, &rr, received, cc, last_sent, &terminated ) != 0 ))
                     {
                         already_read=0;
-                        fseek( fp, returnpos, 0 );
-                        linenum = returnline;
+                        pc = returnpc;
                         found=0;
-                        if( archdatalen > 0 )
-                           free( archdatalist );
                         archdatalen=0;
-                        strcpy( lineread, "" );
-                        sleep(10);
+                        DropOutstandingWindows( conf, session, &windows_out );
+                        if( reused ) {
+                            // the inverter no longer takes the old logon
+                            log_info( "Kept session rejected, logging on again" );
+                            keepalive = reused = session->logged_on = 0;
+                            pc = returnpc = session->setuppc;
+                            goto start;
+                        }
+                        engine_sleep(10000);
                         failedbluetooth++;
                         if( failedbluetooth > 60 )
-                            exit(-1);
+                            goto failed;
                         goto start;
                     }
                     else {
@@ -1542,40 +1817,81 @@ int main(int argc, char **argv)
                 } while (found == 0);
                 hlog_trace("data", fl, cc, 0);
             }
-            if(!strcmp(lineread,"S")){        //See if line is something we need to send
+            if( op->type == so_send ){        //See if line is something we need to send
+                // the archive request goes out once per window, up to archive_depth ahead
+                is_request = 0;
+                for( k=0; k<op->nitems; k++ )
+                    if( program->items[op->first_item + k].var == sv_timefrom1 )
+                        is_request = 1;
+                if(( is_request )&&( next_window == 0 )) {
+                    // a new range, or a retry that goes on after what is committed
+                    range_from = 0;
+                    range_to = 0;
+                    if( daterange == 1 ) {
+                        range_from = RangeTime( InverterDateFrom( conf, session, autodates, mysql, datefrom, ownfrom ));
+                        range_to = RangeTime( dateto );
+                        if(( range_from < 0 )||( range_to < 0 )) {
+                            // only this poll fails, the other inverters carry on
+                            result = 1;
+                            goto done;
+                        }
+                    }
+                    if( checkpoint > 0 ) {
+                        // the record at the checkpoint is the dummy
+                        log_verbose( "Resuming archive download after %ld", (long)checkpoint );
+                        range_from = checkpoint + 300;
+                    }
+                    window_sent = window_read = range_from;
+                    DropOutstandingWindows( conf, session, &windows_out );
+                    requestpc = pc;
+                }
+                next_window = 0;
+                while(( is_request == 0 )||(( windows_out < ( conf->archive_depth > 1 ? conf->archive_depth : 1 ))
+                                           &&( window_sent <= range_to ))) {
+                if( is_request ) {
+                    fromtime = window_sent;
+                    totime = window_sent + ( conf->archive_window > 300 ? conf->archive_window : 300 ) - 300;
+                    if( totime > range_to )
+                        totime = range_to;
+                    window_sent = totime + 300;
+                    windows_out++;
+                    log_verbose( "[%d] Requesting archive window %ld to %ld, %d outstanding", linenum,
+                                 (long)fromtime, (long)totime, windows_out );
+                }
                 log_debug("[%d] Sending", linenum);
                 cc = 0;
-                do{
-                    lineread = strtok(NULL," ;");
-                    switch(select_str(lineread)) {
+                for( k=0; k<op->nitems; k++ ){
+                    item = program->items + op->first_item + k;
+                    switch( item->var ) {
         
-                    case 0: // $END
-                    //do nothing
-                    break;            
+                    case sv_bytes: // literal bytes
+                    memcpy( fl+cc, program->bytes+item->offset, item->len );
+                    cc += item->len;
+                    break;
 
-                    case 1: // $ADDR
+                    case sv_addr: // $ADDR
                     for (i=0;i<6;i++){
-                        fl[cc] = address[i];
+                        fl[cc] = session->address[i];
                         cc++;
                     }
                     break;
 
-                    case 3: // $SER
+                    case sv_ser: // $SER
                     for (i=0;i<4;i++){
-                        fl[cc] = serial[i];
+                        fl[cc] = session->serial[i];
                         cc++;
                     }
                     break;    
                     
 
-                    case 7: // $ADD2
+                    case sv_add2: // $ADD2
                     for (i=0;i<6;i++){
-                        fl[cc] = address2[i];
+                        fl[cc] = session->address2[i];
                         cc++;
                     }
                     break;
 
-                    case 2: // $TIME    
+                    case sv_time: // $TIME    
                     // get report time and convert
                     sprintf(tt,"%x",(int)reporttime); //convert to a hex in a string
                     for (i=7;i>0;i=i-2){ //change order and convert to integer
@@ -1587,7 +1903,7 @@ int main(int argc, char **argv)
                     }
                     break;
 
-                    case 11: // $TMPLUS    
+                    case sv_tmpl: // $TMPLUS    
                     // get report time and convert
                     sprintf(tt,"%x",(int)reporttime+1); //convert to a hex in a string
                     for (i=7;i>0;i=i-2){ //change order and convert to integer
@@ -1600,7 +1916,7 @@ int main(int argc, char **argv)
                     break;
 
 
-                    case 10: // $TMMINUS
+                    case sv_tmmi: // $TMMINUS
                     // get report time and convert
                     sprintf(tt,"%x",(int)reporttime-1); //convert to a hex in a string
                     for (i=7;i>0;i=i-2){ //change order and convert to integer
@@ -1612,49 +1928,27 @@ int main(int argc, char **argv)
                     }
                     break;
 
-                    case 4: //$crc
-                    tryfcs16(fl+19, cc -19);
+                    case sv_crc: //$crc
+                    tryfcs16(fl+19, cc -19, fl+cc);
+                    cc += 2;
                                     add_escapes(fl,&cc);
                                     fix_length_send(fl,&cc);
                     break;
 
-                    case 8: // $CHAN
-                    fl[cc] = chan[0];
+                    case sv_chan: // $CHAN
+                    fl[cc] = session->chan[0];
                     cc++;
                     break;
 
-                    case 12: // $TIMESTRING
+                    case sv_timestring: // $TIMESTRING
                     for (i=0;i<25;i++){
-                        fl[cc] = timestr[i];
+                        fl[cc] = session->timestr[i];
                         cc++;
                     }
                     break;
 
-                    case 13: // $TIMEFROM1    
-                    // get report time and convert
-                                    if( daterange == 1 ) {
-                                        if( strptime( datefrom, "%Y-%m-%d %H:%M:%S", &tm) == 0 ) 
-                                        {
-                                            log_debug("datefrom %s", datefrom );
-                                            log_fatal("Time Coversion Error");
-                                            error=1;
-                                            exit(-1);
-                                        }
-                                        tm.tm_isdst=-1;
-                                        fromtime=mktime(&tm);
-                                        if( fromtime == -1 ) {
-                                        // Error we need to do something about it
-                                            printf( "%03x",(int)fromtime ); getchar();
-                                            printf( "\n%03lx", fromtime ); getchar();
-                                            fromtime=0;
-                                            printf( "bad from" ); getchar();
-                                        }
-                                    }
-                                    else
-                                    {
-                                      printf( "no from" ); getchar();
-                                      fromtime=0;
-                                    }
+                    case sv_timefrom1: // $TIMEFROM1    
+                    // fromtime is the start of the window being requested
                     sprintf(tt,"%03x",(int)fromtime-300); //convert to a hex in a string and start 5 mins before for dummy read.
                     for (i=7;i>0;i=i-2){ //change order and convert to integer
                         ti[1] = tt[i];
@@ -1665,27 +1959,8 @@ int main(int argc, char **argv)
                     }
                     break;
 
-                    case 14: // $TIMETO1    
-                                    if( daterange == 1 ) {
-                                        if( strptime( dateto, "%Y-%m-%d %H:%M:%S", &tm) == 0 ) 
-                                        {
-                                            log_debug("dateto [%s]", dateto);
-                                            log_fatal("Time Coversion Error");
-                                            error=1;
-                                            exit(-1);
-                                        }
-                                        tm.tm_isdst=-1;
-                                        totime=mktime(&tm);
-                                        if( totime == -1 ) {
-                                        // Error we need to do something about it
-                                            printf( "%03x",(int)totime ); getchar();
-                                            printf( "\n%03lx", totime ); getchar();
-                                            totime=0;
-                                            printf( "bad to" ); getchar();
-                                        }
-                                    }
-                                    else
-                                      totime=0;
+                    case sv_timeto1: // $TIMETO1    
+                    // totime is the end of the window being requested
                     sprintf(tt,"%03x",(int)totime); //convert to a hex in a string
                     // get report time and convert
                     for (i=7;i>0;i=i-2){ //change order and convert to integer
@@ -1697,9 +1972,9 @@ int main(int argc, char **argv)
                     }
                     break;
 
-                    case 15: // $TIMEFROM2    
+                    case sv_timefrom2: // $TIMEFROM2    
                                     if( daterange == 1 ) {
-                                        strptime( datefrom, "%Y-%m-%d %H:%M:%S", &tm);
+                                        strptime( InverterDateFrom( conf, session, autodates, mysql, datefrom, ownfrom ), "%Y-%m-%d %H:%M:%S", &tm);
                                         tm.tm_isdst=-1;
                                         fromtime=mktime(&tm)-86400;
                                         if( fromtime == -1 ) {
@@ -1725,7 +2000,7 @@ int main(int argc, char **argv)
                     }
                     break;
 
-                    case 16: // $TIMETO2    
+                    case sv_timeto2: // $TIMETO2    
                                     if( daterange == 1 ) {
                                         strptime( dateto, "%Y-%m-%d %H:%M:%S", &tm);
 
@@ -1751,14 +2026,14 @@ int main(int argc, char **argv)
                     }
                     break;
                     
-                    case 19: // $PASSWORD
+                    case sv_password: // $PASSWORD
                                   
                                     j=0;
                     for(i=0;i<12;i++){
-                        if( conf.Password[j] == '\0' )
+                        if( conf->Password[j] == '\0' )
                                           fl[cc] = 0x88;
                                         else {
-                                            pass_i = conf.Password[j];
+                                            pass_i = conf->Password[j];
                                             fl[cc] = (( pass_i+0x88 )%0xff);
                                             j++;
                                         }
@@ -1766,45 +2041,43 @@ int main(int argc, char **argv)
                     }
                     break;    
 
-                    case 21: // $UNKNOWN
+                    case sv_unknown: // $UNKNOWN
                     for (i=0;i<4;i++){
-                            fl[cc] = conf.InverterCode[i];
+                            fl[cc] = conf->InverterCode[i];
                         cc++;
                     }
                                     break;
 
-                    case 22: // $INVCODE
-                            fl[cc] = invcode;
+                    case sv_invcode: // $INVCODE
+                            fl[cc] = session->invcode;
                         cc++;
                                     break;
-                    case 23: // $ARCHCODE
-                            fl[cc] = conf.ArchiveCode;
+                    case sv_archcode: // $ARCHCODE
+                            fl[cc] = conf->ArchiveCode;
                         cc++;
                                     break;
-                    case 25: // $CNT send counter
-                                        send_count++;
-                            fl[cc] = send_count;
+                    case sv_cnt: // $CNT send counter
+                                        session->send_count++;
+                            fl[cc] = session->send_count;
                         cc++;
                                     break;
-                    case 26: // $TIMEZONE timezone in seconds
-                            fl[cc] = tzhex[1];
-                            fl[cc+1] = tzhex[0];
+                    case sv_timezone: // $TIMEZONE timezone in seconds
+                            fl[cc] = session->tzhex[1];
+                            fl[cc+1] = session->tzhex[0];
                         cc+=2;
                                     break;
-                    case 27: // $TIMESET unknown setting
+                    case sv_timeset: // $TIMESET unknown setting
                                         for( i=0; i<4; i++ ) {
-                                fl[cc] = timeset[i];
+                                fl[cc] = session->timeset[i];
                             cc++;
                                         }
                                     break;
 
                     default :
-                    fl[cc] = conv(lineread);
-                    cc++;
                     break;
                     }
 
-                } while (strcmp(lineread,"$END"));
+                }
                 {
                     char buf[128];
                     snprintf(buf, 127, "[%d] sending", linenum);
@@ -1812,40 +2085,43 @@ int main(int argc, char **argv)
                 }
                 last_sent = (unsigned  char *)realloc( last_sent, sizeof( unsigned char )*(cc));
                 memcpy(last_sent,fl,cc);
-                write(s,fl,cc);
+                if( write_bluetooth( session->s, fl, cc, conf->bt_timeout*1000L ) < 0 )
+                    goto failed;
                             already_read=0;
-                            //check_send_error( &conf, &s, &rr, received, cc, last_sent, &terminated, &already_read ); 
+                            //check_send_error( conf, &session->reader, &rr, received, cc, last_sent, &terminated, &already_read ); 
+                if( is_request == 0 )
+                    break;
+                }
             }
 
 
-            if(!strcmp(lineread,"E")){        //See if line is something we need to extract
+            if( op->type == so_extract ){        //See if line is something we need to extract
                 log_debug("[%d] Extracting", linenum);
                 cc = 0;
-                do{
-                    lineread = strtok(NULL," ;");
-                    switch(select_str(lineread)) {
-
-                        case 3: // Extract Serial of Inverter
-                            data = ReadStream( &conf, &s, received, &rr, data, &datalen, last_sent, cc, &terminated, &togo );
-                            /*
-                            printf( "1.len=%d data=", datalen );
-                            for( i=0; i< datalen; i++ )
-                              printf( "%02x ", data[i] );
-                            printf( "\n" );
-                            */
-                            serial[3]=data[19];
-                            serial[2]=data[18];
-                            serial[1]=data[17];
-                            serial[0]=data[16];
+                for( k=0; k<op->nitems; k++ ){
+                    item = program->items + op->first_item + k;
+                    switch( item->var ) {
+
+                        case sv_ser: // Extract Serial of Inverter
+                            OpenStream( &stream, conf, &session->reader, received, &rr, last_sent, cc, &terminated, &togo );
+                            if(( record = StreamRecord( &stream, 20 )) == NULL ) {
+                                CloseStream( &stream );
+                                goto bad_stream;
+                            }
+                            session->serial[3]=record[19];
+                            session->serial[2]=record[18];
+                            session->serial[1]=record[17];
+                            session->serial[0]=record[16];
+                            if( CloseStream( &stream ) < 0 )
+                                goto bad_stream;
                             log_verbose( "serial=%02x:%02x:%02x:%02x\n",
-                                            serial[3]&0xff,serial[2]&0xff,
-                                            serial[1]&0xff,serial[0]&0xff ); 
-                            free( data );
+                                            session->serial[3]&0xff,session->serial[2]&0xff,
+                                            session->serial[1]&0xff,session->serial[0]&0xff ); 
                             break;
                                     
-                        case 9: // extract Time from Inverter
+                        case sv_itime: // extract Time from Inverter
                             idate = (received[66] * 16777216 ) + (received[65] *65536 )+ (received[64] * 256) + received[63];
-                            loctime = localtime(&idate);
+                            loctime = localtime_r(&idate, &loctm);
                             day = loctime->tm_mday;
                             month = loctime->tm_mon +1;
                             year = loctime->tm_year + 1900;
@@ -1860,287 +2136,877 @@ int main(int argc, char **argv)
 #endif
                             break;
 
-                        case 5: // extract current power $POW
-                            data = ReadStream( &conf, &s, received, &rr, data, &datalen, last_sent, cc, &terminated, &togo );
-                            if( (data+3)[0] == 0x08 )
-                                gap = 40; 
-                            if( (data+3)[0] == 0x10 )
-                                gap = 40; 
-                            if( (data+3)[0] == 0x40 )
-                                gap = 28;
-                            if( (data+3)[0] == 0x00 )
-                                gap = 28;
-                            for ( i = 0; i<datalen; i+=gap ) 
+                        case sv_pow: // extract current power $POW
+                            OpenStream( &stream, conf, &session->reader, received, &rr, last_sent, cc, &terminated, &togo );
+                            if(( record = StreamPeek( &stream, 4 )) != NULL ) {
+                                if( (record+3)[0] == 0x08 )
+                                    gap = 40; 
+                                if( (record+3)[0] == 0x10 )
+                                    gap = 40; 
+                                if( (record+3)[0] == 0x40 )
+                                    gap = 28;
+                                if( (record+3)[0] == 0x00 )
+                                    gap = 28;
+                            }
+                            while(( record = StreamRecord( &stream, gap )) != NULL )
                             {
-                               idate=ConvertStreamtoTime( data+i+4, 4, &idate );
-                               loctime = localtime(&idate);
+                               idate=ConvertStreamtoTime( record+4, 4, &idate );
+                               loctime = localtime_r(&idate, &loctm);
                                day = loctime->tm_mday;
                                month = loctime->tm_mon +1;
                                year = loctime->tm_year + 1900;
                                hour = loctime->tm_hour;
                                minute = loctime->tm_min; 
                                second = loctime->tm_sec; 
-                               ConvertStreamtoFloat( data+i+8, 3, &currentpower_total );
-                               return_key=-1;
-                               for( j=0; j<num_return_keys; j++ )
-                               {
-                                  if(( (data+i+1)[0] == returnkeylist[j].key1 )&&((data+i+2)[0] == returnkeylist[j].key2)) {
-                                      return_key=j;
-                                      break;
-                                  }
-                               }
-                               if( return_key >= 0 )
+                               ConvertStreamtoFloat( record+8, 3, &currentpower_total );
+                               channel = LookupReturnKey( returnkeylist, returnkeyindex, record );
+                               if( channel != NULL )
                                    log_info("%d-%02d-%02d %02d:%02d:%02d %-20s = %.0f %-20s", year, month, day, hour, minute, second,
-                                             returnkeylist[return_key].description, currentpower_total/returnkeylist[return_key].divisor, 
-                                             returnkeylist[return_key].units );
+                                             channel->description, currentpower_total*channel->scale, 
+                                             channel->units );
                                else
                                    log_info("%d-%02d-%02d %02d:%02d:%02d NO DATA for %02x %02x = %.0f NO UNITS", year, month, day, hour,
-                                             minute, second, (data+i+1)[0], (data+i+1)[1], currentpower_total );
+                                             minute, second, (record+1)[0], (record+1)[1], currentpower_total );
                             }
-                            free( data );
+                            if( CloseStream( &stream ) < 0 )
+                                goto bad_stream;
                             break;
 
-                        case 6: // extract total energy collected today
-                            gtotal = (received[69] * 65536) + (received[68] * 256) + received[67];
-                            gtotal = gtotal / 1000;
-                            log_info("G total so far = %.2f kWh",gtotal);
+                        case sv_dtot: // extract total energy collected today
+                            gtotal = StreamValue( received+67, 3 );
+                            log_info("G total so far = %.2f kWh",gtotal/1000.0);
 
-                            dtotal = (received[84] * 256) + received[83];
+                            dtotal = StreamValue( received+83, 2 );
                             dtotal = dtotal / 1000;
                             log_info("E total today = %.2f kWh",dtotal);
                             break;        
 
-                        case 7: // extract 2nd address
-                            memcpy(address2,received+26,6);
+                        case sv_add2: // extract 2nd address
+                            memcpy(session->address2,received+26,6);
                             log_debug("address 2");
                             break;
                     
-                        case 8: // extract bluetooth channel
-                            memcpy(chan,received+22,1);
-                            log_debug("Bluetooth channel [%i]", chan[0]);
+                        case sv_chan: // extract bluetooth channel
+                            memcpy(session->chan,received+22,1);
+                            log_debug("Bluetooth channel [%i]", session->chan[0]);
                             break;
 
-                        case 12: // extract time strings $TIMESTRING
+                        case sv_timestring: // extract time strings $TIMESTRING
                             if(( received[60] == 0x6d )&&( received[61] == 0x23 ))
                             {
-                                memcpy(timestr,received+63,24);
+                                memcpy(session->timestr,received+63,24);
                                 log_debug("extracting timestring");
-                                memcpy(timeset,received+79,4);
+                                memcpy(session->timeset,received+79,4);
                                 idate=ConvertStreamtoTime( received+63,4, &idate );
                                 /* Allow delay for inverter to be slow */
                                 if( reporttime > idate ) {
                                    log_debug("delay [5 seconds]");
-                                   sleep( 5 );
+                                   engine_sleep( 5000 );
                                 }
                             }
                             else
                             {
-                                memcpy(timestr,received+63,24);
+                                memcpy(session->timestr,received+63,24);
                                 log_debug("bad extracting timestring");
                                 already_read=0;
-                                fseek( fp, returnpos, 0 );
-                                linenum = returnline;
+                                pc = returnpc;
                                 found=0;
-                                if( archdatalen > 0 )
-                                   free( archdatalist );
                                 archdatalen=0;
-                                strcpy( lineread, "" );
                                 failedbluetooth++;
                                 if( failedbluetooth > 10 )
-                                    exit(-1);
+                                    goto failed;
                                 goto start;
                                 //exit(-1);
                             }
                                     
                             break;
 
-                    case 17: // Test data
-                            data = ReadStream( &conf, &s, received, &rr, data, &datalen, last_sent, cc, &terminated, &togo );
-                            // printf( "\n" );
-                      
-                            free( data );
+                    case sv_testdata: // Test data
+                            OpenStream( &stream, conf, &session->reader, received, &rr, last_sent, cc, &terminated, &togo );
+                            if( CloseStream( &stream ) < 0 )
+                                goto bad_stream;
                             break;
                     
-                    case 18: // $ARCHIVEDATA1
+                    case sv_archivedata1: // $ARCHIVEDATA1
                         finished=0;
                         ptotal=0;
                         idate=0;
+                        window_first=1;
+                        window_end = window_read + ( conf->archive_window > 300 ? conf->archive_window : 300 ) - 300;
+                        if( window_end > range_to )
+                           window_end = range_to;
+                        if( archdatalen > 0 ) {
+                            // a later window follows on from the record kept as the dummy
+                            ptotal = archdatalist[archdatalen-1].accum_value;
+                            idate = archdatalist[archdatalen-1].date;
+                        }
                         // printf( "\n" );
                         while( finished != 1 ) {
-                            data = ReadStream( &conf, &s, received, &rr, data, &datalen, last_sent, cc, &terminated, &togo );
-
-                            j=0;
-                            for( i=0; i<datalen; i++ )
+                            OpenStream( &stream, conf, &session->reader, received, &rr, last_sent, cc, &terminated, &togo );
+                            framestart = archdatalen;
+                            for( i=0; ( record = StreamRecord( &stream, 12 )) != NULL; i++ )
                             {
-                               datarecord[j]=data[i];
-                               j++;
-                               if( j > 11 ) {
                                  if( idate > 0 ) prev_idate=idate;
                                  else prev_idate=0;
-                                 idate=ConvertStreamtoTime( datarecord, 4, &idate );
+                                 idate=ConvertStreamtoTime( record, 4, &idate );
                                  if( prev_idate == 0 )
                                     prev_idate = idate-300;
+                                 if( window_first ) {
+                                    // replies are only told apart by their dates, this one must answer
+                                    // the oldest window asked for and after a record start at its dummy
+                                    window_first = 0;
+                                    if(( archdatalen > 0 ) ? ( idate != window_read-300 )
+                                                           : (( idate < window_read-300 )||( idate > window_end ))) {
+                                       log_warning( "Reply from %ld is not for the archive window from %ld",
+                                                    (long)idate, (long)window_read );
+                                       archdatalen = framestart;
+                                       goto bad_stream;
+                                    }
+                                    if(( archdatalen > 0 )&&( idate <= archdatalist[archdatalen-1].date )) {
+                                       // the dummy at the start of a window, already have it
+                                       ptotal = archdatalist[archdatalen-1].accum_value;
+                                       continue;
+                                    }
+                                 }
 
-                                 loctime = localtime(&idate);
+                                 loctime = localtime_r(&idate, &loctm);
                                  day = loctime->tm_mday;
                                  month = loctime->tm_mon +1;
                                  year = loctime->tm_year + 1900;
                                  hour = loctime->tm_hour;
                                  minute = loctime->tm_min; 
                                  second = loctime->tm_sec; 
-                                 ConvertStreamtoFloat( datarecord+4, 8, &gtotal );
+                                 gtotal = StreamValue( record+4, 8 );
                                  if(archdatalen == 0 )
                                     ptotal = gtotal;
                                  log_info("%d/%d/%4d %02d:%02d:%02d  total=%.3f Kwh current=%.0f Watts togo=%d i=%d crc=%d", day,
-                                          month, year, hour, minute,second, gtotal/1000, (gtotal-ptotal)*12, togo, i, crc_at_end);
+                                          month, year, hour, minute,second, gtotal/1000.0, (double)(gtotal-ptotal)*12, togo, i, crc_at_end);
                                  if( idate != prev_idate+300 ) {
                                     log_error("Date Error! prev=%d current=%d\n", (int)prev_idate, (int)idate );
-                                    error=1;
-                                    break;
+                                    // ask again from what is committed rather than give up the poll
+                                    archdatalen = framestart;
+                                    goto bad_stream;
+                                 }
+                                 if( archdatalen == archdatasize ) {
+                                    // doubling keeps a long backfill at a handful of reallocs
+                                    archdatasize = archdatasize ? archdatasize*2 : ARCHIVE_CHUNK+1;
+                                    archdatalist = (struct archdata_type *)realloc( archdatalist, sizeof( struct archdata_type )*archdatasize );
                                  }
-                                 if( archdatalen == 0 )
-                                    archdatalist = (struct archdata_type *)malloc( sizeof( struct archdata_type ) );
-                                 else
-                                    archdatalist = (struct archdata_type *)realloc( archdatalist, sizeof( struct archdata_type )*(archdatalen+1));
                                  (archdatalist+archdatalen)->date=idate;
-                                 strcpy((archdatalist+archdatalen)->inverter,conf.Inverter);
-                                 ConvertStreamtoLong( serial, 4, &(archdatalist+archdatalen)->serial);
+                                 (archdatalist+archdatalen)->inverter=conf->Inverter;
+                                 ConvertStreamtoLong( session->serial, 4, &(archdatalist+archdatalen)->serial);
                                  (archdatalist+archdatalen)->accum_value=gtotal;
                                  (archdatalist+archdatalen)->current_value=(gtotal-ptotal)*12;
                                  archdatalen++;
                                  ptotal=gtotal;
-                                 j=0; //get ready for another record
-                              }
                            }
+                           if( CloseStream( &stream ) < 0 ) {
+                              // nothing of a bad frame is kept
+                              archdatalen = framestart;
+                              goto bad_stream;
+                           }
+                           if(( mysql == 1 )&&( archdatalen > ARCHIVE_CHUNK ))
+                              checkpoint = CommitArchiveData( archdatalist, &archdatalen, batch, 0 );
                            if( togo == 0 ) 
                               finished=1;
                            else
-                              if( read_bluetooth( conf.bt_timeout, s, &rr, received, cc, last_sent, &terminated ) != 0 )
+                              if( read_bluetooth( conf->bt_timeout, &session->reader, &rr, received, cc, last_sent, &terminated ) != 0 )
                               {
-                                 fseek( fp, returnpos, 0 );
-                                 linenum = returnline;
+                                 pc = returnpc;
                                  found=0;
-                                 if( archdatalen > 0 )
-                                    free( archdatalist );
+                                 // keep what came in, the retry carries on from there
+                                 if(( mysql == 1 )&&( error == 0 )
+                                    &&(( committed = CommitArchiveData( archdatalist, &archdatalen, batch, 1 )) > checkpoint )) {
+                                    checkpoint = committed;
+                                    failedbluetooth = 0;
+                                 }
                                  archdatalen=0;
-                                 strcpy( lineread, "" );
-                                 sleep(10);
+                                 DropOutstandingWindows( conf, session, &windows_out );
+                                 if( reused ) {
+                                    log_info( "Kept session rejected, logging on again" );
+                                    keepalive = reused = session->logged_on = 0;
+                                    pc = returnpc = session->setuppc;
+                                    goto start;
+                                 }
+                                 engine_sleep(10000);
                                  failedbluetooth++;
                                  if( failedbluetooth > 3 )
-                                   exit(-1);
+                                   goto failed;
                                  goto start;
                               }
                         }
-                        free( data );
-                        // printf( "\n" );
-                                  
+                        // one window done, keep it and go on with the next one
+                        windows_out--;
+                        window_read = window_end + 300;
+                        if(( mysql == 1 )&&( error == 0 )
+                           &&(( committed = CommitArchiveData( archdatalist, &archdatalen, batch, 0 )) > checkpoint ))
+                           checkpoint = committed;
+                        if(( error == 0 )&&(( windows_out > 0 )||( window_sent <= range_to ))) {
+                           next_window = 1;
+                           pc = requestpc - 1;
+                        }
                         break;
-                    case 20: // SIGNAL signal strength
+                    case sv_signal: // SIGNAL signal strength
                         strength  = (received[22] * 100.0)/0xff;
                         log_verbose("bluetooth signal [%.0f%%]",strength);
                         break;        
 
-                    case 22: // extract time strings $INVCODE
-                        invcode=received[22];
-                        log_debug("extracting invcode [%02x]", invcode);
+                    case sv_invcode: // extract time strings $INVCODE
+                        session->invcode=received[22];
+                        log_debug("extracting invcode [%02x]", session->invcode);
                         break;
 
-                    case 24: // Inverter data $INVERTERDATA
-                            data = ReadStream( &conf, &s, received, &rr, data, &datalen, last_sent, cc, &terminated, &togo );
-                            log_debug( "data=%02x",(data+3)[0] );
-                            if( (data+3)[0] == 0x08 )
-                                gap = 40; 
-                            if( (data+3)[0] == 0x10 )
-                                gap = 40; 
-                            if( (data+3)[0] == 0x40 )
-                                gap = 28;
-                            if( (data+3)[0] == 0x00 )
-                                gap = 28;
-                            for ( i = 0; i<datalen; i+=gap ) 
+                    case sv_inverterdata: // Inverter data $INVERTERDATA
+                            OpenStream( &stream, conf, &session->reader, received, &rr, last_sent, cc, &terminated, &togo );
+                            if(( record = StreamPeek( &stream, 4 )) != NULL ) {
+                                log_debug( "data=%02x",(record+3)[0] );
+                                if( (record+3)[0] == 0x08 )
+                                    gap = 40; 
+                                if( (record+3)[0] == 0x10 )
+                                    gap = 40; 
+                                if( (record+3)[0] == 0x40 )
+                                    gap = 28;
+                                if( (record+3)[0] == 0x00 )
+                                    gap = 28;
+                            }
+                            for( i=0; ( record = StreamRecord( &stream, gap )) != NULL; i++ )
                             {
-                               idate=ConvertStreamtoTime( data+i+4, 4, &idate );
-                               loctime = localtime(&idate);
+                               idate=ConvertStreamtoTime( record+4, 4, &idate );
+                               loctime = localtime_r(&idate, &loctm);
                                day = loctime->tm_mday;
                                month = loctime->tm_mon +1;
                                year = loctime->tm_year + 1900;
                                hour = loctime->tm_hour;
                                minute = loctime->tm_min; 
                                second = loctime->tm_sec; 
-                               ConvertStreamtoFloat( data+i+8, 3, &currentpower_total );
-                               return_key=-1;
-                               for( j=0; j<num_return_keys; j++ )
-                               {
-                                  if(( (data+i+1)[0] == returnkeylist[j].key1 )&&((data+i+2)[0] == returnkeylist[j].key2)) {
-                                      return_key=j;
-                                      break;
-                                  }
-                               }
-                               if( return_key >= 0 ) {
+                               ConvertStreamtoFloat( record+8, 3, &currentpower_total );
+                               channel = LookupReturnKey( returnkeylist, returnkeyindex, record );
+                               if( channel != NULL ) {
                                    if( i==0 )
-                                       log_info("%d-%02d-%02d  %02d:%02d:%02d %s", year, month, day, hour, minute, second, (data+i+8) );
+                                       log_info("%d-%02d-%02d  %02d:%02d:%02d %s", year, month, day, hour, minute, second, (record+8) );
                                     log_info("%d-%02d-%02d %02d:%02d:%02d %-20s = %.0f %-20s", year, month, day, hour, minute, second,
-                                             returnkeylist[return_key].description, currentpower_total/returnkeylist[return_key].divisor, 
-                                             returnkeylist[return_key].units );
+                                             channel->description, currentpower_total*channel->scale, 
+                                             channel->units );
                                }
                                else
                                    log_info("%d-%02d-%02d %02d:%02d:%02d NO DATA for %02x %02x = %.0f NO UNITS", 
-                                             year, month, day, hour, minute, second, (data+i+1)[0], (data+i+1)[0], currentpower_total );
+                                             year, month, day, hour, minute, second, (record+1)[0], (record+1)[0], currentpower_total );
                             }
-                            free( data );
+                            if( CloseStream( &stream ) < 0 )
+                                goto bad_stream;
+                    break;
+
+                    default :
                     break;
                     }                
                 }
-                    
-                while (strcmp(lineread,"$END"));
             } 
-            if(!strcmp(lineread,":init")){        //See if line is something we need to extract
+            if( op->type == so_label ){
+                if(!strcmp(op->label,":init")){
                        initstarted=1;
-                       returnpos=ftell(fp);
-               returnline = linenum;
-                    }
-            if(!strcmp(lineread,":setup")){        //See if line is something we need to extract
+                       returnpc = pc+1;
+                }
+                if(!strcmp(op->label,":keepalive")&&( keepalive == 0 )){
+                       // only for kept sessions, a fresh one logs on below
+                       pc = script_next_label( program, pc ) - 1;
+                }
+                else if(!strcmp(op->label,":setup")&&( keepalive == 1 )){
+                       // kept alive, skip the signal exchanges and the logon
+                       keepalive = 0;
+                       returnpc = session->setuppc;
+                       pc = script_next_label( program, pc ) - 1;
+                }
+                else if(!strcmp(op->label,":setup")){
                        setupstarted=1;
-                       returnpos=ftell(fp);
-               returnline = linenum;
-                    }
-            if(!strcmp(lineread,":startsetup")){        //See if line is something we need to extract
-                       sleep(1);
-                    }
-            if(!strcmp(lineread,":setinverter1")){        //See if line is something we need to extract
+                       returnpc = pc+1;
+                       session->setuppc = returnpc;
+                }
+                if(!strcmp(op->label,":startsetup")){
+                       engine_sleep(1000);
+                }
+                if(!strcmp(op->label,":setinverter1")){
                        setupstarted=1;
-                       returnpos=ftell(fp);
-               returnline = linenum;
-                    }
-            if(!strcmp(lineread,":getrangedata")){        //See if line is something we need to extract
+                       returnpc = pc+1;
+                }
+                if(!strcmp(op->label,":getrangedata")){
                        rangedatastarted=1;
-                       returnpos=ftell(fp);
-               returnline = linenum;
+                       returnpc = pc+1;
+                }
             }
-        }
     }
+    session->initialised = 1;
+    session->logged_on = 1;
 
-    if ((mysql ==1)&&(error==0)){
-    for( i=1; i<archdatalen; i++ ) //Start at 1 as the first record is a dummy
-        {
-      struct tm *interval;
-      interval = localtime( &((archdatalist+i)->date) );
-      db_set_interval_value( interval, (archdatalist+i)->inverter, (archdatalist+i)->serial, (archdatalist+i)->current_value, (archdatalist+i)->accum_value );
-        }
+    if ((mysql ==1)&&(error==0)&&(archdatalen > 1)){
+      // the batch keeps the rows until every inverter of this cycle is done
+      CommitArchiveData( archdatalist, &archdatalen, batch, 0 );
+    }
+    if( error )
+        result = 1;
+    goto done;
+
+bad_stream:
+    /* Corrupted or incomplete reply, ask for it again */
+    already_read=0;
+    pc = returnpc;
+    found=0;
+    if(( mysql == 1 )&&( error == 0 )
+       &&(( committed = CommitArchiveData( archdatalist, &archdatalen, batch, 1 )) > checkpoint )) {
+        checkpoint = committed;
+        failedbluetooth = 0;
     }
- 
-    close(s);
-    if( archdatalen > 0 )
+    archdatalen=0;
+    DropOutstandingWindows( conf, session, &windows_out );
+    failedbluetooth++;
+    if( failedbluetooth > 10 )
+        goto failed;
+    engine_sleep(1000);
+    goto start;
+
+failed:
+    result = -1;
+done:
+    // a session kept logged on must not hand these to the next poll
+    DropOutstandingWindows( conf, session, &windows_out );
     free( archdatalist );
     archdatalen=0;
     free(last_sent);
-    if ((post ==1)&&(mysql==1)&&(error==0)){
-      post_interval_data( conf.PVOutputURL, conf.PVOutputKey, conf.PVOutputSid, repost, datefrom, dateto, loglevel);
+    return result;
+}
+
+/* Look up today's sunrise/sunset, calculating and storing it if not yet in the db */
+void UpdateAlmanac( ConfType *conf )
+{
+    time_t curtime;
+    struct tm *loctime;
+    char sunrise_time[6],sunset_time[6];
+
+    curtime = time(NULL);
+    loctime = localtime( &curtime );
+    if( !db_fetch_almanac( loctime , sunrise_time, sunset_time ) ) {
+        sprintf( sunrise_time, "%s", sunrise(conf->latitude_f,conf->longitude_f ));
+        sprintf( sunset_time, "%s", sunset(conf->latitude_f, conf->longitude_f ));
+        db_update_almanac( loctime, sunrise_time, sunset_time );
+    }
+    log_verbose( "sunrise=%s sunset=%s", sunrise_time, sunset_time );
+}
+
+static volatile sig_atomic_t stop_daemon = 0;
+
+static void daemon_signal_handler( int signum )
+{
+    stop_daemon = 1;
+}
+
+/* Sleep until the next multiple of interval seconds, returns early when asked to stop */
+void SleepUntilNextPoll( int interval )
+{
+    time_t now = time(NULL);
+    time_t next = ( now / interval + 1 ) * interval;
+
+    log_verbose( "Next poll in %d seconds", (int)(next - now) );
+    while(( stop_daemon == 0 )&&( now < next )) {
+        sleep( next - now );
+        now = time(NULL);
+    }
+}
+
+/*
+ * Upload worker for daemon mode. It runs in its own process with its own
+ * database connection, so polling the inverter never waits on PVOutput.
+ * The poller writes an UploadNotice to the wakeup pipe for every inverter
+ * it has stored new intervals of; failed uploads are retried with
+ * exponential backoff. Data PVOutput rejects for good is parked by
+ * post_interval_data, so only what may still go through is retried.
+ */
+#define UPLOAD_BACKOFF_MIN 30
+#define UPLOAD_BACKOFF_MAX 3600
+
+/* Smaller than PIPE_BUF, so each one is written and read whole */
+typedef struct{
+    int  index;                     /* of the inverter in inverters */
+    long unsigned int serial;
+} UploadNotice;
+
+static void RunUploader( ConfType *inverters, int ninverters, int wakeup )
+{
+    pvoutput_p *pvoutputs = (pvoutput_p *)calloc( ninverters, sizeof( pvoutput_p ));
+    // the serials come from the poller, 0 until an inverter has been polled
+    long unsigned int *serials = (long unsigned int *)calloc( ninverters, sizeof( long unsigned int ));
+    int backoff = 0; // seconds to wait before retrying, 0 when not failing
+    int pending = 0; // what is left over from before goes with the first notice
+    UploadNotice notices[16];
+    int i, failed;
+
+    while(( pvoutputs != NULL )&&( serials != NULL )&&( stop_daemon == 0 )) {
+        if( pending ) {
+            pending = 0;
+            failed = 0;
+            for( i=0; i<ninverters; i++ ) {
+                if(( serials[i] != 0 )&&( PostInverterData( pvoutputs, inverters, i, serials[i], 0, "", "" ) != 0 ))
+                    failed = 1;
+            }
+            if( failed == 0 )
+                backoff = 0;
+            else {
+                backoff = ( backoff == 0 ) ? UPLOAD_BACKOFF_MIN : backoff * 2;
+                if( backoff > UPLOAD_BACKOFF_MAX )
+                    backoff = UPLOAD_BACKOFF_MAX;
+                log_warning( "Upload failed, retrying in %d seconds", backoff );
+            }
+        }
+
+        fd_set fds;
+        struct timeval tv = { backoff, 0 };
+        FD_ZERO( &fds );
+        FD_SET( wakeup, &fds );
+        int n = select( wakeup+1, &fds, NULL, NULL, ( backoff > 0 ) ? &tv : NULL );
+        if( n < 0 ) {
+            if( errno == EINTR )
+                continue;
+            break;
+        }
+        if( n == 0 ) {
+            pending = 1; // backoff is over
+            continue;
+        }
+        ssize_t len = read( wakeup, notices, sizeof( notices ));
+        if( len <= 0 )
+            break; // the poller has gone
+        for( i=0; i<len/(ssize_t)sizeof( UploadNotice ); i++ ) {
+            if(( notices[i].index >= 0 )&&( notices[i].index < ninverters )) {
+                serials[notices[i].index] = notices[i].serial;
+                // the poller may have written an earlier interval of a day cached here
+                db_forget_cached( notices[i].serial );
+            }
+        }
+        // while backing off new data waits for the retry
+        if( backoff == 0 )
+            pending = 1;
     }
+    for( i=0; ( pvoutputs != NULL )&&( i<ninverters ); i++ )
+        pvoutput_destructor( pvoutputs[i] );
+    free( pvoutputs );
+    free( serials );
+    db_close();
+}
+
+/* Forks the upload worker. Returns its pid and the write end of its wakeup pipe, -1 on failure */
+static pid_t StartUploader( ConfType *inverters, int ninverters, int *wakeup )
+{
+    int fds[2];
 
+    if( pipe( fds ) < 0 ) {
+        log_error( "Cannot create upload pipe: %s", strerror( errno ));
+        return -1;
+    }
+    fflush( NULL );
+    pid_t pid = fork();
+    if( pid < 0 ) {
+        log_error( "Cannot start uploader: %s", strerror( errno ));
+        close( fds[0] );
+        close( fds[1] );
+        return -1;
+    }
+    if( pid == 0 ) {
+        close( fds[1] );
+        RunUploader( inverters, ninverters, fds[0] );
+        exit( 0 );
+    }
+    close( fds[0] );
+    // a busy uploader must never block the poller
+    fcntl( fds[1], F_SETFL, O_NONBLOCK );
+    *wakeup = fds[1];
+    log_info( "Uploader started, pid %d", (int)pid );
+    return pid;
 }
+
+/*
+ * Forks a process playing conf->sim_inverters inverters on Unix sockets in a
+ * new directory simdir, and replaces the inverters of the config with them.
+ * Returns its pid, -1 on failure.
+ */
+static pid_t StartSimulator( ConfType *conf, ConfType **inverters, int *ninverters,
+                             sim_p **sims, char *simdir )
+{
+    int i, n = conf->sim_inverters;
+
+    strcpy( simdir, "/tmp/smasim.XXXXXX" );
+    if( mkdtemp( simdir ) == NULL ) {
+        log_error( "Cannot create simulator directory: %s", strerror( errno ));
+        return -1;
+    }
+    *sims = (sim_p *)calloc( n, sizeof( sim_p ));
+    *inverters = (ConfType *)realloc( *inverters, sizeof( ConfType )*n );
+    if(( *sims == NULL )||( *inverters == NULL ))
+        return -1;
+    // the sockets listen before the fork, a connection may come at once
+    for( i=0; i<n; i++ ) {
+        if(( (*sims)[i] = sim_constructor( i, simdir, conf->sim_latency, conf->sim_loss )) == NULL )
+            return -1;
+        (*inverters)[i] = *conf;
+        snprintf( (*inverters)[i].Transport, sizeof( conf->Transport ), "unix:%s", (*sims)[i]->path );
+        strcpy( (*inverters)[i].BTAddress, (*sims)[i]->btaddress );
+    }
+    *ninverters = n;
+    fflush( NULL );
+    pid_t pid = fork();
+    if( pid < 0 ) {
+        log_error( "Cannot start simulator: %s", strerror( errno ));
+        return -1;
+    }
+    if( pid == 0 ) {
+        // what the simulator sends and gets is not the poller's to capture
+        capture = NULL;
+        prctl( PR_SET_PDEATHSIG, SIGTERM );
+        sim_run( *sims, n );
+        exit( 0 );
+    }
+    log_info( "Simulating %d inverter(s) in %s, pid %d, latency %ld ms, loss %d%%",
+              n, simdir, (int)pid, conf->sim_latency, conf->sim_loss );
+    return pid;
+}
+
+/* Stops the simulator and removes its sockets */
+static void StopSimulator( pid_t pid, sim_p *sims, int n, char const *simdir )
+{
+    int i;
+
+    if( pid > 0 ) {
+        kill( pid, SIGTERM );
+        waitpid( pid, NULL, 0 );
+    }
+    for( i=0; i<n; i++ )
+        sim_destructor( sims[i] );
+    free( sims );
+    rmdir( simdir );
+}
+
+/* What the pollers of one cycle share. Each inverter has its own conf and session. */
+typedef struct{
+    int  next;                      /* next inverter to poll */
+    int  count;
+    ConfType *inverters;
+    SessionType *sessions;
+    int  *results;
+    script_p program;
+    ReturnType *returnkeylist;
+    unsigned short *returnkeyindex;
+    char *datefrom;
+    char *dateto;
+    int  daterange;
+    int  autodates;                 /* datefrom is worked out for each inverter */
+    int  mysql;
+    time_t reporttime;
+    IntervalBatch batch;
+} PollCycle;
+
+/* Polls inverters until none are left in this cycle, one engine task each */
+static void PollWorker( void *arg )
+{
+    PollCycle *cycle = (PollCycle *)arg;
+    int n, result;
+
+    for(;;) {
+        n = cycle->next++;
+        if( n >= cycle->count )
+            break;
+
+        ConfType *conf = &cycle->inverters[n];
+        SessionType *session = &cycle->sessions[n];
+        log_verbose( "Address %s",conf->BTAddress );
+        if(( session->s < 0 )&&( ConnectInverter( conf, session ) < 0 )) {
+            result = -1;
+        }
+        else {
+            result = PollInverter( conf, session, cycle->program, cycle->returnkeylist, cycle->returnkeyindex,
+                                   cycle->datefrom, cycle->dateto, cycle->daterange, cycle->autodates, cycle->mysql,
+                                   cycle->reporttime, &cycle->batch );
+            if( result < 0 )
+                DisconnectInverter( session );
+        }
+        cycle->results[n] = result;
+    }
+}
+
+/*
+ * Poll every inverter, at most conf->max_sessions at the same time, then store
+ * the interval values of all of them, and any left over from before, at once. The sessions share this thread,
+ * each waits for its socket in the engine, so a cycle takes as long as the
+ * slowest inverter. Returns the number of inverters polled successfully.
+ */
+static int RunPollCycle( ConfType *conf, engine_p engine, PollCycle *cycle )
+{
+    int ntasks = conf->max_sessions;
+    int i, ok = 0;
+
+    if( ntasks > cycle->count )
+        ntasks = cycle->count;
+    if( ntasks < 1 )
+        ntasks = 1;
+    // rows the last cycle could not store are still in the batch, they go again
+    cycle->next = 0;
+
+    for( i=0; i<ntasks; i++ ) {
+        if( engine_spawn( engine, PollWorker, cycle ) < 0 ) {
+            log_error( "Could not start poller task" );
+            break;
+        }
+    }
+    if( i == 0 )
+        PollWorker( cycle );
+    else
+        engine_run( engine );
+
+    FlushIntervalBatch( &cycle->batch );
+    for( i=0; i<cycle->count; i++ ) {
+        if( cycle->results[i] == 0 )
+            ok++;
+    }
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    script_p program;
+    pvoutput_p *pvoutputs = NULL;
+    pid_t uploader = -1;
+    int wakeup = -1;
+    ConfType conf;
+    ConfType *inverters = NULL;
+    SessionType *sessions;
+    PollCycle cycle;
+    engine_p engine;
+    int i, ninverters, polled;
+    pid_t simulator = -1;
+    sim_p *sims = NULL;
+    char simdir[40];
+    struct timeval started, finished;
+    ReturnType *returnkeylist = NULL;
+    int num_return_keys=0;
+    int mysql=0,post=0,repost=0,test=0,file=0,daterange=0;
+    int install=0, update=0, daemon_mode=0;
+    int location=0, result=0;
+    char datefrom[100];
+    char dateto[100];
+    time_t reporttime;
+    loglevel_t loglevel = ll_info;
+   
+    log_init();
+    log_info("Starting pvlogger");
+
+    // set config to defaults
+    InitConfig( &conf, datefrom, dateto );
+    // read command arguments needed so can get config
+    if( ReadCommandConfig( &conf, argc, argv, datefrom, dateto, &loglevel, 
+            &skip_daylight_check, &repost, &test, &install, &update, &daemon_mode) < 0 )
+        exit(0);
+    // read Config file
+    if( GetConfig( &conf ) < 0 )
+        exit(-1);
+    // read command arguments  again - they overide config
+    if( ReadCommandConfig( &conf, argc, argv, datefrom, dateto, &loglevel, 
+            &skip_daylight_check, &repost, &test, &install, &update, &daemon_mode) < 0 )
+        exit(0);
+    // Log level may have been reset by command line.
+    logging_set_loglevel(logger, loglevel);
+    if( logging_set_target( logger, conf.LogTarget ) < 0 )
+        log_error( "Cannot open log file %s: %s", conf.LogTarget, strerror( errno ));
+    // from here on a thread of its own writes the log
+    if( logging_start_async( logger ) < 0 )
+        log_warning( "Cannot start log writer, logging directly" );
+    if(( conf.Capture[0] != '\0' )&&(( capture = capture_constructor( conf.Capture, "w" )) == NULL ))
+        exit(-1);
+
+    // one conf per inverter, each with its own Inverter Setting
+    if(( ninverters = GetInverterSections( &conf, &inverters )) < 0 )
+        exit(-1);
+    // simulated inverters stand in for those of the config
+    if(( conf.sim_inverters > 0 )
+       &&(( simulator = StartSimulator( &conf, &inverters, &ninverters, &sims, simdir )) < 0 ))
+        exit(-1);
+    for( i=0; i<ninverters; i++ ) {
+        if( GetInverterSetting( &inverters[i] ) < 0 )
+            exit(-1);
+    }
+    // set switches used through the program
+    SetSwitches( &conf, datefrom, dateto, &location, &mysql, &post, &file, &daterange, &test );  
+    // the PVOutput system may be given per [inverter] section only
+    for( i=0; i<ninverters; i++ ) {
+        if( PVOutputConfigured( &inverters[i] ))
+            post=1;
+    }
+    
+    if(( install==1 )&&( mysql==1 )) {
+        db_init( conf.MySqlHost, conf.MySqlUser, conf.MySqlPwd, conf.MySqlDatabase );
+        int result = db_install_tables();
+        db_close();
+        exit(result);
+    }
+    if(( update==1 )&&( mysql==1 )) {
+        db_init( conf.MySqlHost, conf.MySqlUser, conf.MySqlPwd, conf.MySqlDatabase );
+        int result = 0; //db_update_schema( SCHEMA_VALUE ); //TODO implement this
+        db_close();
+        exit(result);
+    }
+
+    db_init( conf.MySqlHost, conf.MySqlUser, conf.MySqlPwd, conf.MySqlDatabase );
+
+    if( daemon_mode ) {
+        signal( SIGTERM, daemon_signal_handler );
+        signal( SIGINT, daemon_signal_handler );
+        // a dead uploader must not take the poller down with it
+        signal( SIGPIPE, SIG_IGN );
+        // before the database is opened, each process needs its own connection
+        if(( post==1 )&&( mysql==1 ))
+            uploader = StartUploader( inverters, ninverters, &wakeup );
+    }
+
+    if( mysql==1 ) {
+       if( db_get_schema() != SCHEMA_VALUE ) {
+            log_fatal( "Please Update database schema. Use --UPDATE" );
+            db_close();
+            exit(-1);
+       }
+    }
+    // Set value for inverter type
+    // SetInverterType( &conf );
+    // Get Return Value lookup from file
+    returnkeylist = InitReturnKeys( &conf, returnkeylist, &num_return_keys );
+
+    // Compile the command file once
+    if (file ==1)
+        program = script_constructor( conf.File );
+    else
+        program = script_constructor( "/etc/sma.in" );
+    if( program == NULL ) {
+        db_close();
+        exit(-1);
+    }
+
+    sessions = (SessionType *)calloc( ninverters, sizeof( SessionType ));
+    for( i=0; i<ninverters; i++ ) {
+        sessions[i].s = -1;
+        sessions[i].replay_fd = -1;
+    }
+    memset( &cycle, 0, sizeof( cycle ));
+    cycle.count = ninverters;
+    cycle.inverters = inverters;
+    cycle.sessions = sessions;
+    cycle.results = (int *)calloc( ninverters, sizeof( int ));
+    cycle.program = program;
+    cycle.returnkeylist = returnkeylist;
+    cycle.returnkeyindex = IndexReturnKeys( returnkeylist, num_return_keys );
+    if( cycle.returnkeyindex == NULL ) {
+        log_fatal( "No memory for the channel lookup" );
+        db_close();
+        exit(-1);
+    }
+    cycle.datefrom = datefrom;
+    cycle.dateto = dateto;
+    cycle.mysql = mysql;
+
+    if(( engine = engine_constructor()) == NULL ) {
+        db_close();
+        exit(-1);
+    }
+
+    if( daemon_mode )
+        log_info( "Running as daemon, polling %d inverter(s) every %d seconds", ninverters, conf.poll_interval );
+
+    do {
+        /* get the report time - used in various places */
+        reporttime = time(NULL);  //get time in seconds since epoch (1/1/1970)    
+        // Get Local Timezone offset in seconds
+        for( i=0; i<ninverters; i++ )
+            get_timezone_in_seconds( sessions[i].tzhex );
+        // Location based information to avoid quering Inverter in the dark
+        if((location==1)&&(mysql==1))
+            UpdateAlmanac( &conf );
+        cycle.autodates = ( daterange == 0 );
+        if(daterange==0 ) //auto set the dates
+            auto_set_dates( &daterange, datefrom, dateto );
+        else
+            log_verbose( "QUERY RANGE    from %s to %s", datefrom, dateto ); 
+    
+        int isLight = is_light();
+        log_verbose("is_light() =  %u",isLight );
+    
+        if(( daterange==1 )&&((location==0)||(mysql==0)||isLight)) {
+            cycle.daterange = daterange;
+            cycle.reporttime = reporttime;
+            gettimeofday( &started, NULL );
+            polled = RunPollCycle( &conf, engine, &cycle );
+            gettimeofday( &finished, NULL );
+            log_verbose( "Polled %d of %d inverter(s) in %.3f s", polled, ninverters,
+                         ( finished.tv_sec - started.tv_sec ) + ( finished.tv_usec - started.tv_usec ) / 1e6 );
+            result = 0;
+            for( i=0; i<ninverters; i++ ) {
+                if( cycle.results[i] < result )
+                    result = cycle.results[i];
+            }
+            if ((post ==1)&&(mysql==1)&&(polled > 0)){
+              for( i=0; i<ninverters; i++ ) {
+                  if( cycle.results[i] != 0 )
+                      continue;
+                  if( uploader > 0 ) {
+                      // the uploader posts in the background
+                      UploadNotice notice = { i, SessionSerial( &sessions[i] ) };
+                      if(( write( wakeup, &notice, sizeof( notice )) < 0 )&&( errno != EAGAIN ))
+                          log_warning( "Uploader is not running" );
+                  }
+                  else {
+                      if( pvoutputs == NULL )
+                          pvoutputs = (pvoutput_p *)calloc( ninverters, sizeof( pvoutput_p ));
+                      if( pvoutputs != NULL )
+                          PostInverterData( pvoutputs, inverters, i, SessionSerial( &sessions[i] ), repost, datefrom, dateto );
+                  }
+              }
+            }
+        }
+        else {
+            // let the inverters sleep overnight
+            for( i=0; i<ninverters; i++ )
+                DisconnectInverter( &sessions[i] );
+        }
+
+        if( daemon_mode ) {
+            // only the first poll uses a date range from the command line
+            datefrom[0] = '\0';
+            dateto[0] = '\0';
+            daterange = 0;
+            logging_flush( logger );
+            SleepUntilNextPoll( conf.poll_interval );
+        }
+    } while( daemon_mode && ( stop_daemon == 0 ));
+
+    for( i=0; i<ninverters; i++ )
+        DisconnectInverter( &sessions[i] );
+    free( sessions );
+    free( cycle.results );
+    if( cycle.batch.count > 0 )
+        log_error( "Lost %d interval values that could not be stored", cycle.batch.count );
+    free( cycle.batch.rows );
+    for( i=0; ( pvoutputs != NULL )&&( i<ninverters ); i++ )
+        pvoutput_destructor( pvoutputs[i] );
+    free( pvoutputs );
+    free( inverters );
+    engine_destructor( engine );
+    if( sims != NULL )
+        StopSimulator( simulator, sims, conf.sim_inverters, simdir );
+    if( uploader > 0 ) {
+        // closing the pipe tells the uploader to finish
+        close( wakeup );
+        waitpid( uploader, NULL, 0 );
+    }
+    script_destructor( program );
   db_close();
   /* Clean up memory alloc. */
   free(returnkeylist);
+  free(cycle.returnkeyindex);
+  capture_destructor(capture);
 
+  if( result < 0 )
+      exit(-1);
   return 0;
 }